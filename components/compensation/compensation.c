@@ -0,0 +1,81 @@
+#include "compensation.h"
+
+#include "ah_table.h"
+
+#if CONFIG_COMPENSATION_BENCHMARK
+#include <math.h>
+#include <stdlib.h>
+#include "esp_cpu.h"
+#include "esp_log.h"
+
+#define BENCHMARK_ITERATIONS 1000
+
+static const char *TAG = "COMPENSATION";
+#endif
+
+uint16_t compensation_absolute_humidity(int32_t temperature_centi, uint32_t humidity_centi) {
+    if (temperature_centi < AH_TABLE_TEMP_MIN_CENTI) temperature_centi = AH_TABLE_TEMP_MIN_CENTI;
+    if (temperature_centi > AH_TABLE_TEMP_MAX_CENTI) temperature_centi = AH_TABLE_TEMP_MAX_CENTI;
+    if (humidity_centi > 10000) humidity_centi = 10000;
+
+    //Linear interpolation between the two table entries either side of the temperature
+    uint32_t offset = (uint32_t)(temperature_centi - AH_TABLE_TEMP_MIN_CENTI);
+    uint32_t index = offset >> AH_TABLE_STEP_SHIFT;
+    uint32_t frac = offset & ((1u << AH_TABLE_STEP_SHIFT) - 1);
+    uint32_t entry = ah_table[index] + (((ah_table[index + 1] - ah_table[index]) * frac) >> AH_TABLE_STEP_SHIFT);
+
+    //Entries are scaled so that scaling by the humidity and shifting leaves 8.8 fixed point g/m^3
+    uint32_t value = (uint32_t)(((uint64_t)humidity_centi * entry + (1u << (AH_TABLE_FRAC_SHIFT - 1))) >> AH_TABLE_FRAC_SHIFT);
+
+    if (value < 1) value = 1;
+    if (value > 0xFFFF) value = 0xFFFF;
+    return (uint16_t)value;
+}
+
+#if CONFIG_COMPENSATION_BENCHMARK
+//The float path this component replaced, from raw SHT3X ticks to the SGP30 word
+static uint16_t float_reference(uint16_t raw_temp, uint16_t raw_humidity) {
+    float temp = -45.0f + 175.0f * (((float)raw_temp) / 65535.0f);
+    float humidity = 100.0f * ((float)raw_humidity / 65535.0f);
+    float ah = 216.7f * (((humidity/100.0f) * 6.112f * expf((17.62f * temp) / (243.12f + temp))) / (273.15f + temp));
+
+    if (ah < 1.0f/256.0f) ah = 1.0f/256.0f;
+    if (ah > 255.99609375f) ah = 255.99609375f;
+    return (uint16_t)(ah * 256.0f + 0.5f);
+}
+
+//The fixed point path, using the same conversions as the SHT3X driver
+static uint16_t fixed_point(uint16_t raw_temp, uint16_t raw_humidity) {
+    int32_t temp_centi = (int32_t)((17500u * raw_temp + 32767u) / 65535u) - 4500;
+    uint32_t humidity_centi = (10000u * raw_humidity + 32767u) / 65535u;
+    return compensation_absolute_humidity(temp_centi, humidity_centi);
+}
+
+void compensation_benchmark(void) {
+    volatile uint16_t sink = 0;
+    uint32_t max_error = 0;
+
+    uint32_t start = esp_cpu_get_cycle_count();
+    for (uint32_t i = 0; i < BENCHMARK_ITERATIONS; i++) {
+        sink = float_reference((uint16_t)(i * 65), (uint16_t)(i * 47));
+    }
+    uint32_t float_cycles = esp_cpu_get_cycle_count() - start;
+
+    start = esp_cpu_get_cycle_count();
+    for (uint32_t i = 0; i < BENCHMARK_ITERATIONS; i++) {
+        sink = fixed_point((uint16_t)(i * 65), (uint16_t)(i * 47));
+    }
+    uint32_t fixed_cycles = esp_cpu_get_cycle_count() - start;
+    (void)sink;
+
+    for (uint32_t i = 0; i < BENCHMARK_ITERATIONS; i++) {
+        int32_t diff = (int32_t)float_reference((uint16_t)(i * 65), (uint16_t)(i * 47)) - fixed_point((uint16_t)(i * 65), (uint16_t)(i * 47));
+        if ((uint32_t)abs(diff) > max_error) max_error = abs(diff);
+    }
+
+    ESP_LOGI(TAG, "Float: %lu cycles, fixed point: %lu cycles per conversion, max difference %lu/256 g/m^3",
+            (unsigned long)(float_cycles / BENCHMARK_ITERATIONS),
+            (unsigned long)(fixed_cycles / BENCHMARK_ITERATIONS),
+            (unsigned long)max_error);
+}
+#endif
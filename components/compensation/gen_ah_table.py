@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+"""Generates the absolute humidity lookup table used by compensation.c and checks its accuracy.
+
+The table holds 216.7 * 6.112 * exp(17.62 T / (243.12 + T)) / (273.15 + T), the absolute humidity in g/m^3
+at 100 %RH, over the full SHT3X range in steps of 1.28 degC. compensation.c interpolates between entries and
+scales by the relative humidity without any floating point.
+
+The integer pipeline (raw SHT3X ticks -> centi units -> SGP30 8.8 word) is modelled here bit for bit and
+compared with the float reference over the whole sensor range. The build fails if the error exceeds the
+limit, so a change to the table layout or the firmware math can't silently lose accuracy.
+
+Usage: gen_ah_table.py <output header>
+"""
+
+import math
+import sys
+
+TEMP_MIN_CENTI = -4500      # SHT3X range is -45 to 130 degC
+TEMP_MAX_CENTI = 13000
+STEP_SHIFT = 7              # 128 centi-degrees between entries
+FRAC_SHIFT = 20             # Entries are g/m^3 * 256 * 2^20 / 10000, so AH_8.8 = (RH_centi * entry) >> 20
+
+ENTRIES = ((TEMP_MAX_CENTI - TEMP_MIN_CENTI) >> STEP_SHIFT) + 2
+
+MAX_ERROR_LSB = 1           # Limit in 1/256 g/m^3 over the whole range
+MAX_ERROR_RELATIVE = 0.002  # Or 0.2 % of the reading, whichever is larger
+
+
+def ah_at_saturation(temp):
+    return 216.7 * 6.112 * math.exp((17.62 * temp) / (243.12 + temp)) / (273.15 + temp)
+
+
+def build_table():
+    table = []
+    for i in range(ENTRIES):
+        temp = (TEMP_MIN_CENTI + (i << STEP_SHIFT)) / 100.0
+        table.append(round(ah_at_saturation(temp) * 256 * (1 << FRAC_SHIFT) / 10000))
+    assert max(table) < (1 << 32)
+    # The interpolation multiplies an entry difference by a 7 bit fraction in 32 bits
+    assert max(b - a for a, b in zip(table, table[1:])) << STEP_SHIFT < (1 << 32)
+    return table
+
+
+# Mirrors sht3x_controller.c
+def temp_centi_from_raw(raw):
+    return (17500 * raw + 32767) // 65535 - 4500
+
+
+def humidity_centi_from_raw(raw):
+    return (10000 * raw + 32767) // 65535
+
+
+# Mirrors compensation_absolute_humidity()
+def ah_q8(table, temp_centi, humidity_centi):
+    temp_centi = min(max(temp_centi, TEMP_MIN_CENTI), TEMP_MAX_CENTI)
+    offset = temp_centi - TEMP_MIN_CENTI
+    index = offset >> STEP_SHIFT
+    frac = offset & ((1 << STEP_SHIFT) - 1)
+    entry = table[index] + (((table[index + 1] - table[index]) * frac) >> STEP_SHIFT)
+    value = (humidity_centi * entry + (1 << (FRAC_SHIFT - 1))) >> FRAC_SHIFT
+    return min(max(value, 1), 0xFFFF)
+
+
+# The original float path
+def ah_q8_reference(temp, humidity):
+    ah = (humidity / 100.0) * ah_at_saturation(temp)
+    ah = min(max(ah, 1.0 / 256.0), 255.99609375)
+    return int(ah * 256.0 + 0.5)
+
+
+def check_accuracy(table):
+    # Conversions from raw ticks must round to the nearest centi unit, checked on every possible reading
+    for raw in range(65536):
+        temp = -45.0 + 175.0 * (raw / 65535.0)
+        humidity = 100.0 * (raw / 65535.0)
+        if abs(temp_centi_from_raw(raw) - temp * 100.0) > 0.5 or abs(humidity_centi_from_raw(raw) - humidity * 100.0) > 0.5:
+            sys.exit("gen_ah_table: raw %d converts to %d / %d centi" % (raw, temp_centi_from_raw(raw), humidity_centi_from_raw(raw)))
+
+    # Absolute humidity against the float reference over the full temperature and humidity range
+    worst = 0
+    for temp_centi in range(TEMP_MIN_CENTI, TEMP_MAX_CENTI + 1, 11):
+        for humidity_centi in range(0, 10001, 41):
+            expected = ah_q8_reference(temp_centi / 100.0, humidity_centi / 100.0)
+            actual = ah_q8(table, temp_centi, humidity_centi)
+            error = abs(actual - expected)
+            if error > max(MAX_ERROR_LSB, expected * MAX_ERROR_RELATIVE):
+                sys.exit("gen_ah_table: %d centi-degC %d centi-%%RH gives %d, expected %d"
+                         % (temp_centi, humidity_centi, actual, expected))
+            worst = max(worst, error)
+    return worst
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit(__doc__)
+
+    table = build_table()
+    worst = check_accuracy(table)
+
+    lines = [
+        "/* Generated by gen_ah_table.py, do not edit */",
+        "",
+        "#pragma once",
+        "",
+        "#include <stdint.h>",
+        "",
+        "#define AH_TABLE_TEMP_MIN_CENTI %d" % TEMP_MIN_CENTI,
+        "#define AH_TABLE_TEMP_MAX_CENTI %d" % TEMP_MAX_CENTI,
+        "#define AH_TABLE_STEP_SHIFT %d" % STEP_SHIFT,
+        "#define AH_TABLE_FRAC_SHIFT %d" % FRAC_SHIFT,
+        "#define AH_TABLE_ENTRIES %d" % ENTRIES,
+        "",
+        "/* Worst case error against the float reference for 0.01 unit inputs: %d / 256 g/m^3 */" % worst,
+        "static const uint32_t ah_table[AH_TABLE_ENTRIES] = {",
+    ]
+    for i in range(0, len(table), 6):
+        lines.append("    " + " ".join("%u," % v for v in table[i:i + 6]))
+    lines += ["};", ""]
+
+    with open(sys.argv[1], "w") as out:
+        out.write("\n".join(lines))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "compensation.h"
+
+//Same limit as gen_ah_table.py: 1/256 g/m^3 or 0.2 % of the reading, whichever is larger
+#define MAX_ERROR_LSB 1.0
+#define MAX_ERROR_RELATIVE 0.002
+
+//Raw SHT3X humidity ticks are stepped through this far apart, every raw temperature is covered
+#define RAW_HUMIDITY_STEP 7
+
+typedef struct {
+    const char *name;
+    double worst;               //Largest error in 1/256 g/m^3
+    double worst_expected;      //Reference value where it occurred
+    double temperature;
+    double humidity;
+    unsigned long failures;
+} error_stats_t;
+
+//Absolute humidity at 100 %RH in 1/256 g/m^3, in double precision
+static double saturation_q8(double temperature) {
+    return 256.0 * 216.7 * 6.112 * exp((17.62 * temperature) / (243.12 + temperature)) / (273.15 + temperature);
+}
+
+//The float formula the firmware replaced, with the same clamp to the SGP30 range and rounding to the word
+static double reference_q8(double saturation, double humidity) {
+    double value = humidity / 100.0 * saturation;
+    if (value < 1.0) value = 1.0;
+    if (value > 65535.0) value = 65535.0;
+    return floor(value + 0.5);
+}
+
+//slack widens the limit by what the formula moves over the rounding of the inputs ahead of the function
+static void add_error(error_stats_t *stats, double temperature, double humidity, double expected, double slack, uint16_t actual) {
+    double error = fabs(actual - expected);
+
+    if (error > stats->worst) {
+        stats->worst = error;
+        stats->worst_expected = expected;
+        stats->temperature = temperature;
+        stats->humidity = humidity;
+    }
+    if (error > fmax(MAX_ERROR_LSB, expected * MAX_ERROR_RELATIVE) + slack) {
+        if (stats->failures++ < 10) {
+            printf("FAIL: %s %.3f degC %.3f %%RH gives %u, expected %.1f\n", stats->name, temperature, humidity, actual, expected);
+        }
+    }
+}
+
+static void report(const error_stats_t *stats) {
+    printf("%s: worst %.2f/256 g/m^3 (%.3f %%) at %.3f degC %.3f %%RH\n", stats->name, stats->worst,
+            100.0 * stats->worst / stats->worst_expected, stats->temperature, stats->humidity);
+}
+
+//Every input compensation_absolute_humidity() can get, in 0.01 units over the SHT3X range
+static void check_centi_inputs(error_stats_t *stats) {
+    for (int32_t temperature_centi = -4500; temperature_centi <= 13000; temperature_centi++) {
+        double saturation = saturation_q8(temperature_centi / 100.0);
+        for (uint32_t humidity_centi = 0; humidity_centi <= 10000; humidity_centi++) {
+            double expected = reference_q8(saturation, humidity_centi / 100.0);
+            add_error(stats, temperature_centi / 100.0, humidity_centi / 100.0, expected, 0.0,
+                    compensation_absolute_humidity(temperature_centi, humidity_centi));
+        }
+    }
+}
+
+//The whole path from raw SHT3X ticks, through the driver's rounding to 0.01 units, against the float formula on
+//the unrounded reading. Up to half a unit of temperature and humidity is lost before the function runs, which
+//adds to the interpolation error where the curve is steepest.
+static void check_raw_ticks(error_stats_t *stats) {
+    for (uint32_t raw_temperature = 0; raw_temperature <= 0xFFFF; raw_temperature++) {
+        double temperature = -45.0 + 175.0 * (raw_temperature / 65535.0);
+        double saturation = saturation_q8(temperature);
+        double saturation_step = saturation_q8(temperature + 0.005) - saturation;
+        int32_t temperature_centi = (int32_t)((17500u * raw_temperature + 32767u) / 65535u) - 4500;
+
+        for (uint32_t raw_humidity = 0; raw_humidity <= 0xFFFF; raw_humidity += RAW_HUMIDITY_STEP) {
+            double humidity = 100.0 * (raw_humidity / 65535.0);
+            uint32_t humidity_centi = (10000u * raw_humidity + 32767u) / 65535u;
+            //Half a unit of each input, plus the reference's own rounding to the word
+            double slack = (saturation_step * (humidity + 0.005) + saturation * 0.005) / 100.0 + 0.5;
+            add_error(stats, temperature, humidity, reference_q8(saturation, humidity), slack,
+                    compensation_absolute_humidity(temperature_centi, humidity_centi));
+        }
+    }
+}
+
+int main(void) {
+    error_stats_t centi = { .name = "0.01 unit inputs" };
+    error_stats_t raw = { .name = "raw SHT3X ticks" };
+
+    check_centi_inputs(&centi);
+    check_raw_ticks(&raw);
+    report(&centi);
+    report(&raw);
+
+    if (centi.failures || raw.failures) {
+        printf("%lu failures\n", centi.failures + raw.failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
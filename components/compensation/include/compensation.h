@@ -0,0 +1,36 @@
+/**
+* @file compensation.h
+* @brief Fixed point humidity compensation for the SGP30
+*
+* Converts a temperature and relative humidity reading into the 8.8 fixed point absolute humidity word the
+* SGP30 uses for its humidity compensation. The exponential in the saturation vapour pressure comes from a
+* lookup table generated at build time by gen_ah_table.py, which also checks the result against the float
+* formula over the full SHT3X range. No floating point is used, the ESP32-C6 has no FPU.
+*
+* host_test measures the compiled function against the formula in double precision. It stays within 1/256 g/m^3
+* or 0.2 % of the reading, whichever is larger, on every 0.01 unit input, at most 17/256 g/m^3 near 75 degC and
+* saturation. From raw SHT3X ticks the driver's rounding to 0.01 units adds to that where the curve is steepest,
+* up to 36/256 g/m^3 (0.06 %) near 130 degC and 14/256 g/m^3 between 0 and 50 degC.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+/**
+* @brief Calculates the absolute humidity
+*
+* @param temperature_centi Temperature in 0.01 degC, clamped to the SHT3X range of -45 to 130 degC
+* @param humidity_centi Relative humidity in 0.01 %RH
+* @return uint16_t Absolute humidity in 1/256 g/m^3, clamped to the 1 to 0xFFFF range accepted by the SGP30
+*/
+uint16_t compensation_absolute_humidity(int32_t temperature_centi, uint32_t humidity_centi);
+
+#if CONFIG_COMPENSATION_BENCHMARK
+/**
+* @brief Times the fixed point path against the float formula it replaces and logs the cycle counts
+*/
+void compensation_benchmark(void);
+#endif
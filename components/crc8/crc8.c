@@ -1,19 +1,27 @@
 #include "crc8.h"
 
+#include "crc8_table.h"
+
+#define CRC8_INIT 0xFF
+
 uint8_t crc8(const uint8_t *data, size_t length) {
-    uint8_t crc = 0xFF;
-    uint8_t polynomial = 0x31;
+    uint8_t crc = CRC8_INIT;
 
     for(size_t i = 0; i < length; i++) {
-        crc ^= data[i];
-        for(int bit = 0; bit < 8; bit++) {
-            if(crc & 0x80) {
-                crc = (crc << 1) ^ polynomial;
-            }
-            else {
-                crc <<= 1;
-            }
-        }
+        crc = crc8_table[crc ^ data[i]];
     }
     return crc;
 }
+
+bool crc8_decode_words(const uint8_t *buf, uint16_t *words, size_t word_count) {
+    if(!buf || !words) return false;
+
+    //Each word is two data bytes followed by their crc
+    for(size_t i = 0; i < word_count; i++, buf += CRC8_WORD_SIZE) {
+        if(crc8_table[crc8_table[CRC8_INIT ^ buf[0]] ^ buf[1]] != buf[2]) {
+            return false;
+        }
+        words[i] = (buf[0] << 8) | buf[1];
+    }
+    return true;
+}
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "crc8.h"
+
+#define CRC8_POLYNOMIAL 0x31
+#define CRC8_INIT 0xFF
+
+//Bit at a time, straight from the datasheet definition, independent of the generated table
+static uint8_t crc8_bitwise(const uint8_t *data, size_t length) {
+    uint8_t crc = CRC8_INIT;
+
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ CRC8_POLYNOMIAL) : (uint8_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+static int failures = 0;
+
+static void fail(const char *what, unsigned value) {
+    if (failures++ < 10) printf("FAIL: %s 0x%04X\n", what, value);
+}
+
+//The datasheet example, 0xBEEF -> 0x92
+static void check_datasheet_example(void) {
+    const uint8_t word[] = { 0xBE, 0xEF, 0x92 };
+    uint16_t decoded;
+
+    if (crc8_bitwise(word, 2) != 0x92) fail("bitwise reference, datasheet example", 0xBEEF);
+    if (crc8(word, 2) != 0x92) fail("crc8, datasheet example", 0xBEEF);
+    if (!crc8_decode_words(word, &decoded, 1) || decoded != 0xBEEF) fail("crc8_decode_words, datasheet example", 0xBEEF);
+}
+
+//Every possible 2-byte word, the unit every Sensirion transfer is protected in. A word with the right crc must
+//decode and one with any other crc must be rejected.
+static void check_words(void) {
+    for (unsigned value = 0; value <= 0xFFFF; value++) {
+        uint8_t word[CRC8_WORD_SIZE] = { value >> 8, value & 0xFF, 0 };
+        uint16_t decoded = 0;
+
+        word[2] = crc8_bitwise(word, 2);
+        if (crc8(word, 2) != word[2]) fail("crc8", value);
+        if (!crc8_decode_words(word, &decoded, 1) || decoded != value) fail("crc8_decode_words", value);
+
+        word[2] ^= 1u << (value % 8);
+        if (crc8_decode_words(word, &decoded, 1)) fail("crc8_decode_words accepted a bad crc", value);
+    }
+}
+
+//Longer buffers, as the state store uses crc8() over whole blobs, and multi word reads with one bad crc
+static void check_buffers(void) {
+    uint8_t data[64];
+    uint16_t words[4];
+    uint32_t seed = 1;
+
+    for (unsigned round = 0; round < 10000; round++) {
+        size_t length = round % sizeof(data);
+        for (size_t i = 0; i < length; i++) {
+            seed = seed * 1103515245u + 12345u;
+            data[i] = seed >> 16;
+        }
+        if (crc8(data, length) != crc8_bitwise(data, length)) fail("crc8 over a buffer of length", (unsigned)length);
+    }
+
+    uint8_t buf[4 * CRC8_WORD_SIZE];
+    for (size_t i = 0; i < 4; i++) {
+        buf[i * CRC8_WORD_SIZE] = 0x12 * (i + 1);
+        buf[i * CRC8_WORD_SIZE + 1] = 0x34 * (i + 1);
+        buf[i * CRC8_WORD_SIZE + 2] = crc8_bitwise(&buf[i * CRC8_WORD_SIZE], 2);
+    }
+    if (!crc8_decode_words(buf, words, 4)) fail("crc8_decode_words over 4 words", 0);
+    for (size_t i = 0; i < 4; i++) {
+        if (words[i] != (((0x12 * (i + 1)) & 0xFF) << 8 | ((0x34 * (i + 1)) & 0xFF))) fail("crc8_decode_words word", (unsigned)i);
+    }
+    buf[3 * CRC8_WORD_SIZE + 2] ^= 0x01;
+    if (crc8_decode_words(buf, words, 4)) fail("crc8_decode_words accepted a bad crc in the last word", 3);
+    if (crc8_decode_words(NULL, words, 1) || crc8_decode_words(buf, NULL, 1)) fail("NULL buffer accepted", 0);
+}
+
+int main(void) {
+    check_datasheet_example();
+    check_words();
+    check_buffers();
+
+    if (failures) {
+        printf("%d failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("crc8: all 65536 words match the bitwise reference\n");
+    return EXIT_SUCCESS;
+}
@@ -1,12 +1,18 @@
 /**
 * @file crc8.h
 * @brief Crc8 algorithm helper component
+*
+* Table driven, the 256 entry table is generated and checked against the bitwise algorithm at build time
+* by gen_crc8_table.py. host_test checks the compiled functions the same way on the build machine.
 */
 
 #pragma once
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
+
+#define CRC8_WORD_SIZE 3        /*!< A Sensirion data word on the wire: two data bytes and their crc */
 
 /**
 * @brief Crc8 calculation function. Initial value 0xFF polynomial 0x31
@@ -16,3 +22,13 @@
 * @return uint8_t Result of the crc8 calculation
 */
 uint8_t crc8(const uint8_t *data, size_t length);
+
+/**
+* @brief Checks the crc of every word in a buffer read from a Sensirion sensor and decodes the words in the same pass
+*
+* @param buf Pointer to the buffer, word_count * CRC8_WORD_SIZE bytes
+* @param words Pointer to the buffer that receives the decoded words, only complete if every crc matches
+* @param word_count The number of words in the buffer
+* @return bool True if every word's crc matches
+*/
+bool crc8_decode_words(const uint8_t *buf, uint16_t *words, size_t word_count);
@@ -0,0 +1,96 @@
+#include "diagnostics.h"
+
+#include <stdio.h>
+#include "esp_system.h"
+#include "esp_timer.h"
+
+atomic_uint_fast32_t diagnostics_counters[DIAG_COUNTER_COUNT];
+atomic_uint_fast32_t diagnostics_gauges[DIAG_GAUGE_COUNT];
+
+static const char *const COUNTER_NAMES[DIAG_COUNTER_COUNT] = {
+    [DIAG_SGP30_I2C_ERRORS] = "sgp30_i2c_errors",
+    [DIAG_SGP30_CRC_ERRORS] = "sgp30_crc_errors",
+    [DIAG_SHT3X_I2C_ERRORS] = "sht3x_i2c_errors",
+    [DIAG_SHT3X_CRC_ERRORS] = "sht3x_crc_errors",
+    [DIAG_PUBLISH_FAILURES] = "publish_failures",
+    [DIAG_STATE_STORE_ERRORS] = "state_store_errors",
+    [DIAG_CYCLE_OVERRUNS] = "cycle_overruns",
+    [DIAG_OUTBOX_REFUSED] = "outbox_refused",
+    [DIAG_OUTBOX_DROPPED] = "outbox_dropped",
+    [DIAG_WIFI_DISCONNECTS] = "wifi_disconnects",
+};
+
+static const char *const GAUGE_NAMES[DIAG_GAUGE_COUNT] = {
+    [DIAG_SAMPLES_DROPPED] = "samples_dropped",
+    [DIAG_STORE_PENDING] = "store_pending",
+    [DIAG_CYCLE_JITTER_MAX_US] = "cycle_jitter_max_us",
+    [DIAG_CYCLE_JITTER_P99_US] = "cycle_jitter_p99_us",
+    [DIAG_OUTBOX_BYTES] = "outbox_bytes",
+    [DIAG_OUTBOX_PEAK_BYTES] = "outbox_peak_bytes",
+    [DIAG_PUBACK_LATENCY_MAX_MS] = "puback_latency_max_ms",
+    [DIAG_PUBACK_LATENCY_P99_MS] = "puback_latency_p99_ms",
+    [DIAG_FIRST_SAMPLE_MS] = "first_sample_ms",
+    [DIAG_WIFI_CONNECT_MS] = "wifi_connect_ms",
+    [DIAG_WIFI_CONNECT_MAX_MS] = "wifi_connect_max_ms",
+};
+
+//Slots are claimed with a compare and swap from NULL, so registering never takes a lock
+static _Atomic(TaskHandle_t) tasks[DIAGNOSTICS_MAX_TASKS];
+
+esp_err_t diagnostics_register_task(TaskHandle_t task) {
+    if (!task) return ESP_ERR_INVALID_ARG;
+
+    for (size_t i = 0; i < DIAGNOSTICS_MAX_TASKS; i++) {
+        TaskHandle_t expected = NULL;
+        if (atomic_compare_exchange_strong(&tasks[i], &expected, task)) return ESP_OK;
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+void diagnostics_unregister_task(TaskHandle_t task) {
+    for (size_t i = 0; i < DIAGNOSTICS_MAX_TASKS; i++) {
+        TaskHandle_t expected = task;
+        if (atomic_compare_exchange_strong(&tasks[i], &expected, NULL)) return;
+    }
+}
+
+//Appends to the buffer, returns false once it is full
+static bool append(char *buf, size_t size, int *len, int written) {
+    if (written < 0 || (size_t)written >= size - *len) return false;
+    *len += written;
+    return true;
+}
+
+int diagnostics_format_json(char *buf, size_t size) {
+    int len = 0;
+    if (!buf || size == 0) return -1;
+
+    if (!append(buf, size, &len, snprintf(buf, size, "{\"uptime_ms\": %llu, \"heap_free\": %lu, \"heap_min\": %lu",
+            (unsigned long long)(esp_timer_get_time() / 1000),
+            (unsigned long)esp_get_free_heap_size(),
+            (unsigned long)esp_get_minimum_free_heap_size()))) return -1;
+
+    for (size_t i = 0; i < DIAG_COUNTER_COUNT; i++) {
+        if (!append(buf, size, &len, snprintf(&buf[len], size - len, ", \"%s\": %lu", COUNTER_NAMES[i],
+                (unsigned long)atomic_load_explicit(&diagnostics_counters[i], memory_order_relaxed)))) return -1;
+    }
+
+    for (size_t i = 0; i < DIAG_GAUGE_COUNT; i++) {
+        if (!append(buf, size, &len, snprintf(&buf[len], size - len, ", \"%s\": %lu", GAUGE_NAMES[i],
+                (unsigned long)atomic_load_explicit(&diagnostics_gauges[i], memory_order_relaxed)))) return -1;
+    }
+
+    //Free stack in bytes that each task has never touched
+    if (!append(buf, size, &len, snprintf(&buf[len], size - len, ", \"stack_free_min\": {"))) return -1;
+    bool first = true;
+    for (size_t i = 0; i < DIAGNOSTICS_MAX_TASKS; i++) {
+        TaskHandle_t task = atomic_load(&tasks[i]);
+        if (!task) continue;
+        if (!append(buf, size, &len, snprintf(&buf[len], size - len, "%s\"%s\": %lu", first ? "" : ", ",
+                pcTaskGetName(task), (unsigned long)uxTaskGetStackHighWaterMark(task)))) return -1;
+        first = false;
+    }
+
+    if (!append(buf, size, &len, snprintf(&buf[len], size - len, "}}"))) return -1;
+    return len;
+}
@@ -0,0 +1,101 @@
+/**
+* @file diagnostics.h
+* @brief Lock-free registry of device health counters, gauges and task stack usage
+*
+* Counters only ever go up and are bumped from wherever the event happens with a single relaxed atomic add,
+* so they are safe to use from any task and cheap enough for the sensor hot path. Gauges hold the latest value
+* of something owned elsewhere and are set by its owner. Tasks register their handle once so their stack high
+* water marks can be reported. diagnostics_format_json() takes a snapshot of everything for publishing.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "sdkconfig.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define DIAGNOSTICS_MAX_TASKS 8
+
+typedef enum {
+    DIAG_SGP30_I2C_ERRORS,      /*!< Failed transfers to the SGP30 */
+    DIAG_SGP30_CRC_ERRORS,      /*!< SGP30 reads with a bad crc */
+    DIAG_SHT3X_I2C_ERRORS,      /*!< Failed transfers to the SHT3X */
+    DIAG_SHT3X_CRC_ERRORS,      /*!< SHT3X reads with a bad crc */
+    DIAG_PUBLISH_FAILURES,      /*!< Publishes the MQTT client didn't accept */
+    DIAG_STATE_STORE_ERRORS,    /*!< Persistent state writes that failed */
+    DIAG_CYCLE_OVERRUNS,        /*!< Sensor cycles that started more than the allowed slack late */
+    DIAG_OUTBOX_REFUSED,        /*!< Publishes held back by the caller because the MQTT outbox was full */
+    DIAG_OUTBOX_DROPPED,        /*!< Best effort publishes dropped because the MQTT outbox was full */
+    DIAG_WIFI_DISCONNECTS,      /*!< Times the station lost its access point */
+    DIAG_COUNTER_COUNT
+} diag_counter_t;
+
+typedef enum {
+    DIAG_SAMPLES_DROPPED,       /*!< Samples lost to ring overruns or recycled from the store before being sent */
+    DIAG_STORE_PENDING,         /*!< Samples waiting in the flash store */
+    DIAG_CYCLE_JITTER_MAX_US,   /*!< Largest deviation of a sensor cycle period from its nominal period since boot */
+    DIAG_CYCLE_JITTER_P99_US,   /*!< Estimated 99th percentile of that deviation */
+    DIAG_OUTBOX_BYTES,          /*!< Bytes waiting in the MQTT outbox to be sent or acknowledged */
+    DIAG_OUTBOX_PEAK_BYTES,     /*!< Largest outbox size seen since boot */
+    DIAG_PUBACK_LATENCY_MAX_MS, /*!< Longest time from enqueueing a QoS 1 publish to its PUBACK since boot */
+    DIAG_PUBACK_LATENCY_P99_MS, /*!< Estimated 99th percentile of that time */
+    DIAG_FIRST_SAMPLE_MS,       /*!< Time from boot to the first sample with a reading from every sensor of its probe */
+    DIAG_WIFI_CONNECT_MS,       /*!< Time the last connection took, from boot or losing the access point to getting an IP address */
+    DIAG_WIFI_CONNECT_MAX_MS,   /*!< Longest connection time since boot */
+    DIAG_GAUGE_COUNT
+} diag_gauge_t;
+
+extern atomic_uint_fast32_t diagnostics_counters[DIAG_COUNTER_COUNT];
+extern atomic_uint_fast32_t diagnostics_gauges[DIAG_GAUGE_COUNT];
+
+/**
+* @brief Adds one to a counter
+*
+* @param counter The counter
+*/
+static inline void diagnostics_count(diag_counter_t counter) {
+#if CONFIG_DIAGNOSTICS_ENABLE
+    atomic_fetch_add_explicit(&diagnostics_counters[counter], 1, memory_order_relaxed);
+#endif
+}
+
+/**
+* @brief Sets a gauge to its latest value
+*
+* @param gauge The gauge
+* @param value The new value
+*/
+static inline void diagnostics_set_gauge(diag_gauge_t gauge, uint32_t value) {
+#if CONFIG_DIAGNOSTICS_ENABLE
+    atomic_store_explicit(&diagnostics_gauges[gauge], value, memory_order_relaxed);
+#endif
+}
+
+/**
+* @brief Adds a task to the stack high water mark report
+*
+* @param task Handle of the task
+* @return esp_err_t ESP_ERR_NO_MEM if DIAGNOSTICS_MAX_TASKS tasks are already registered
+*/
+esp_err_t diagnostics_register_task(TaskHandle_t task);
+
+/**
+* @brief Removes a task from the report, must be called before the task is deleted
+*
+* @param task Handle of the task
+*/
+void diagnostics_unregister_task(TaskHandle_t task);
+
+/**
+* @brief Formats a snapshot of every counter and gauge, the heap and the registered task stacks as JSON
+*
+* @param buf Pointer to the output buffer
+* @param size Size of the output buffer
+* @return int The length of the JSON, or -1 if it didn't fit
+*/
+int diagnostics_format_json(char *buf, size_t size);
@@ -1,28 +1,57 @@
 #include "i2c_controller.h"
 
-#define I2C_MASTER_SCL_IO   22          /*!< GPIO number used for I2C master clock */
-#define I2C_MASTER_SDA_IO   21          /*!< GPIO number used for I2C master data  */
-#define I2C_MASTER_NUM      -1          /*!< I2C port number for master dev */
-#define I2C_MASTER_FREQ_HZ  100000      /*!< I2C master clock frequency */
+#include "soc/soc_caps.h"
+
+//Time allowed for a device to acknowledge a probe
+#define I2C_PROBE_TIMEOUT_MS 50
+//Longest a device may hold SCL low, covers the 15.5 ms of a clock stretched SHT3X high repeatability measurement
+#define I2C_SCL_WAIT_US 20000
+
+//The i2c_master functions take their timeout in milliseconds, not ticks
+static inline int timeout_ms(TickType_t timeout) {
+    return timeout == portMAX_DELAY ? -1 : (int)pdTICKS_TO_MS(timeout);
+}
+
+esp_err_t i2c_init_bus(const i2c_bus_params_t *params, i2c_master_bus_handle_t *bus_handle) {
+    if(!params || !bus_handle) {
+        return ESP_ERR_INVALID_ARG;
+    }
 
-esp_err_t i2c_init_bus(i2c_master_bus_handle_t *bus_handle) {
     i2c_master_bus_config_t bus_config = {
-        .i2c_port = I2C_MASTER_NUM,
-        .sda_io_num = I2C_MASTER_SDA_IO,
-        .scl_io_num = I2C_MASTER_SCL_IO,
+        .i2c_port = params->port,
+        .sda_io_num = params->sda_io,
+        .scl_io_num = params->scl_io,
         .clk_source = I2C_CLK_SRC_DEFAULT,
         .glitch_ignore_cnt = 7,
-        .flags.enable_internal_pullup = true,
+        .flags.enable_internal_pullup = params->internal_pullup,
     };
+#if SOC_LP_I2C_SUPPORTED
+    //The LP I2C controller has its own clock source, and only reaches the LP GPIOs
+    if(params->port == LP_I2C_NUM_0) {
+        bus_config.lp_source_clk = LP_I2C_SCLK_DEFAULT;
+    }
+#endif
 
     return i2c_new_master_bus(&bus_config, bus_handle);
 }
 
-esp_err_t i2c_add_device(i2c_master_bus_handle_t *bus_handle, uint16_t device_address, i2c_master_dev_handle_t *dev_handle) {
+esp_err_t i2c_probe(i2c_master_bus_handle_t *bus_handle, uint16_t device_address) {
+    if(!bus_handle) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return i2c_master_probe(*bus_handle, device_address, I2C_PROBE_TIMEOUT_MS);
+}
+
+esp_err_t i2c_add_device(i2c_master_bus_handle_t *bus_handle, uint16_t device_address, uint32_t scl_speed_hz, i2c_master_dev_handle_t *dev_handle) {
+    if(scl_speed_hz == 0 || scl_speed_hz > I2C_MAX_SCL_SPEED_HZ) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
     i2c_device_config_t dev_config = {
         .dev_addr_length = I2C_ADDR_BIT_LEN_7,
         .device_address = device_address,
-        .scl_speed_hz = I2C_MASTER_FREQ_HZ,
+        .scl_speed_hz = scl_speed_hz,
+        .scl_wait_us = I2C_SCL_WAIT_US,
     };
     return i2c_master_bus_add_device(*bus_handle, &dev_config, dev_handle);
 }
@@ -31,12 +60,19 @@ esp_err_t i2c_write_to_device(i2c_master_dev_handle_t dev_handle, const uint8_t
     if(!write_buf || size == 0) {
         return ESP_ERR_INVALID_ARG;
     }
-    return i2c_master_transmit(dev_handle, write_buf, size, timeout);
+    return i2c_master_transmit(dev_handle, write_buf, size, timeout_ms(timeout));
 }
 
 esp_err_t i2c_read_from_device(i2c_master_dev_handle_t dev_handle, uint8_t *read_buf, size_t size, TickType_t timeout) {
     if(!read_buf || size == 0) {
         return ESP_ERR_INVALID_ARG;
     }
-    return i2c_master_receive(dev_handle, read_buf, size, timeout);
+    return i2c_master_receive(dev_handle, read_buf, size, timeout_ms(timeout));
+}
+
+esp_err_t i2c_transmit_receive(i2c_master_dev_handle_t dev_handle, const uint8_t *write_buf, size_t write_size, uint8_t *read_buf, size_t read_size, TickType_t timeout) {
+    if(!write_buf || write_size == 0 || !read_buf || read_size == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return i2c_master_transmit_receive(dev_handle, write_buf, write_size, read_buf, read_size, timeout_ms(timeout));
 }
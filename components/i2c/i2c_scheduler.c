@@ -0,0 +1,167 @@
+#include "i2c_scheduler.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#include "latency.h"
+
+#define I2C_SCHED_TIMEOUT_MS 100
+
+//Pending transactions in submission order, started ones are waiting for their read phase
+static i2c_txn_t *pending;
+
+static void append_txn(i2c_txn_t *txn) {
+    txn->next = NULL;
+    i2c_txn_t **link = &pending;
+    while (*link) link = &(*link)->next;
+    *link = txn;
+}
+
+static void unlink_txn(i2c_txn_t *txn) {
+    for (i2c_txn_t **link = &pending; *link; link = &(*link)->next) {
+        if (*link == txn) {
+            *link = txn->next;
+            txn->next = NULL;
+            return;
+        }
+    }
+}
+
+static bool device_busy(i2c_master_dev_handle_t dev) {
+    for (i2c_txn_t *txn = pending; txn; txn = txn->next) {
+        if (txn->dev == dev && txn->started) return true;
+    }
+    return false;
+}
+
+//A read with nothing to wait for goes out as one write / repeated start / read transfer, saving a stop, a
+//start and the address byte, and the poll loop only has to hand it to its callback
+static bool combined_read(const i2c_txn_t *txn) {
+    return txn->wait_us == 0 && txn->rx_len > 0;
+}
+
+//Writes the command phase and works out when the read phase is due
+static esp_err_t start_txn(i2c_txn_t *txn) {
+    esp_err_t err;
+    if (combined_read(txn)) {
+        LATENCY_START(txn_start);
+        err = i2c_transmit_receive(txn->dev, txn->tx, txn->tx_len, txn->rx, txn->rx_len, pdMS_TO_TICKS(I2C_SCHED_TIMEOUT_MS));
+        LATENCY_END(LATENCY_I2C_READ, txn_start);
+    } else {
+        LATENCY_START(write_start);
+        err = i2c_write_to_device(txn->dev, txn->tx, txn->tx_len, pdMS_TO_TICKS(I2C_SCHED_TIMEOUT_MS));
+        LATENCY_END(LATENCY_I2C_WRITE, write_start);
+    }
+    txn->due_us = esp_timer_get_time() + txn->wait_us;
+    txn->started = err == ESP_OK;
+    return err;
+}
+
+//Starts the oldest transaction held back for a device that has just become free
+static void start_next_for_device(i2c_master_dev_handle_t dev) {
+    i2c_txn_t *txn = pending;
+    while (txn) {
+        if (txn->dev != dev || txn->started) {
+            txn = txn->next;
+            continue;
+        }
+
+        esp_err_t err = start_txn(txn);
+        if (err == ESP_OK) return;
+
+        //The command never reached the device, report it and try the next one in line
+        i2c_txn_t *failed = txn;
+        txn = txn->next;
+        unlink_txn(failed);
+        if (failed->cb) failed->cb(failed, err);
+    }
+}
+
+esp_err_t i2c_sched_submit(i2c_txn_t *txn) {
+    if (!txn || txn->tx_len == 0 || txn->tx_len > I2C_TXN_MAX_TX || txn->rx_len > I2C_TXN_MAX_RX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    txn->started = false;
+    if (!device_busy(txn->dev)) {
+        esp_err_t err = start_txn(txn);
+        if (err != ESP_OK) return err;
+    }
+    append_txn(txn);
+    return ESP_OK;
+}
+
+int64_t i2c_sched_poll(void) {
+    for (;;) {
+        int64_t now = esp_timer_get_time();
+        i2c_txn_t *due = NULL;
+        for (i2c_txn_t *txn = pending; txn; txn = txn->next) {
+            if (txn->started && txn->due_us <= now) {
+                due = txn;
+                break;
+            }
+        }
+        if (!due) break;
+
+        //Unlink before the callback runs so it can resubmit the same transaction
+        unlink_txn(due);
+
+        esp_err_t err = ESP_OK;
+        if (due->rx_len > 0 && !combined_read(due)) {
+            //Includes however late the poll came, not just the wait the device asked for
+            LATENCY_RECORD(LATENCY_CONVERSION_WAIT, esp_timer_get_time() - (due->due_us - due->wait_us));
+            LATENCY_START(read_start);
+            err = i2c_read_from_device(due->dev, due->rx, due->rx_len, pdMS_TO_TICKS(I2C_SCHED_TIMEOUT_MS));
+            LATENCY_END(LATENCY_I2C_READ, read_start);
+        }
+
+        start_next_for_device(due->dev);
+        if (due->cb) due->cb(due, err);
+    }
+
+    if (!pending) return -1;
+
+    int64_t now = esp_timer_get_time();
+    int64_t next_us = INT64_MAX;
+    for (i2c_txn_t *txn = pending; txn; txn = txn->next) {
+        if (txn->started && txn->due_us - now < next_us) next_us = txn->due_us - now;
+    }
+    return next_us < 0 ? 0 : next_us;
+}
+
+bool i2c_sched_idle(void) {
+    return pending == NULL;
+}
+
+esp_err_t i2c_txn_execute(i2c_txn_t *txn) {
+    if (!txn || txn->tx_len == 0 || txn->tx_len > I2C_TXN_MAX_TX || txn->rx_len > I2C_TXN_MAX_RX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (combined_read(txn)) {
+        LATENCY_START(txn_start);
+        esp_err_t err = i2c_transmit_receive(txn->dev, txn->tx, txn->tx_len, txn->rx, txn->rx_len, pdMS_TO_TICKS(I2C_SCHED_TIMEOUT_MS));
+        LATENCY_END(LATENCY_I2C_READ, txn_start);
+        return err;
+    }
+
+    LATENCY_START(write_start);
+    esp_err_t err = i2c_write_to_device(txn->dev, txn->tx, txn->tx_len, pdMS_TO_TICKS(I2C_SCHED_TIMEOUT_MS));
+    LATENCY_END(LATENCY_I2C_WRITE, write_start);
+    if (err != ESP_OK) return err;
+
+    LATENCY_START(wait_start);
+    if (txn->wait_us > 0) {
+        //Round up and add a tick, the first tick of a delay can be cut short
+        vTaskDelay(pdMS_TO_TICKS((txn->wait_us + 999) / 1000) + 1);
+    }
+
+    if (txn->rx_len == 0) return ESP_OK;
+    LATENCY_END(LATENCY_CONVERSION_WAIT, wait_start);
+
+    LATENCY_START(read_start);
+    err = i2c_read_from_device(txn->dev, txn->rx, txn->rx_len, pdMS_TO_TICKS(I2C_SCHED_TIMEOUT_MS));
+    LATENCY_END(LATENCY_I2C_READ, read_start);
+    return err;
+}
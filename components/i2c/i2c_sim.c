@@ -0,0 +1,466 @@
+#include "i2c_controller.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "esp_timer.h"
+
+#include "crc8.h"
+
+//Conversion and command times from the datasheets
+#define SHT3X_HIGH_REPEATABILITY_US 15000
+#define SHT3X_MEDIUM_REPEATABILITY_US 6000
+#define SHT3X_LOW_REPEATABILITY_US 4000
+#define SHT3X_RESET_US 1000
+#define SHT3X_COMMAND_US 1000
+#define SHT3X_ART_PERIOD_US 250000
+#define SGP30_MEASURE_US 12000
+#define SGP30_COMMAND_US 10000
+#define SGP30_WARM_UP_US 15000000
+#define SGP30_MEASURE_RAW_US 25000
+#define SGP30_MEASURE_TEST_US 220000
+
+#define SGP30_DEFAULT_BASELINE_ECO2 0x8973
+#define SGP30_DEFAULT_BASELINE_TVOC 0x8AAE
+#define SGP30_FEATURE_SET 0x0022
+#define SGP30_INCEPTIVE_BASELINE_TVOC 0x8D60
+#define SGP30_RAW_H2 13600
+#define SGP30_RAW_ETHANOL 19200
+
+#define SIM_MAX_WORDS 3
+
+//A transfer NACKed by the device, matching the error the IDF i2c_master driver reports
+#define SIM_NACK ESP_ERR_INVALID_STATE
+
+typedef struct sim_model sim_model_t;
+typedef bool (*sim_command_fn)(sim_model_t *model, uint16_t cmd, const uint16_t *args, size_t arg_count, int64_t now_us);
+
+struct sim_model {
+    uint16_t address;
+    uint32_t max_scl_hz;            //Fastest clock the part supports
+    sim_command_fn command;
+    i2c_sim_faults_t faults;
+    i2c_sim_stats_t stats;
+    uint32_t reads;
+
+    int64_t busy_until_us;          //Commands are NACKed until the running one completes
+    uint8_t result[SIM_MAX_WORDS * CRC8_WORD_SIZE];
+    size_t result_len;              //0 when there is nothing to read
+    bool result_is_measurement;
+    float result_value[2];
+
+    bool initialised;
+    int64_t init_us;
+    uint16_t baseline[2];
+
+    int64_t periodic_us;            //SHT3X measurement period, 0 when not measuring periodically
+    int64_t periodic_first_us;      //When the first periodic result was ready
+    int64_t periodic_fetched;       //Index of the last periodic result fetched
+    uint16_t status;                //SHT3X status register
+};
+
+//The sensors are modelled on the first bus that is initialised, any other bus is empty
+struct i2c_sim_bus {
+    bool in_use;
+    bool has_models;
+};
+
+struct i2c_sim_device {
+    sim_model_t *model;
+};
+
+static bool sht3x_command(sim_model_t *model, uint16_t cmd, const uint16_t *args, size_t arg_count, int64_t now_us);
+static bool sgp30_command(sim_model_t *model, uint16_t cmd, const uint16_t *args, size_t arg_count, int64_t now_us);
+
+static sim_model_t models[] = {
+    { .address = I2C_SIM_SHT3X_ADDR, .max_scl_hz = 1000000, .command = sht3x_command, .status = 1u << 4 },
+    { .address = I2C_SIM_SGP30_ADDR, .max_scl_hz = 400000, .command = sgp30_command, .baseline = { SGP30_DEFAULT_BASELINE_ECO2, SGP30_DEFAULT_BASELINE_TVOC } },
+};
+
+static i2c_sim_waveform_t waveforms[I2C_SIM_CHANNEL_COUNT] = {
+    [I2C_SIM_TEMPERATURE] = { .type = I2C_SIM_WAVE_CONSTANT, .offset = 21.0f },
+    [I2C_SIM_HUMIDITY] = { .type = I2C_SIM_WAVE_CONSTANT, .offset = 45.0f },
+    [I2C_SIM_ECO2] = { .type = I2C_SIM_WAVE_CONSTANT, .offset = 600.0f },
+    [I2C_SIM_TVOC] = { .type = I2C_SIM_WAVE_CONSTANT, .offset = 50.0f },
+};
+
+static struct i2c_sim_bus buses[2];
+
+static sim_model_t *find_model(uint16_t address) {
+    for (size_t i = 0; i < sizeof(models) / sizeof(models[0]); i++) {
+        if (models[i].address == address) return &models[i];
+    }
+    return NULL;
+}
+
+static float waveform_value(i2c_sim_channel_t channel, int64_t now_us) {
+    const i2c_sim_waveform_t *wave = &waveforms[channel];
+    if (wave->type == I2C_SIM_WAVE_CONSTANT || wave->period_ms == 0) return wave->offset;
+
+    float phase = (float)((now_us / 1000) % wave->period_ms) / (float)wave->period_ms;
+    switch (wave->type) {
+        case I2C_SIM_WAVE_SINE:
+            return wave->offset + wave->amplitude * sinf(2.0f * (float)M_PI * phase);
+        case I2C_SIM_WAVE_SQUARE:
+            return wave->offset + (phase < 0.5f ? wave->amplitude : -wave->amplitude);
+        case I2C_SIM_WAVE_RAMP:
+            return wave->offset + wave->amplitude * (2.0f * phase - 1.0f);
+        default:
+            return wave->offset;
+    }
+}
+
+static uint16_t clamp_word(float value, float min, float max) {
+    if (value < min) value = min;
+    if (value > max) value = max;
+    return (uint16_t)lroundf(value);
+}
+
+//Queues a result of crc protected words, readable once the conversion time has passed
+static void set_words(sim_model_t *model, const uint16_t *words, size_t count, int64_t ready_us) {
+    for (size_t i = 0; i < count; i++) {
+        uint8_t *word = &model->result[i * CRC8_WORD_SIZE];
+        word[0] = words[i] >> 8;
+        word[1] = words[i] & 0xFF;
+        word[2] = crc8(word, 2);
+    }
+    model->result_len = count * CRC8_WORD_SIZE;
+    model->result_is_measurement = false;
+    model->busy_until_us = ready_us;
+}
+
+//Queues a two word result, readable once the conversion time has passed
+static void set_result(sim_model_t *model, uint16_t first, uint16_t second, int64_t ready_us) {
+    uint16_t words[2] = { first, second };
+    set_words(model, words, 2, ready_us);
+}
+
+static void set_word(sim_model_t *model, uint16_t word, int64_t ready_us) {
+    set_words(model, &word, 1, ready_us);
+}
+
+//Queues a temperature and humidity measurement of the waveforms at measured_us
+static void sht3x_measure(sim_model_t *model, int64_t measured_us, int64_t ready_us) {
+    uint16_t raw_temp = clamp_word((waveform_value(I2C_SIM_TEMPERATURE, measured_us) + 45.0f) * 65535.0f / 175.0f, 0.0f, 65535.0f);
+    uint16_t raw_humidity = clamp_word(waveform_value(I2C_SIM_HUMIDITY, measured_us) * 65535.0f / 100.0f, 0.0f, 65535.0f);
+
+    set_result(model, raw_temp, raw_humidity, ready_us);
+    model->result_is_measurement = true;
+    model->result_value[0] = -45.0f + 175.0f * raw_temp / 65535.0f;
+    model->result_value[1] = 100.0f * raw_humidity / 65535.0f;
+}
+
+//Period of a periodic acquisition command from its msb
+static int64_t sht3x_periodic_us(uint16_t cmd) {
+    switch (cmd >> 8) {
+        case 0x20: return 2000000;
+        case 0x21: return 1000000;
+        case 0x22: return 500000;
+        case 0x23: return 250000;
+        case 0x27: return 100000;
+        default: return 0;
+    }
+}
+
+//Conversion time of a periodic acquisition command, 0 if the command isn't one
+static int64_t sht3x_periodic_conversion_us(uint16_t cmd) {
+    switch (cmd) {
+        case 0x2032: case 0x2130: case 0x2236: case 0x2334: case 0x2737: return SHT3X_HIGH_REPEATABILITY_US;
+        case 0x2024: case 0x2126: case 0x2220: case 0x2322: case 0x2721: return SHT3X_MEDIUM_REPEATABILITY_US;
+        case 0x202F: case 0x212D: case 0x222B: case 0x2329: case 0x272A: return SHT3X_LOW_REPEATABILITY_US;
+        default: return 0;
+    }
+}
+
+//Fetch Data returns each periodic result once, fetching again before the next one is ready NACKs the read
+static void sht3x_fetch(sim_model_t *model, int64_t now_us) {
+    model->result_len = 0;
+    if (now_us < model->periodic_first_us) return;
+
+    int64_t latest = (now_us - model->periodic_first_us) / model->periodic_us;
+    if (latest == model->periodic_fetched) return;
+    model->periodic_fetched = latest;
+    sht3x_measure(model, model->periodic_first_us + latest * model->periodic_us, now_us);
+}
+
+static void sht3x_start_periodic(sim_model_t *model, int64_t period_us, int64_t conversion_us, int64_t now_us) {
+    model->periodic_us = period_us;
+    model->periodic_first_us = now_us + conversion_us;
+    model->periodic_fetched = -1;
+    model->result_len = 0;
+}
+
+static bool sht3x_command(sim_model_t *model, uint16_t cmd, const uint16_t *args, size_t arg_count, int64_t now_us) {
+    int64_t conversion_us;
+
+    if (arg_count != 0) return false;
+
+    //Accepted in every mode
+    if (cmd == 0x3093) {    //Break, stops periodic acquisition
+        model->periodic_us = 0;
+        model->result_len = 0;
+        model->busy_until_us = now_us + SHT3X_COMMAND_US;
+        return true;
+    }
+
+    //The real part only takes Fetch Data, Break and ART while measuring periodically, anything else needs a Break first
+    if (model->periodic_us) {
+        if (cmd == 0x2B32) {
+            sht3x_start_periodic(model, SHT3X_ART_PERIOD_US, SHT3X_HIGH_REPEATABILITY_US, now_us);
+            return true;
+        }
+        if (cmd != 0xE000) return false;
+        sht3x_fetch(model, now_us);
+        return true;
+    }
+
+    switch (cmd) {
+        case 0x30A2:    //Soft reset
+            model->status = 1u << 4;
+            model->result_len = 0;
+            model->busy_until_us = now_us + SHT3X_RESET_US;
+            return true;
+        case 0x306D:    //Heater on
+            model->status |= 1u << 13;
+            model->busy_until_us = now_us + SHT3X_COMMAND_US;
+            return true;
+        case 0x3066:    //Heater off
+            model->status &= ~(1u << 13);
+            model->busy_until_us = now_us + SHT3X_COMMAND_US;
+            return true;
+        case 0xF32D:    //Read status
+            set_word(model, model->status, now_us);
+            return true;
+        case 0x3041:    //Clear status, the heater bit is left alone
+            model->status &= 1u << 13;
+            model->busy_until_us = now_us + SHT3X_COMMAND_US;
+            return true;
+        case 0x2400: conversion_us = SHT3X_HIGH_REPEATABILITY_US; break;
+        case 0x240B: conversion_us = SHT3X_MEDIUM_REPEATABILITY_US; break;
+        case 0x2416: conversion_us = SHT3X_LOW_REPEATABILITY_US; break;
+        //Clock stretching, the device holds SCL until the conversion is done so the read never comes early
+        case 0x2C06:
+        case 0x2C0D:
+        case 0x2C10: conversion_us = 0; break;
+        case 0x2B32:    //ART, 4 Hz periodic
+            sht3x_start_periodic(model, SHT3X_ART_PERIOD_US, SHT3X_HIGH_REPEATABILITY_US, now_us);
+            return true;
+        default:
+            conversion_us = sht3x_periodic_conversion_us(cmd);
+            if (conversion_us == 0) return false;
+            sht3x_start_periodic(model, sht3x_periodic_us(cmd), conversion_us, now_us);
+            return true;
+    }
+
+    sht3x_measure(model, now_us, now_us + conversion_us);
+    return true;
+}
+
+static bool sgp30_command(sim_model_t *model, uint16_t cmd, const uint16_t *args, size_t arg_count, int64_t now_us) {
+    switch (cmd) {
+        case 0x2003:    //Init air quality, restarts the warm up and the baseline algorithm
+            if (arg_count != 0) return false;
+            model->initialised = true;
+            model->init_us = now_us;
+            model->baseline[0] = SGP30_DEFAULT_BASELINE_ECO2;
+            model->baseline[1] = SGP30_DEFAULT_BASELINE_TVOC;
+            model->result_len = 0;
+            model->busy_until_us = now_us + SGP30_COMMAND_US;
+            return true;
+        case 0x2008: {  //Measure air quality, fixed values until the sensor has warmed up
+            if (arg_count != 0) return false;
+            uint16_t eco2 = 400;
+            uint16_t tvoc = 0;
+            if (model->initialised && now_us - model->init_us >= SGP30_WARM_UP_US) {
+                eco2 = clamp_word(waveform_value(I2C_SIM_ECO2, now_us), 400.0f, 60000.0f);
+                tvoc = clamp_word(waveform_value(I2C_SIM_TVOC, now_us), 0.0f, 60000.0f);
+            }
+            set_result(model, eco2, tvoc, now_us + SGP30_MEASURE_US);
+            model->result_is_measurement = true;
+            model->result_value[0] = eco2;
+            model->result_value[1] = tvoc;
+            return true;
+        }
+        case 0x2015:    //Get baseline
+            if (arg_count != 0) return false;
+            set_result(model, model->baseline[0], model->baseline[1], now_us + SGP30_COMMAND_US);
+            model->result_is_measurement = false;
+            return true;
+        case 0x201E:    //Set baseline
+            if (arg_count != 2) return false;
+            model->baseline[0] = args[0];
+            model->baseline[1] = args[1];
+            model->result_len = 0;
+            model->busy_until_us = now_us + SGP30_COMMAND_US;
+            return true;
+        case 0x2077:    //Set TVOC baseline
+            if (arg_count != 1) return false;
+            model->baseline[1] = args[0];
+            model->result_len = 0;
+            model->busy_until_us = now_us + SGP30_COMMAND_US;
+            return true;
+        case 0x20B3:    //Get TVOC inceptive baseline
+            if (arg_count != 0) return false;
+            set_word(model, SGP30_INCEPTIVE_BASELINE_TVOC, now_us + SGP30_COMMAND_US);
+            return true;
+        case 0x202F:    //Get feature set
+            if (arg_count != 0) return false;
+            set_word(model, SGP30_FEATURE_SET, now_us + SGP30_COMMAND_US);
+            return true;
+        case 0x2032:    //Measure test, always passes
+            if (arg_count != 0) return false;
+            set_word(model, 0xD400, now_us + SGP30_MEASURE_TEST_US);
+            return true;
+        case 0x2050:    //Measure raw signals
+            if (arg_count != 0) return false;
+            set_result(model, SGP30_RAW_H2, SGP30_RAW_ETHANOL, now_us + SGP30_MEASURE_RAW_US);
+            return true;
+        case 0x2061:    //Set absolute humidity
+            if (arg_count != 1) return false;
+            model->stats.absolute_humidity = args[0];
+            model->result_len = 0;
+            model->busy_until_us = now_us + SGP30_COMMAND_US;
+            return true;
+        default:
+            return false;
+    }
+}
+
+//Counts the transfer and reports whether the fault configuration NACKs it
+static bool inject_nack(sim_model_t *model) {
+    model->stats.transfers++;
+    if (model->faults.nack_every && model->stats.transfers % model->faults.nack_every == 0) {
+        model->stats.nacks++;
+        return true;
+    }
+    return false;
+}
+
+esp_err_t i2c_init_bus(const i2c_bus_params_t *params, i2c_master_bus_handle_t *bus_handle) {
+    if (!params || !bus_handle) return ESP_ERR_INVALID_ARG;
+
+    for (size_t i = 0; i < sizeof(buses) / sizeof(buses[0]); i++) {
+        if (buses[i].in_use) continue;
+        buses[i].in_use = true;
+        buses[i].has_models = i == 0;
+        *bus_handle = &buses[i];
+        return ESP_OK;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t i2c_probe(i2c_master_bus_handle_t *bus_handle, uint16_t device_address) {
+    if (!bus_handle || !*bus_handle) return ESP_ERR_INVALID_ARG;
+    return (*bus_handle)->has_models && find_model(device_address) ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t i2c_add_device(i2c_master_bus_handle_t *bus_handle, uint16_t device_address, uint32_t scl_speed_hz, i2c_master_dev_handle_t *dev_handle) {
+    if (!bus_handle || !*bus_handle || !dev_handle) return ESP_ERR_INVALID_ARG;
+    if (scl_speed_hz == 0 || scl_speed_hz > I2C_MAX_SCL_SPEED_HZ) return ESP_ERR_INVALID_ARG;
+
+    //A real part clocked too fast corrupts transfers in ways that are hard to trace, fail loudly instead
+    sim_model_t *model = (*bus_handle)->has_models ? find_model(device_address) : NULL;
+    if (model && scl_speed_hz > model->max_scl_hz) return ESP_ERR_NOT_SUPPORTED;
+
+    //Like the real driver this doesn't probe, transfers to an address with no model are NACKed
+    struct i2c_sim_device *dev = calloc(1, sizeof(*dev));
+    if (!dev) return ESP_ERR_NO_MEM;
+    dev->model = model;
+    *dev_handle = dev;
+    return ESP_OK;
+}
+
+esp_err_t i2c_write_to_device(i2c_master_dev_handle_t dev_handle, const uint8_t *write_buf, size_t size, TickType_t timeout) {
+    if(!dev_handle || !write_buf || size == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    sim_model_t *model = dev_handle->model;
+    if (!model) return SIM_NACK;
+    if (inject_nack(model)) return SIM_NACK;
+
+    int64_t now_us = esp_timer_get_time();
+    if (now_us < model->busy_until_us) {
+        model->stats.nacks++;
+        return SIM_NACK;
+    }
+
+    //Command word followed by argument words, each with its crc
+    uint16_t args[SIM_MAX_WORDS];
+    size_t arg_count = (size - 2) / CRC8_WORD_SIZE;
+    bool valid = size >= 2 && (size - 2) % CRC8_WORD_SIZE == 0 && arg_count <= SIM_MAX_WORDS && crc8_decode_words(&write_buf[2], args, arg_count);
+
+    if (!valid || !model->command(model, (write_buf[0] << 8) | write_buf[1], args, arg_count, now_us)) {
+        model->stats.bad_commands++;
+        model->stats.nacks++;
+        return SIM_NACK;
+    }
+    return ESP_OK;
+}
+
+esp_err_t i2c_read_from_device(i2c_master_dev_handle_t dev_handle, uint8_t *read_buf, size_t size, TickType_t timeout) {
+    if(!dev_handle || !read_buf || size == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    sim_model_t *model = dev_handle->model;
+    if (!model) return SIM_NACK;
+    if (inject_nack(model)) return SIM_NACK;
+
+    if (model->result_len == 0) {
+        model->stats.nacks++;
+        return SIM_NACK;
+    }
+    if (esp_timer_get_time() < model->busy_until_us) {
+        model->stats.early_reads++;
+        model->stats.nacks++;
+        return SIM_NACK;
+    }
+
+    //Reading past the result clocks out 0xFF, like an idle bus
+    memset(read_buf, 0xFF, size);
+    memcpy(read_buf, model->result, size < model->result_len ? size : model->result_len);
+    model->result_len = 0;
+
+    model->reads++;
+    if (model->faults.crc_error_every && model->reads % model->faults.crc_error_every == 0) {
+        read_buf[2] ^= 0x5A;
+        model->stats.crc_errors++;
+    }
+    else if (model->result_is_measurement) {
+        model->stats.last_value[0] = model->result_value[0];
+        model->stats.last_value[1] = model->result_value[1];
+    }
+    return ESP_OK;
+}
+
+//A read straight after the write NACKs unless the command has nothing to wait for, like a part that doesn't
+//stretch the clock
+esp_err_t i2c_transmit_receive(i2c_master_dev_handle_t dev_handle, const uint8_t *write_buf, size_t write_size, uint8_t *read_buf, size_t read_size, TickType_t timeout) {
+    esp_err_t err = i2c_write_to_device(dev_handle, write_buf, write_size, timeout);
+    if (err != ESP_OK) return err;
+    return i2c_read_from_device(dev_handle, read_buf, read_size, timeout);
+}
+
+void i2c_sim_set_waveform(i2c_sim_channel_t channel, const i2c_sim_waveform_t *wave) {
+    if (channel >= I2C_SIM_CHANNEL_COUNT || !wave) return;
+    waveforms[channel] = *wave;
+}
+
+void i2c_sim_set_faults(uint16_t device_address, const i2c_sim_faults_t *faults) {
+    sim_model_t *model = find_model(device_address);
+    if (!model || !faults) return;
+    model->faults = *faults;
+}
+
+void i2c_sim_get_stats(uint16_t device_address, i2c_sim_stats_t *stats) {
+    sim_model_t *model = find_model(device_address);
+    if (!stats) return;
+    if (!model) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    *stats = model->stats;
+}
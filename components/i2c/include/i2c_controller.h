@@ -1,5 +1,5 @@
 /**
-* @file i2c_bus.h
+* @file i2c_controller.h
 * @brief High-level I2C bus and device helper functions.
 * 
 */
@@ -8,28 +8,89 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
+#include "sdkconfig.h"
 #include "esp_err.h"
-#include "driver/i2c_master.h"
 #include "freertos/FreeRTOS.h"
 
+#if CONFIG_IDF_TARGET_LINUX
+//Host build, the bus and the sensors on it are simulated
+#include "i2c_sim.h"
+#else
+#include "driver/i2c_master.h"
+#endif
+
+#define I2C_MAX_SCL_SPEED_HZ 400000     /*!< Fast mode, the ESP32-C6 I2C controllers do not support fast mode plus */
+
+#if CONFIG_I2C_BUS_INTERNAL_PULLUP
+#define I2C_BUS_INTERNAL_PULLUP_DEFAULT true
+#else
+#define I2C_BUS_INTERNAL_PULLUP_DEFAULT false
+#endif
+
+/**
+* @brief Bus pins and port
+*/
+typedef struct {
+    int port;                   /*!< I2C port number, -1 picks any free port */
+    int sda_io;                 /*!< GPIO used for SDA */
+    int scl_io;                 /*!< GPIO used for SCL */
+    bool internal_pullup;       /*!< The internal pull ups are only strong enough for 100 kHz on short wires */
+} i2c_bus_params_t;
+
+/*!< Bus parameters chosen in menuconfig */
+#define I2C_BUS_PARAMS_DEFAULT() (i2c_bus_params_t){ \
+    .port = CONFIG_I2C_BUS_PORT, \
+    .sda_io = CONFIG_I2C_BUS_SDA_GPIO, \
+    .scl_io = CONFIG_I2C_BUS_SCL_GPIO, \
+    .internal_pullup = I2C_BUS_INTERNAL_PULLUP_DEFAULT, \
+}
+
+#if CONFIG_I2C_BUS2_ENABLE
+#if CONFIG_I2C_BUS2_INTERNAL_PULLUP
+#define I2C_BUS2_INTERNAL_PULLUP_DEFAULT true
+#else
+#define I2C_BUS2_INTERNAL_PULLUP_DEFAULT false
+#endif
+
+/*!< Second bus parameters chosen in menuconfig */
+#define I2C_BUS2_PARAMS_DEFAULT() (i2c_bus_params_t){ \
+    .port = CONFIG_I2C_BUS2_PORT, \
+    .sda_io = CONFIG_I2C_BUS2_SDA_GPIO, \
+    .scl_io = CONFIG_I2C_BUS2_SCL_GPIO, \
+    .internal_pullup = I2C_BUS2_INTERNAL_PULLUP_DEFAULT, \
+}
+#endif
+
 /**
-* @brief Initialises the I2C bus
+* @brief Initialises an I2C bus
 *
+* @param params Pointer to the bus pins and port
 * @param bus_handle Pointer to the I2C bus handle
 * @return esp_err_t The esp error code
 */
-esp_err_t i2c_init_bus(i2c_master_bus_handle_t *bus_handle);
+esp_err_t i2c_init_bus(const i2c_bus_params_t *params, i2c_master_bus_handle_t *bus_handle);
+
+/**
+* @brief Checks whether a device acknowledges its address on the bus
+*
+* @param bus_handle Pointer to the I2C bus handle
+* @param device_address The I2C address to probe
+* @return esp_err_t ESP_OK if the device answered, ESP_ERR_NOT_FOUND if nothing did, otherwise the bus error
+*/
+esp_err_t i2c_probe(i2c_master_bus_handle_t *bus_handle, uint16_t device_address);
 
 /**
-* @brief Adds a device to the I2C bus
+* @brief Adds a device to the I2C bus with its own clock speed, the bus switches speed per transfer
 *
 * @param bus_handle Pointer to the I2C bus handle
 * @param device_address The I2C address of the device to be added
+* @param scl_speed_hz SCL clock used for this device, up to I2C_MAX_SCL_SPEED_HZ
 * @param dev_handle Pointer to the I2C device handle
 * @return esp_err_t The esp error code
 */
-esp_err_t i2c_add_device(i2c_master_bus_handle_t *bus_handle, uint16_t device_address, i2c_master_dev_handle_t *dev_handle);
+esp_err_t i2c_add_device(i2c_master_bus_handle_t *bus_handle, uint16_t device_address, uint32_t scl_speed_hz, i2c_master_dev_handle_t *dev_handle);
 
 /**
 * @brief Writes to an I2C device on the bus from a buffer
@@ -52,3 +113,17 @@ esp_err_t i2c_write_to_device(i2c_master_dev_handle_t dev_handle, const uint8_t
 * @return esp_err_t The esp error code
 */
 esp_err_t i2c_read_from_device(i2c_master_dev_handle_t dev_handle, uint8_t *read_buf, size_t size, TickType_t timeout);
+
+/**
+* @brief Writes to a device and reads its reply in one transaction with a repeated start, for register style
+*        reads where the device has the data ready straight away or stretches the clock until it has
+*
+* @param dev_handle Pointer to the I2C device handle
+* @param write_buf Pointer to the buffer containing the data to write
+* @param write_size Size of the write buffer
+* @param read_buf Pointer to the buffer to take the bytes read from the device
+* @param read_size Size of the expected bytes to be read
+* @param timeout The timeout value in FreeRTOS ticks for the whole transaction
+* @return esp_err_t The esp error code
+*/
+esp_err_t i2c_transmit_receive(i2c_master_dev_handle_t dev_handle, const uint8_t *write_buf, size_t write_size, uint8_t *read_buf, size_t read_size, TickType_t timeout);
@@ -0,0 +1,90 @@
+/**
+* @file i2c_scheduler.h
+* @brief Cooperative I2C transaction scheduler for command / wait / read sensor transactions
+*
+* A transaction writes a command, waits for the device to finish its conversion and then reads the result.
+* Instead of sleeping through the wait, the scheduler records when the read phase is due and returns straight
+* away, so conversions on different devices run at the same time. The owner calls i2c_sched_poll() to run any
+* read phases that are due and sleeps until the next deadline it returns. Transactions for a device that is
+* still busy are held back and started as soon as the earlier one completes.
+*
+* A transaction that reads with no wait is sent as a single write / repeated start / read transfer when it
+* starts and completes on the next poll.
+*
+* Completion callbacks run from i2c_sched_poll() in the caller's task and may submit further transactions.
+* The scheduler is not thread safe, all transactions must be submitted and polled from one task.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+#include "i2c_controller.h"
+
+#define I2C_TXN_MAX_TX 8        /*!< Command plus two argument words with their crc bytes */
+#define I2C_TXN_MAX_RX 9        /*!< Three data words with their crc bytes */
+
+typedef struct i2c_txn i2c_txn_t;
+
+/**
+* @brief Transaction completion callback
+*
+* @param txn The completed transaction, rx holds the bytes read when err is ESP_OK
+* @param err ESP_OK or the error from the write or read phase
+*/
+typedef void (*i2c_txn_cb_t)(i2c_txn_t *txn, esp_err_t err);
+
+/**
+* @brief A command / wait / read transaction. Owned by the caller and must stay valid until its callback has run.
+*/
+struct i2c_txn {
+    i2c_master_dev_handle_t dev;    /*!< Device to talk to */
+    uint8_t tx[I2C_TXN_MAX_TX];     /*!< Command phase bytes */
+    size_t tx_len;
+    uint32_t wait_us;               /*!< Time the device needs before the read phase, or before it accepts the next command */
+    uint8_t rx[I2C_TXN_MAX_RX];     /*!< Read phase bytes */
+    size_t rx_len;                  /*!< Number of bytes to read, 0 for a write only transaction */
+    i2c_txn_cb_t cb;                /*!< Completion callback, may be NULL */
+    void *ctx;                      /*!< Caller context for the callback */
+
+    /* Scheduler private */
+    int64_t due_us;
+    bool started;
+    i2c_txn_t *next;
+};
+
+/**
+* @brief Queues a transaction. The command phase is written straight away unless the device is still busy
+*        with an earlier transaction.
+*
+* @param txn Pointer to the transaction
+* @return esp_err_t ESP_OK if queued, otherwise the error from the command phase. The callback isn't called on error.
+*/
+esp_err_t i2c_sched_submit(i2c_txn_t *txn);
+
+/**
+* @brief Runs the read phase of every transaction whose wait has elapsed and calls its completion callback
+*
+* @return int64_t Microseconds until the next transaction is due, 0 if one is due now, -1 if nothing is pending
+*/
+int64_t i2c_sched_poll(void);
+
+/**
+* @brief Checks whether any transaction is still pending
+*
+* @return bool True if no transactions are pending
+*/
+bool i2c_sched_idle(void);
+
+/**
+* @brief Runs a single transaction to completion in the calling task, sleeping through the wait phase.
+*        For initialisation and other paths where blocking is acceptable. The callback is not used.
+*
+* @param txn Pointer to the transaction
+* @return esp_err_t The esp error code
+*/
+esp_err_t i2c_txn_execute(i2c_txn_t *txn);
@@ -0,0 +1,101 @@
+/**
+* @file i2c_sim.h
+* @brief Simulated I2C bus for the Linux host build
+*
+* Replaces i2c_controller.c when IDF_TARGET is linux. The SGP30 and SHT3X are modelled at their usual
+* addresses from their command sets: commands are decoded, conversions take their datasheet time and reading
+* a result early is NACKed like on the real parts, results carry Sensirion crcs and the SGP30 answers with
+* its fixed 400 ppm / 0 ppb during the 15 s after init. The SHT3X also models its periodic and ART modes,
+* where Fetch Data returns each result once and only Fetch Data, Break and ART are accepted, and its heater
+* and status register. Addresses with no model NACK
+* every transfer. The sensors sit on the first bus initialised, a second bus is empty.
+*
+* Each measured quantity follows a configurable waveform, and faults can be injected per device: every Nth
+* transfer NACKed, or every Nth read returned with a corrupted crc.
+*
+* Configure the simulation before starting the code under test, the configuration is not locked against
+* concurrent transfers.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#define I2C_SIM_SGP30_ADDR 0x58
+#define I2C_SIM_SHT3X_ADDR 0x44
+
+typedef struct i2c_sim_bus *i2c_master_bus_handle_t;
+typedef struct i2c_sim_device *i2c_master_dev_handle_t;
+
+/**
+* @brief Simulated quantities
+*/
+typedef enum {
+    I2C_SIM_TEMPERATURE,        /*!< SHT3X temperature in degC */
+    I2C_SIM_HUMIDITY,           /*!< SHT3X relative humidity in %RH */
+    I2C_SIM_ECO2,               /*!< SGP30 eCO2 in ppm */
+    I2C_SIM_TVOC,               /*!< SGP30 TVOC in ppb */
+    I2C_SIM_CHANNEL_COUNT,
+} i2c_sim_channel_t;
+
+typedef enum {
+    I2C_SIM_WAVE_CONSTANT,      /*!< offset */
+    I2C_SIM_WAVE_SINE,          /*!< offset + amplitude * sin(2 pi t / period) */
+    I2C_SIM_WAVE_SQUARE,        /*!< offset + amplitude for the first half of each period, offset - amplitude for the second */
+    I2C_SIM_WAVE_RAMP,          /*!< Sawtooth from offset - amplitude to offset + amplitude over each period */
+} i2c_sim_wave_type_t;
+
+/**
+* @brief Waveform followed by a simulated quantity, time is measured from the start of the process
+*/
+typedef struct {
+    i2c_sim_wave_type_t type;
+    float offset;
+    float amplitude;
+    uint32_t period_ms;
+} i2c_sim_waveform_t;
+
+/**
+* @brief Faults injected on one device, 0 disables a fault
+*/
+typedef struct {
+    uint32_t nack_every;        /*!< NACK every Nth transfer (read or write) */
+    uint32_t crc_error_every;   /*!< Corrupt the crc of the first word of every Nth read */
+} i2c_sim_faults_t;
+
+/**
+* @brief Per device counters
+*/
+typedef struct {
+    uint32_t transfers;         /*!< Reads and writes addressed to the device */
+    uint32_t nacks;             /*!< Transfers NACKed, injected or because of a protocol error */
+    uint32_t early_reads;       /*!< Reads NACKed because the conversion hadn't finished */
+    uint32_t crc_errors;        /*!< Reads returned with a corrupted crc */
+    uint32_t bad_commands;      /*!< Unknown commands or written words with a wrong crc */
+    float last_value[2];        /*!< Quantities in the last measurement read out, as the driver should decode them */
+    uint16_t absolute_humidity; /*!< Last humidity compensation word written to the SGP30 */
+} i2c_sim_stats_t;
+
+/**
+* @brief Sets the waveform a simulated quantity follows
+*
+* @param channel The quantity
+* @param wave Pointer to the waveform
+*/
+void i2c_sim_set_waveform(i2c_sim_channel_t channel, const i2c_sim_waveform_t *wave);
+
+/**
+* @brief Sets the faults injected on a device
+*
+* @param device_address I2C address of the simulated device
+* @param faults Pointer to the fault configuration
+*/
+void i2c_sim_set_faults(uint16_t device_address, const i2c_sim_faults_t *faults);
+
+/**
+* @brief Reads a device's counters
+*
+* @param device_address I2C address of the simulated device
+* @param stats Pointer to a structure that receives the counters
+*/
+void i2c_sim_get_stats(uint16_t device_address, i2c_sim_stats_t *stats);
@@ -0,0 +1,117 @@
+/**
+* @file latency.h
+* @brief Timestamp probes along the sensor to broker path feeding fixed bucket log2 histograms
+*
+* Each stage has a histogram of 24 buckets where bucket i counts durations below 2^i microseconds that didn't
+* fit in bucket i - 1, and the last bucket also takes everything longer. Recording is a handful of relaxed
+* atomic adds so probes can run on any task, including inside the I2C scheduler.
+*
+* With CONFIG_LATENCY_PROBES_ENABLE disabled every macro expands to nothing, the timestamps aren't taken
+* and latency.c isn't built.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "sdkconfig.h"
+
+#define LATENCY_BUCKET_COUNT 24
+
+typedef enum {
+    LATENCY_I2C_WRITE,          /*!< Command phase of an I2C transaction */
+    LATENCY_CONVERSION_WAIT,    /*!< From the end of the command phase to the start of the read phase */
+    LATENCY_I2C_READ,           /*!< Read phase of an I2C transaction */
+    LATENCY_CRC_CHECK,          /*!< Checking and converting a sensor response */
+    LATENCY_QUEUE_HOP,          /*!< From a sample being pushed to the ring to the publisher picking it up */
+    LATENCY_ENCODE,             /*!< Formatting a payload */
+    LATENCY_PUBLISH,            /*!< Handing a message to the MQTT outbox */
+    LATENCY_PUBACK,             /*!< From publishing to the broker acknowledging, QoS 1 only */
+    LATENCY_STAGE_COUNT
+} latency_stage_t;
+
+#if CONFIG_LATENCY_PROBES_ENABLE
+
+#include "esp_timer.h"
+
+/*!< Takes a start timestamp in a local variable */
+#define LATENCY_START(name) const int64_t name = esp_timer_get_time()
+/*!< Records the time since the LATENCY_START of the same name */
+#define LATENCY_END(stage, name) latency_record((stage), (uint32_t)(esp_timer_get_time() - (name)))
+/*!< Records a duration measured by other means */
+#define LATENCY_RECORD(stage, duration_us) latency_record((stage), (uint32_t)(duration_us))
+/*!< Marks the start of a stage that ends on another task, only the latest mark per stage is kept */
+#define LATENCY_MARK(stage) latency_mark(stage)
+/*!< Records the time since the last LATENCY_MARK of the stage */
+#define LATENCY_MARK_END(stage) latency_mark_end(stage)
+/*!< Marks the start of a stage that ends on another task, keyed by id so several can be in flight */
+#define LATENCY_BEGIN_ID(stage, id) latency_begin_id((stage), (id))
+/*!< Records the time since the LATENCY_BEGIN_ID with the same id, if it is still being tracked */
+#define LATENCY_END_ID(stage, id) latency_end_id((stage), (id))
+
+/**
+* @brief Adds a duration to a stage's histogram
+*
+* @param stage The stage
+* @param duration_us The duration in microseconds
+*/
+void latency_record(latency_stage_t stage, uint32_t duration_us);
+
+/**
+* @brief Backs LATENCY_MARK(), records the start of a stage that ends on another task
+*
+* @param stage The stage
+*/
+void latency_mark(latency_stage_t stage);
+
+/**
+* @brief Backs LATENCY_MARK_END(), records the time since the last mark of the stage
+*
+* @param stage The stage
+*/
+void latency_mark_end(latency_stage_t stage);
+
+/**
+* @brief Backs LATENCY_BEGIN_ID(), records the start of an operation identified by id, e.g. an MQTT msg_id
+*
+* @param stage The stage
+* @param id Identifier of the operation, non negative
+*/
+void latency_begin_id(latency_stage_t stage, int id);
+
+/**
+* @brief Backs LATENCY_END_ID(), records the time since the operation began. Operations whose slot was reused
+*        by a later one are not recorded.
+*
+* @param stage The stage
+* @param id Identifier of the operation
+*/
+void latency_end_id(latency_stage_t stage, int id);
+
+/**
+* @brief Logs the count, percentiles, maximum and non empty buckets of every stage
+*/
+void latency_dump(void);
+
+/**
+* @brief Formats every stage's count, percentiles, maximum and buckets as JSON. Percentiles are the upper
+*        edge of the bucket they fall in. Trailing empty buckets are left out.
+*
+* @param buf Pointer to the output buffer
+* @param size Size of the output buffer
+* @return int The length of the JSON, or -1 if it didn't fit
+*/
+int latency_format_json(char *buf, size_t size);
+
+#else
+
+#define LATENCY_START(name)
+#define LATENCY_END(stage, name) do {} while (0)
+#define LATENCY_RECORD(stage, duration_us) do {} while (0)
+#define LATENCY_MARK(stage) do {} while (0)
+#define LATENCY_MARK_END(stage) do {} while (0)
+#define LATENCY_BEGIN_ID(stage, id) do {} while (0)
+#define LATENCY_END_ID(stage, id) do {} while (0)
+
+#endif
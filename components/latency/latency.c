@@ -0,0 +1,165 @@
+#include "latency.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "esp_log.h"
+
+//Operations tracked by id at the same time, a power of two
+#define LATENCY_ID_SLOTS 8
+
+static const char *TAG = "LATENCY";
+
+static const char *const STAGE_NAMES[LATENCY_STAGE_COUNT] = {
+    [LATENCY_I2C_WRITE] = "i2c_write",
+    [LATENCY_CONVERSION_WAIT] = "conversion_wait",
+    [LATENCY_I2C_READ] = "i2c_read",
+    [LATENCY_CRC_CHECK] = "crc_check",
+    [LATENCY_QUEUE_HOP] = "queue_hop",
+    [LATENCY_ENCODE] = "encode",
+    [LATENCY_PUBLISH] = "publish",
+    [LATENCY_PUBACK] = "puback",
+};
+
+static atomic_uint_fast32_t buckets[LATENCY_STAGE_COUNT][LATENCY_BUCKET_COUNT];
+static atomic_uint_fast32_t max_us[LATENCY_STAGE_COUNT];
+
+//Start times are kept as 32 bit microseconds, durations stay correct across the wrap every 71 minutes
+static atomic_uint_fast32_t marks[LATENCY_STAGE_COUNT];
+static atomic_int id_slots[LATENCY_ID_SLOTS] = { [0 ... LATENCY_ID_SLOTS - 1] = -1 };
+static atomic_uint_fast32_t id_starts[LATENCY_ID_SLOTS];
+
+static inline uint32_t now_us(void) {
+    return (uint32_t)esp_timer_get_time();
+}
+
+//0 for 0 us, otherwise the number of bits needed for the duration
+static inline size_t bucket_of(uint32_t duration_us) {
+    size_t bucket = duration_us ? 32 - __builtin_clz(duration_us) : 0;
+    return bucket < LATENCY_BUCKET_COUNT ? bucket : LATENCY_BUCKET_COUNT - 1;
+}
+
+void latency_record(latency_stage_t stage, uint32_t duration_us) {
+    if (stage >= LATENCY_STAGE_COUNT) return;
+
+    atomic_fetch_add_explicit(&buckets[stage][bucket_of(duration_us)], 1, memory_order_relaxed);
+
+    uint_fast32_t max = atomic_load_explicit(&max_us[stage], memory_order_relaxed);
+    while (duration_us > max && !atomic_compare_exchange_weak_explicit(&max_us[stage], &max, duration_us, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+void latency_mark(latency_stage_t stage) {
+    if (stage >= LATENCY_STAGE_COUNT) return;
+    atomic_store_explicit(&marks[stage], now_us(), memory_order_relaxed);
+}
+
+void latency_mark_end(latency_stage_t stage) {
+    if (stage >= LATENCY_STAGE_COUNT) return;
+    latency_record(stage, now_us() - atomic_load_explicit(&marks[stage], memory_order_relaxed));
+}
+
+void latency_begin_id(latency_stage_t stage, int id) {
+    if (id < 0) return;
+
+    size_t slot = (size_t)id & (LATENCY_ID_SLOTS - 1);
+    atomic_store_explicit(&id_starts[slot], now_us(), memory_order_relaxed);
+    //Published last so an end never pairs the id with a stale start
+    atomic_store_explicit(&id_slots[slot], id, memory_order_release);
+}
+
+void latency_end_id(latency_stage_t stage, int id) {
+    if (id < 0) return;
+
+    size_t slot = (size_t)id & (LATENCY_ID_SLOTS - 1);
+    int expected = id;
+    if (atomic_compare_exchange_strong_explicit(&id_slots[slot], &expected, -1, memory_order_acquire, memory_order_relaxed)) {
+        latency_record(stage, now_us() - atomic_load_explicit(&id_starts[slot], memory_order_relaxed));
+    }
+}
+
+typedef struct {
+    uint32_t counts[LATENCY_BUCKET_COUNT];
+    uint32_t total;
+    uint32_t max_us;
+    size_t used;                /*!< Buckets up to the last non empty one */
+} stage_snapshot_t;
+
+static void snapshot_stage(latency_stage_t stage, stage_snapshot_t *out) {
+    out->total = 0;
+    out->used = 0;
+    for (size_t i = 0; i < LATENCY_BUCKET_COUNT; i++) {
+        out->counts[i] = atomic_load_explicit(&buckets[stage][i], memory_order_relaxed);
+        out->total += out->counts[i];
+        if (out->counts[i]) out->used = i + 1;
+    }
+    out->max_us = atomic_load_explicit(&max_us[stage], memory_order_relaxed);
+}
+
+//Upper edge of the bucket the quantile falls in, capped at the maximum seen
+static uint32_t snapshot_quantile(const stage_snapshot_t *snap, uint32_t permille) {
+    if (snap->total == 0) return 0;
+
+    uint64_t rank = ((uint64_t)snap->total * permille + 999) / 1000;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < LATENCY_BUCKET_COUNT; i++) {
+        seen += snap->counts[i];
+        if (seen >= rank) {
+            uint32_t edge = i == 0 ? 0 : (1u << i) - 1;
+            return edge < snap->max_us ? edge : snap->max_us;
+        }
+    }
+    return snap->max_us;
+}
+
+void latency_dump(void) {
+    stage_snapshot_t snap;
+    char line[LATENCY_BUCKET_COUNT * 12];
+
+    for (size_t stage = 0; stage < LATENCY_STAGE_COUNT; stage++) {
+        snapshot_stage(stage, &snap);
+        if (snap.total == 0) continue;
+
+        int len = 0;
+        for (size_t i = 0; i < snap.used && len >= 0 && (size_t)len < sizeof(line); i++) {
+            if (!snap.counts[i]) continue;
+            if (i == LATENCY_BUCKET_COUNT - 1) {
+                len += snprintf(&line[len], sizeof(line) - len, " >=%lu:%lu", 1ul << (i - 1), (unsigned long)snap.counts[i]);
+            }
+            else {
+                len += snprintf(&line[len], sizeof(line) - len, " <%lu:%lu", 1ul << i, (unsigned long)snap.counts[i]);
+            }
+        }
+        ESP_LOGI(TAG, "%-15s n=%lu p50<=%lu p99<=%lu max=%lu us |%s", STAGE_NAMES[stage], (unsigned long)snap.total,
+                (unsigned long)snapshot_quantile(&snap, 500), (unsigned long)snapshot_quantile(&snap, 990), (unsigned long)snap.max_us, line);
+    }
+}
+
+//Appends to the buffer, returns false once it is full
+static bool append(char *buf, size_t size, int *len, int written) {
+    if (written < 0 || (size_t)written >= size - *len) return false;
+    *len += written;
+    return true;
+}
+
+int latency_format_json(char *buf, size_t size) {
+    int len = 0;
+    if (!buf || size == 0) return -1;
+
+    if (!append(buf, size, &len, snprintf(buf, size, "{\"uptime_ms\": %llu", (unsigned long long)(esp_timer_get_time() / 1000)))) return -1;
+
+    stage_snapshot_t snap;
+    for (size_t stage = 0; stage < LATENCY_STAGE_COUNT; stage++) {
+        snapshot_stage(stage, &snap);
+        if (!append(buf, size, &len, snprintf(&buf[len], size - len, ", \"%s\": {\"n\": %lu, \"p50_us\": %lu, \"p99_us\": %lu, \"max_us\": %lu, \"buckets\": [",
+                STAGE_NAMES[stage], (unsigned long)snap.total, (unsigned long)snapshot_quantile(&snap, 500),
+                (unsigned long)snapshot_quantile(&snap, 990), (unsigned long)snap.max_us))) return -1;
+        for (size_t i = 0; i < snap.used; i++) {
+            if (!append(buf, size, &len, snprintf(&buf[len], size - len, "%s%lu", i ? ", " : "", (unsigned long)snap.counts[i]))) return -1;
+        }
+        if (!append(buf, size, &len, snprintf(&buf[len], size - len, "]}"))) return -1;
+    }
+
+    if (!append(buf, size, &len, snprintf(&buf[len], size - len, "}"))) return -1;
+    return len;
+}
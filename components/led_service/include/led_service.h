@@ -1,13 +1,19 @@
 /**
 * @file led_service.h
 * @brief LED controller for a red yellow and green LED on the board. Supports setting different states for each LED.
-* 
+*
+* Changes are applied from the esp_timer task and blinking LEDs are toggled by their own periodic esp_timer,
+* so no task polls the LEDs and nothing runs at all while every LED is static. Setting an LED never blocks.
 */
 
 #pragma once
 
+#include <stdint.h>
+
 #include "esp_err.h"
 
+#define LED_MIN_BLINK_PERIOD_MS 20     /*!< Shorter blink periods are raised to this */
+
 typedef enum {
     LED_STATE_LOW,
     LED_STATE_HIGH,
@@ -23,13 +29,19 @@ typedef enum {
 } led_id_t;
 
 typedef struct {
-    led_id_t id;
     led_state_t state;
-    uint32_t period_ms;
-} led_command_t;
+    uint32_t period_ms;     /*!< Time between blink toggles, N/A if state != blink */
+} led_setting_t;
+
+/**
+* @brief The state of every LED, indexed by led_id_t
+*/
+typedef struct {
+    led_setting_t leds[LED_ID_SIZE];
+} led_frame_t;
 
 /**
-* @brief Initialises the LED GPIO pins and starts the LED freeRTOS task
+* @brief Initialises the LED GPIO pins and creates the LED timers
 *
 * @return esp_err_t The esp error code
 */
@@ -44,3 +56,12 @@ esp_err_t led_service_init(void);
 * @return esp_err_t The esp error code
 */
 esp_err_t led_service_set_led(led_id_t id, led_state_t state, uint32_t period_ms);
+
+/**
+* @brief Sets every LED at once. The frame is applied as a whole, the LEDs never show a mix of an old and a new
+*        frame. Doesn't block, if the previous change hasn't been applied yet it is replaced by this one.
+*
+* @param frame Pointer to the new state of every LED
+* @return esp_err_t The esp error code
+*/
+esp_err_t led_service_set_frame(const led_frame_t *frame);
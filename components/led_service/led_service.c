@@ -1,80 +1,90 @@
 #include "led_service.h"
 
+#include <string.h>
 #include "driver/gpio.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
-#include "freertos/queue.h"
 
 const char *TAG = "LED_SERVICE";
 
-typedef struct {
-    led_state_t state;
-    uint32_t period_ms;
-    TickType_t last_toggle;
-    uint32_t level;
-} led_runtime_t;
-
 static const gpio_num_t LED_PINS[] = {
     GPIO_NUM_4,
     GPIO_NUM_5,
     GPIO_NUM_6
 };
 
-static TaskHandle_t led_task_handle;
-static QueueHandle_t led_queue;
-
-static led_runtime_t led_state[LED_ID_SIZE];
+//Latest requested frame, written by any task and read by the apply timer
+static portMUX_TYPE pending_lock = portMUX_INITIALIZER_UNLOCKED;
+static led_frame_t pending_frame;
 
-static esp_err_t led_command(const led_command_t* command) {
-    if(!command) return ESP_ERR_INVALID_ARG;
+//Only touched from the esp_timer task, which runs the apply and blink callbacks one at a time
+static led_frame_t applied_frame;
+static uint32_t led_level[LED_ID_SIZE];
 
-    led_state[command->id].state = command->state;
-    led_state[command->id].period_ms = command->period_ms;
-    led_state[command->id].last_toggle = xTaskGetTickCount();
+static esp_timer_handle_t apply_timer;
+static esp_timer_handle_t blink_timers[LED_ID_SIZE];
 
-    if (command->state == LED_STATE_BLINK) {
-        led_state[command->id].level = 0;
-        return gpio_set_level(LED_PINS[command->id], 0);
-    } 
-    else {
-        led_state[command->id].level = command->state;
-        return gpio_set_level(LED_PINS[command->id], command->state);
-    }
+static void blink_timer_cb(void *arg) {
+    size_t id = (size_t)arg;
+    led_level[id] = !led_level[id];
+    gpio_set_level(LED_PINS[id], led_level[id]);
 }
 
-static void led_service_task(void *arg) {
-    const TickType_t tick_interval = pdMS_TO_TICKS(50);
-    for(;;) {
-        led_command_t command;
-
-        //Blocks the task while the queue is not empty and processes all the requests before moving on
-        while(xQueueReceive(led_queue, &command, 0) == pdTRUE) {
-            esp_err_t err = led_command(&command);
-            if(err == ESP_OK) {
-                ESP_LOGI(TAG, "Set LED %d to %d", command.id, command.state);
-            }
-            else {
-                ESP_LOGE(TAG, "Failed to set LED level");
-            }
+//Applies the latest requested frame, LEDs whose setting hasn't changed keep their blink phase
+static void apply_timer_cb(void *arg) {
+    led_frame_t frame;
+
+    portENTER_CRITICAL(&pending_lock);
+    frame = pending_frame;
+    portEXIT_CRITICAL(&pending_lock);
+
+    for (size_t i = 0; i < LED_ID_SIZE; i++) {
+        const led_setting_t *setting = &frame.leds[i];
+        if (memcmp(setting, &applied_frame.leds[i], sizeof(*setting)) == 0) continue;
+
+        //Fails harmlessly if the LED wasn't blinking
+        esp_timer_stop(blink_timers[i]);
+
+        esp_err_t err;
+        if (setting->state == LED_STATE_BLINK) {
+            led_level[i] = 0;
+            err = gpio_set_level(LED_PINS[i], 0);
+            if (err == ESP_OK) err = esp_timer_start_periodic(blink_timers[i], (uint64_t)setting->period_ms * 1000);
+        }
+        else {
+            led_level[i] = setting->state;
+            err = gpio_set_level(LED_PINS[i], setting->state);
         }
 
-        //Blink Logic, iterates through each LED which has its own blink state. 
-        //Checks if the current time - the time it was last toggled > the LED period
-        TickType_t now = xTaskGetTickCount();
-        for(size_t i = 0; i < LED_ID_SIZE; i++) {
-            if(led_state[i].state == LED_STATE_BLINK) {
-                if(now - led_state[i].last_toggle >= pdMS_TO_TICKS(led_state[i].period_ms)) {
-                    led_state[i].level = !led_state[i].level;
-                    gpio_set_level(LED_PINS[i], led_state[i].level);
-                    led_state[i].last_toggle = now;
-                }
-            }
+        if (err == ESP_OK) {
+            applied_frame.leds[i] = *setting;
+            ESP_LOGI(TAG, "Set LED %d to %d", (int)i, setting->state);
+        }
+        else {
+            ESP_LOGE(TAG, "Failed to set LED %d: %s", (int)i, esp_err_to_name(err));
         }
-        vTaskDelay(tick_interval);
     }
 }
 
+//Schedules the apply callback, a callback that is already scheduled will pick up the latest frame
+static esp_err_t request_apply(void) {
+    esp_err_t err = esp_timer_start_once(apply_timer, 0);
+    return err == ESP_ERR_INVALID_STATE ? ESP_OK : err;
+}
+
+static bool setting_valid(led_setting_t *setting) {
+    if (setting->state >= LED_STATE_SIZE) return false;
+
+    if (setting->state != LED_STATE_BLINK) {
+        setting->period_ms = 0;
+    }
+    else if (setting->period_ms < LED_MIN_BLINK_PERIOD_MS) {
+        setting->period_ms = LED_MIN_BLINK_PERIOD_MS;
+    }
+    return true;
+}
+
 esp_err_t led_service_init(void) {
     /*Configuration of the LED GPIO Pins*/
     gpio_config_t io_conf = {
@@ -100,27 +110,58 @@ esp_err_t led_service_init(void) {
 
     /*Initialize LED states*/
     for (size_t i = 0; i < LED_ID_SIZE; i++) {
-        led_state[i].state = LED_STATE_LOW;
-        led_state[i].level = 0;
-        led_state[i].period_ms = 0;
-        led_state[i].last_toggle = 0;
+        pending_frame.leds[i] = (led_setting_t){ .state = LED_STATE_LOW, .period_ms = 0 };
+        applied_frame.leds[i] = pending_frame.leds[i];
+        led_level[i] = 0;
+        gpio_set_level(LED_PINS[i], 0);
+    }
+
+    /*LED Service timers, the callbacks run in the esp_timer task*/
+    const esp_timer_create_args_t apply_args = {
+        .callback = apply_timer_cb,
+        .name = "led_apply",
+    };
+    err = esp_timer_create(&apply_args, &apply_timer);
+    if (err != ESP_OK) return err;
+
+    for (size_t i = 0; i < LED_ID_SIZE; i++) {
+        const esp_timer_create_args_t blink_args = {
+            .callback = blink_timer_cb,
+            .arg = (void *)i,
+            .name = "led_blink",
+        };
+        err = esp_timer_create(&blink_args, &blink_timers[i]);
+        if (err != ESP_OK) return err;
     }
 
-    /*LED Service Queue and Task initialization*/
-    led_queue = xQueueCreate(10, sizeof(led_command_t));
-    BaseType_t ok = xTaskCreate(led_service_task, "LED Task", 4096, NULL, 5, &led_task_handle);
-    
-    return ok == pdPASS ? ESP_OK : ESP_ERR_NO_MEM;
+    return ESP_OK;
 }
 
 esp_err_t led_service_set_led(led_id_t id, led_state_t state, uint32_t period_ms) {
-    //Places all requests into the queue for the task to process, preventing blocking of other tasks
-    if(id >= LED_ID_SIZE || state >= LED_STATE_SIZE) return ESP_ERR_INVALID_ARG;
-    led_command_t command = {
-        .id = id,
+    led_setting_t setting = {
         .state = state,
         .period_ms = period_ms
     };
-    BaseType_t ok = xQueueSend(led_queue, &command, portMAX_DELAY);
-    return ok == pdPASS ? ESP_OK : ESP_ERR_TIMEOUT;
+    if(id >= LED_ID_SIZE || !setting_valid(&setting)) return ESP_ERR_INVALID_ARG;
+
+    portENTER_CRITICAL(&pending_lock);
+    pending_frame.leds[id] = setting;
+    portEXIT_CRITICAL(&pending_lock);
+
+    return request_apply();
+}
+
+esp_err_t led_service_set_frame(const led_frame_t *frame) {
+    if(!frame) return ESP_ERR_INVALID_ARG;
+
+    led_frame_t checked = *frame;
+    for (size_t i = 0; i < LED_ID_SIZE; i++) {
+        if (!setting_valid(&checked.leds[i])) return ESP_ERR_INVALID_ARG;
+    }
+
+    portENTER_CRITICAL(&pending_lock);
+    pending_frame = checked;
+    portEXIT_CRITICAL(&pending_lock);
+
+    return request_apply();
 }
@@ -0,0 +1,49 @@
+/**
+* @file mqtt_command.h
+* @brief Runtime settings over a per-device MQTT command topic
+*
+* The device subscribes to AirQuality/<mac>/cmd, <mac> being its station MAC address as 12 hex digits. A command
+* is a list of key=value pairs separated by spaces, commas or semicolons, e.g. "id=7 sample_s=30 batch=5 log=2".
+* An id, given first, is echoed in the reply so the sender can match them up. The keys are:
+*
+*   sample_s                Sample period in whole seconds
+*   batch, report_s         Samples per batch and the longest a sample waits for its batch, with batching enabled
+*   db_temp, db_hum         Absolute deadbands in 0.01 degC and 0.01 %RH, with the deadband filter enabled
+*   db_eco2, db_tvoc        Absolute deadbands in ppm and ppb
+*   db_*_pm                 Relative deadband of a channel in 0.1 %
+*   heartbeat_s             Longest time without a report
+*   co2_warn, co2_danger    eCO2 levels at which the LEDs turn yellow and red
+*   log                     Log level, 0 (none) to 5 (verbose) or its name
+*
+* Every value is checked before anything changes, so a command is applied as a whole or not at all. The new
+* settings reach each task in one piece at its next cycle, and are persisted in the state store so they survive
+* a reboot. The reply on AirQuality/<mac>/cmd/reply is {"id": 7, "ok": true, ...} with every setting now in use,
+* or {"id": 7, "ok": false, "error": "..."} with nothing changed. A command with no settings just reads them.
+*/
+
+#pragma once
+
+#include "esp_err.h"
+#include "mqtt_client.h"
+
+/**
+* @brief Works out the device's topics and applies the settings persisted by earlier commands. Called by
+*        mqtt_service_start() once the defaults are in place and before the client starts.
+*
+* @return esp_err_t The esp error code
+*/
+esp_err_t mqtt_command_init(void);
+
+/**
+* @brief Subscribes to the command topic, called on every MQTT_EVENT_CONNECTED
+*
+* @param client The MQTT client
+*/
+void mqtt_command_subscribe(esp_mqtt_client_handle_t client);
+
+/**
+* @brief Runs a command and publishes the reply, called on every MQTT_EVENT_DATA. Messages on other topics are ignored.
+*
+* @param event The data event
+*/
+void mqtt_command_handle(const esp_mqtt_event_t *event);
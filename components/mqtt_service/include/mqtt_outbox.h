@@ -0,0 +1,79 @@
+/**
+* @file mqtt_outbox.h
+* @brief Bounded, non-blocking front end to the MQTT client's outbox
+*
+* Messages are handed to the client with esp_mqtt_client_enqueue(), which copies them into the client's outbox
+* and returns straight away, the client task sends them. The outbox holds every message until it has been sent,
+* and QoS 1 messages until their PUBACK, so a slow broker makes it grow. Messages are only accepted while the
+* outbox stays within the configured byte budget, except that an empty outbox takes one message of any size so
+* a large batch can't be refused forever. What happens to a message that doesn't fit depends on its policy:
+* samples are refused and stay with the caller, best effort snapshots are dropped.
+*
+* Above the high watermark the outbox signals backpressure, callers batching or pacing data should hold back
+* until it clears. The outbox size, its peak and the PUBACK latency are reported as diagnostics gauges.
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "mqtt_client.h"
+
+/*!< Returned by mqtt_outbox_publish() when the message didn't fit in the budget */
+#define MQTT_OUTBOX_FULL -2
+
+/**
+* @brief What happens to a message that doesn't fit in the budget
+*/
+typedef enum {
+    MQTT_OUTBOX_HOLD,       /*!< Refused, the caller keeps the data and tries again later */
+    MQTT_OUTBOX_DROP,       /*!< Dropped and counted, for data the next message supersedes */
+} mqtt_outbox_policy_t;
+
+/**
+* @brief Sets the client messages are enqueued on
+*
+* @param client The MQTT client
+*/
+void mqtt_outbox_init(esp_mqtt_client_handle_t client);
+
+/**
+* @brief Enqueues a message on the client without blocking
+*
+* @param topic Topic to publish to
+* @param data Payload
+* @param len Payload length in bytes
+* @param qos QoS level, QoS 1 messages stay in the outbox until their PUBACK
+* @param policy What to do if the message doesn't fit
+* @return int The msg_id, MQTT_OUTBOX_FULL if the message didn't fit or -1 if the client failed
+*/
+int mqtt_outbox_publish(const char *topic, const char *data, int len, int qos, mqtt_outbox_policy_t policy);
+
+/**
+* @brief Records the PUBACK of a message, called from the client's MQTT_EVENT_PUBLISHED event
+*
+* @param msg_id The msg_id of the acknowledged message
+*/
+void mqtt_outbox_acked(int msg_id);
+
+/**
+* @brief Returns the bytes the client holds for messages that haven't been sent or, at QoS 1, acknowledged
+*
+* @return size_t The outbox size
+*/
+size_t mqtt_outbox_bytes(void);
+
+/**
+* @brief Checks whether the outbox is above its high watermark
+*
+* @return bool True while callers should hold back
+*/
+bool mqtt_outbox_backpressure(void);
+
+/**
+* @brief Refreshes the outbox size gauges, e.g. before a diagnostics snapshot
+*/
+void mqtt_outbox_update_gauges(void);
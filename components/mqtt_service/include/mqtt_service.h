@@ -6,19 +6,100 @@
 
 #pragma once
 
+#include "sdkconfig.h"
 #include "esp_err.h"
 #include <stdbool.h>
+#include <stdint.h>
+
+#if CONFIG_MQTT_DEADBAND_ENABLE
+#include "report_filter.h"
+#endif
 
 /**
-* @brief Initialises the mqtt client configuration and starts the FreeRTOS MQTT task
+* @brief Publishing settings that can be changed while the service runs
+*/
+typedef struct {
+    uint16_t batch_max_samples;     /*!< Samples per batch, 1 to CONFIG_MQTT_BATCH_MAX_SAMPLES, 1 without batching */
+    uint32_t batch_max_age_ms;      /*!< Longest a sample waits for its batch to fill, 0 without batching */
+    uint16_t co2_warning_ppm;       /*!< eCO2 from which the LEDs show a warning */
+    uint16_t co2_danger_ppm;        /*!< eCO2 from which the LEDs show danger, above the warning level */
+#if CONFIG_MQTT_DEADBAND_ENABLE
+    report_filter_config_t filter;  /*!< Deadbands and heartbeat */
+#endif
+} mqtt_publish_config_t;
+
+/**
+* @brief Initialises the mqtt client configuration and starts the FreeRTOS MQTT task. Doesn't need the network,
+*        samples are held until mqtt_service_connect() has been called and the client has connected.
 *
 * @return esp_err_t The esp error code
 */
 esp_err_t mqtt_service_start(void);
 
+/**
+* @brief Starts the MQTT client connecting to the broker, call it once the network is up. The client reconnects
+*        on its own after that, so further calls do nothing. Also registers the flush on restart, which has to
+*        come after Wi-Fi is initialised so it runs before Wi-Fi is stopped.
+*
+* @return esp_err_t The esp error code, ESP_ERR_INVALID_STATE if the service hasn't been started
+*/
+esp_err_t mqtt_service_connect(void);
+
 /**
 * @brief Helper function to check if MQTT client is connected to the broker
 *
 * @return bool True if connected, false if disconnected
 */
 bool mqtt_client_connected(void);
+
+/**
+* @brief Checks whether the MQTT outbox is above its high watermark. Producers can publish less often or in
+*        larger batches until it clears.
+*
+* @return bool True while the broker is falling behind
+*/
+bool mqtt_service_backpressure(void);
+
+/**
+* @brief Publishes any samples being held for a batch straight away instead of waiting for the batch to fill,
+*        and waits until the broker has acknowledged them. Also runs automatically when the device restarts.
+*
+* @param timeout_ms Maximum time in milliseconds to wait for the MQTT task to publish and the broker to acknowledge
+* @return esp_err_t The esp error code, ESP_ERR_INVALID_STATE if the client isn't connected
+*/
+esp_err_t mqtt_service_flush(uint32_t timeout_ms);
+
+/**
+* @brief Replaces the publishing settings as a whole, the publisher never sees half of a change. Takes effect from
+*        the next sample. mqtt_service_start() loads the menuconfig defaults and any settings persisted by the
+*        MQTT commands, so call it after the service has started.
+*
+* @param config Pointer to the new settings
+* @return esp_err_t ESP_ERR_INVALID_ARG if the batch size is out of range or the warning level isn't below danger
+*/
+esp_err_t mqtt_service_set_publish_config(const mqtt_publish_config_t *config);
+
+/**
+* @brief Reads the publishing settings currently in use
+*
+* @param config Pointer to a structure that receives the settings
+*/
+void mqtt_service_get_publish_config(mqtt_publish_config_t *config);
+
+#if CONFIG_MQTT_DEADBAND_ENABLE
+/**
+* @brief Replaces the deadbands and heartbeat used to decide which samples are published. Takes effect from the
+*        next sample. mqtt_service_start() loads the menuconfig defaults, so call it after the service has started.
+*
+* @param config Pointer to the new thresholds
+* @return esp_err_t The esp error code
+*/
+esp_err_t mqtt_service_set_report_filter(const report_filter_config_t *config);
+
+/**
+* @brief Reads the deadbands and heartbeat currently in use
+*
+* @param config Pointer to a structure that receives the thresholds
+*/
+void mqtt_service_get_report_filter(report_filter_config_t *config);
+#endif
@@ -0,0 +1,64 @@
+/**
+* @file report_filter.h
+* @brief Deadband filter that decides which samples are worth publishing
+*
+* A sample is reported when any channel has moved beyond its deadband since the last reported sample, or when
+* nothing has been reported for the heartbeat interval so the receiver can tell a steady reading from a dead
+* device. A channel's deadband is the larger of its absolute threshold and its relative threshold applied to
+* the last reported value, so small readings use the absolute floor and large ones the percentage.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sensor_service.h"
+
+typedef enum {
+    REPORT_CHANNEL_TEMPERATURE,     /*!< 0.01 degC */
+    REPORT_CHANNEL_HUMIDITY,        /*!< 0.01 %RH */
+    REPORT_CHANNEL_ECO2,            /*!< ppm */
+    REPORT_CHANNEL_TVOC,            /*!< ppb */
+    REPORT_CHANNEL_COUNT
+} report_channel_t;
+
+/**
+* @brief Deadband of one channel, a change is reported when it exceeds the larger of the two thresholds.
+*        With both at 0 any change is reported.
+*/
+typedef struct {
+    uint32_t absolute;              /*!< Change in the channel's units */
+    uint16_t relative_permille;     /*!< Change relative to the last reported value in 0.1 % */
+} report_deadband_t;
+
+typedef struct {
+    report_deadband_t deadband[REPORT_CHANNEL_COUNT];
+    uint32_t heartbeat_s;           /*!< Longest time without a report, 0 reports only on change */
+} report_filter_config_t;
+
+/**
+* @brief What was last reported, starts zeroed so the first sample is always reported
+*/
+typedef struct {
+    bool reported;
+    int32_t last[REPORT_CHANNEL_COUNT];
+    uint32_t last_report_ms;
+} report_filter_state_t;
+
+/**
+* @brief Fills in the thresholds chosen in menuconfig
+*
+* @param config Pointer to the configuration to fill in
+*/
+void report_filter_default_config(report_filter_config_t *config);
+
+/**
+* @brief Checks a sample against the deadbands and heartbeat, and records it as reported if it passes
+*
+* @param state Pointer to the filter state
+* @param config Pointer to the thresholds
+* @param sample The sample to check
+* @return bool True if the sample should be reported
+*/
+bool report_filter_check(report_filter_state_t *state, const report_filter_config_t *config, const sensor_data_t *sample);
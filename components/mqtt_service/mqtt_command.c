@@ -0,0 +1,324 @@
+#include "mqtt_command.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_mac.h"
+#include "esp_log.h"
+
+#include "mqtt_service.h"
+#include "mqtt_outbox.h"
+#include "sensor_service.h"
+#include "state_store.h"
+
+#define MQTT_COMMAND_TOPIC_FMT "AirQuality/%02x%02x%02x%02x%02x%02x/cmd"
+#define MQTT_COMMAND_TOPIC_SIZE 48
+#define MQTT_COMMAND_MAX_SIZE 256
+#define MQTT_COMMAND_REPLY_SIZE 512
+#define MQTT_COMMAND_ERROR_SIZE 64
+#define MQTT_COMMAND_SEPARATORS " ,;\t\r\n"
+
+#if CONFIG_MQTT_DEADBAND_ENABLE
+_Static_assert(REPORT_CHANNEL_COUNT == STATE_STORE_DEADBAND_COUNT, "Stored deadbands must cover every channel");
+#endif
+
+static const char *TAG = "MQTT_COMMAND";
+
+static char command_topic[MQTT_COMMAND_TOPIC_SIZE];
+static char reply_topic[MQTT_COMMAND_TOPIC_SIZE];
+static esp_log_level_t log_level = CONFIG_LOG_DEFAULT_LEVEL;
+
+static const char *const log_level_names[] = { "none", "error", "warn", "info", "debug", "verbose" };
+
+//A key and the field of the settings it sets, the value given is multiplied by unit before it is stored
+typedef struct {
+    const char *name;
+    size_t offset;
+    size_t size;
+    uint32_t min;
+    uint32_t max;
+    uint32_t unit;
+} command_key_t;
+
+#define COMMAND_KEY(name, field, min, max, unit) \
+    { name, offsetof(state_store_settings_t, field), sizeof(((state_store_settings_t *)0)->field), min, max, unit }
+
+//Ranges match the menuconfig options
+static const command_key_t command_keys[] = {
+    COMMAND_KEY("sample_s", sample_period_ms, SENSOR_SAMPLE_PERIOD_MIN_MS / 1000, SENSOR_SAMPLE_PERIOD_MAX_MS / 1000, 1000),
+#if CONFIG_MQTT_BATCH_ENABLE
+    COMMAND_KEY("batch", batch_max_samples, 1, CONFIG_MQTT_BATCH_MAX_SAMPLES, 1),
+    COMMAND_KEY("report_s", batch_max_age_ms, 1, 3600, 1000),
+#endif
+#if CONFIG_MQTT_DEADBAND_ENABLE
+    COMMAND_KEY("db_temp", deadband_absolute[REPORT_CHANNEL_TEMPERATURE], 0, 1000, 1),
+    COMMAND_KEY("db_temp_pm", deadband_permille[REPORT_CHANNEL_TEMPERATURE], 0, 1000, 1),
+    COMMAND_KEY("db_hum", deadband_absolute[REPORT_CHANNEL_HUMIDITY], 0, 2000, 1),
+    COMMAND_KEY("db_hum_pm", deadband_permille[REPORT_CHANNEL_HUMIDITY], 0, 1000, 1),
+    COMMAND_KEY("db_eco2", deadband_absolute[REPORT_CHANNEL_ECO2], 0, 10000, 1),
+    COMMAND_KEY("db_eco2_pm", deadband_permille[REPORT_CHANNEL_ECO2], 0, 1000, 1),
+    COMMAND_KEY("db_tvoc", deadband_absolute[REPORT_CHANNEL_TVOC], 0, 10000, 1),
+    COMMAND_KEY("db_tvoc_pm", deadband_permille[REPORT_CHANNEL_TVOC], 0, 1000, 1),
+    COMMAND_KEY("heartbeat_s", heartbeat_s, 0, 86400, 1),
+#endif
+    COMMAND_KEY("co2_warn", co2_warning_ppm, 1, UINT16_MAX, 1),
+    COMMAND_KEY("co2_danger", co2_danger_ppm, 1, UINT16_MAX, 1),
+    COMMAND_KEY("log", log_level, ESP_LOG_NONE, CONFIG_LOG_MAXIMUM_LEVEL, 1),
+};
+
+static uint32_t read_field(const state_store_settings_t *settings, const command_key_t *key) {
+    const uint8_t *field = (const uint8_t *)settings + key->offset;
+    if (key->size == sizeof(uint32_t)) return *(const uint32_t *)field;
+    if (key->size == sizeof(uint16_t)) return *(const uint16_t *)field;
+    return *field;
+}
+
+static void write_field(state_store_settings_t *settings, const command_key_t *key, uint32_t value) {
+    uint8_t *field = (uint8_t *)settings + key->offset;
+    if (key->size == sizeof(uint32_t)) *(uint32_t *)field = value;
+    else if (key->size == sizeof(uint16_t)) *(uint16_t *)field = (uint16_t)value;
+    else *field = (uint8_t)value;
+}
+
+static const command_key_t *find_key(const char *name) {
+    for (size_t i = 0; i < sizeof(command_keys) / sizeof(command_keys[0]); i++) {
+        if (strcmp(command_keys[i].name, name) == 0) return &command_keys[i];
+    }
+    return NULL;
+}
+
+//Plain decimal, no sign, no trailing characters
+static bool parse_number(const char *text, uint32_t *value) {
+    if (*text < '0' || *text > '9') return false;
+
+    char *end;
+    unsigned long number = strtoul(text, &end, 10);
+    if (*end != '\0' || number > UINT32_MAX) return false;
+    *value = (uint32_t)number;
+    return true;
+}
+
+static bool parse_value(const command_key_t *key, const char *text, uint32_t *value) {
+    if (parse_number(text, value)) return true;
+
+    //The log level can also be given by name
+    if (strcmp(key->name, "log") == 0) {
+        for (uint32_t level = 0; level < sizeof(log_level_names) / sizeof(log_level_names[0]); level++) {
+            if (strcmp(text, log_level_names[level]) == 0) {
+                *value = level;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+//Only names that could be keys are echoed in an error, so the reply never needs escaping
+static const char *printable_name(const char *name) {
+    if (strlen(name) > 16) return "?";
+    for (const char *c = name; *c; c++) {
+        if (!((*c >= 'a' && *c <= 'z') || (*c >= '0' && *c <= '9') || *c == '_')) return "?";
+    }
+    return name;
+}
+
+//Collects the settings in use from the services that own them
+static void read_settings(state_store_settings_t *settings) {
+    mqtt_publish_config_t config;
+    mqtt_service_get_publish_config(&config);
+
+    *settings = (state_store_settings_t){
+        .sample_period_ms = sensor_service_sample_period(),
+        .batch_max_age_ms = config.batch_max_age_ms,
+        .batch_max_samples = config.batch_max_samples,
+        .co2_warning_ppm = config.co2_warning_ppm,
+        .co2_danger_ppm = config.co2_danger_ppm,
+        .log_level = (uint8_t)log_level,
+    };
+#if CONFIG_MQTT_DEADBAND_ENABLE
+    for (int i = 0; i < REPORT_CHANNEL_COUNT; i++) {
+        settings->deadband_absolute[i] = config.filter.deadband[i].absolute;
+        settings->deadband_permille[i] = config.filter.deadband[i].relative_permille;
+    }
+    settings->heartbeat_s = config.filter.heartbeat_s;
+    settings->deadband_valid = 1;
+#endif
+}
+
+//Hands the settings to the services. The publishing settings go in one piece, so this only fails before
+//anything has changed.
+static esp_err_t apply_settings(const state_store_settings_t *settings) {
+    mqtt_publish_config_t config;
+    mqtt_service_get_publish_config(&config);
+
+    config.batch_max_age_ms = settings->batch_max_age_ms;
+    config.batch_max_samples = settings->batch_max_samples;
+    config.co2_warning_ppm = settings->co2_warning_ppm;
+    config.co2_danger_ppm = settings->co2_danger_ppm;
+#if CONFIG_MQTT_DEADBAND_ENABLE
+    //Settings stored by firmware without the filter leave the defaults in place
+    if (settings->deadband_valid) {
+        for (int i = 0; i < REPORT_CHANNEL_COUNT; i++) {
+            config.filter.deadband[i].absolute = settings->deadband_absolute[i];
+            config.filter.deadband[i].relative_permille = settings->deadband_permille[i];
+        }
+        config.filter.heartbeat_s = settings->heartbeat_s;
+    }
+#endif
+    if (settings->log_level > CONFIG_LOG_MAXIMUM_LEVEL) return ESP_ERR_INVALID_ARG;
+
+    esp_err_t err = mqtt_service_set_publish_config(&config);
+    if (err != ESP_OK) return err;
+
+    //Checked against the same range as the key, so it can't be refused once the publishing settings were taken
+    err = sensor_service_set_sample_period(settings->sample_period_ms);
+    if (err != ESP_OK) ESP_LOGE(TAG, "Sample period %lu ms refused", (unsigned long)settings->sample_period_ms);
+
+    log_level = (esp_log_level_t)settings->log_level;
+    esp_log_level_set("*", log_level);
+    return ESP_OK;
+}
+
+//Parses and applies a command, returns false with the reason in error if nothing was changed
+static bool run_command(char *command, uint32_t *id, char *error, size_t error_size) {
+    state_store_settings_t current;
+    read_settings(&current);
+    state_store_settings_t settings = current;
+
+    char *save;
+    for (char *token = strtok_r(command, MQTT_COMMAND_SEPARATORS, &save); token; token = strtok_r(NULL, MQTT_COMMAND_SEPARATORS, &save)) {
+        char *value = strchr(token, '=');
+        if (!value) {
+            snprintf(error, error_size, "expected key=value");
+            return false;
+        }
+        *value++ = '\0';
+
+        if (strcmp(token, "id") == 0) {
+            if (!parse_number(value, id)) {
+                snprintf(error, error_size, "bad id");
+                return false;
+            }
+            continue;
+        }
+
+        const command_key_t *key = find_key(token);
+        if (!key) {
+            snprintf(error, error_size, "unknown key %s", printable_name(token));
+            return false;
+        }
+
+        uint32_t number;
+        if (!parse_value(key, value, &number) || number < key->min || number > key->max) {
+            snprintf(error, error_size, "%s must be %lu to %lu", key->name, (unsigned long)key->min, (unsigned long)key->max);
+            return false;
+        }
+        write_field(&settings, key, number * key->unit);
+    }
+
+    if (settings.co2_warning_ppm >= settings.co2_danger_ppm) {
+        snprintf(error, error_size, "co2_warn must be below co2_danger");
+        return false;
+    }
+
+    //A read, or a command that repeats the settings in use, costs no flash write
+    if (memcmp(&settings, &current, sizeof(settings)) == 0) return true;
+
+    esp_err_t err = apply_settings(&settings);
+    if (err != ESP_OK) {
+        snprintf(error, error_size, "rejected: %s", esp_err_to_name(err));
+        return false;
+    }
+    ESP_LOGI(TAG, "Command %lu applied", (unsigned long)*id);
+
+    //Written by the store's worker, the client task doesn't wait for the flash
+    state_store_set_settings(&settings);
+    state_store_commit_async();
+    return true;
+}
+
+//Formats the reply, every setting in use on success. Returns its length or -1 if it didn't fit.
+static int format_reply(char *buf, size_t size, uint32_t id, bool ok, const char *error) {
+    int len;
+    if (!ok) {
+        len = snprintf(buf, size, "{\"id\": %lu, \"ok\": false, \"error\": \"%s\"}", (unsigned long)id, error);
+        return len < 0 || (size_t)len >= size ? -1 : len;
+    }
+
+    state_store_settings_t settings;
+    read_settings(&settings);
+
+    len = snprintf(buf, size, "{\"id\": %lu, \"ok\": true", (unsigned long)id);
+    for (size_t i = 0; i < sizeof(command_keys) / sizeof(command_keys[0]) && len >= 0 && (size_t)len < size; i++) {
+        const command_key_t *key = &command_keys[i];
+        int written = snprintf(&buf[len], size - len, ", \"%s\": %lu", key->name, (unsigned long)(read_field(&settings, key) / key->unit));
+        len = written < 0 ? -1 : len + written;
+    }
+    if (len < 0 || (size_t)len + 2 > size) return -1;
+    buf[len++] = '}';
+    buf[len] = '\0';
+    return len;
+}
+
+esp_err_t mqtt_command_init(void) {
+    uint8_t mac[6];
+    esp_err_t err = esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    if (err != ESP_OK) return err;
+
+    snprintf(command_topic, sizeof(command_topic), MQTT_COMMAND_TOPIC_FMT, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    snprintf(reply_topic, sizeof(reply_topic), MQTT_COMMAND_TOPIC_FMT "/reply", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    ESP_LOGI(TAG, "Commands on %s", command_topic);
+
+    err = state_store_init();
+    if (err != ESP_OK) return err;
+
+    state_store_settings_t settings;
+    if (!state_store_get_settings(&settings)) return ESP_OK;
+
+    //Settings from a build with other limits, e.g. a smaller batch, are dropped rather than stopping the service
+    err = apply_settings(&settings);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Stored settings rejected, using the defaults: %s", esp_err_to_name(err));
+    }
+    return ESP_OK;
+}
+
+void mqtt_command_subscribe(esp_mqtt_client_handle_t client) {
+    int msg_id = esp_mqtt_client_subscribe(client, command_topic, 1);
+    if (msg_id < 0) {
+        ESP_LOGE(TAG, "Failed to subscribe to %s", command_topic);
+    }
+}
+
+void mqtt_command_handle(const esp_mqtt_event_t *event) {
+    static char reply[MQTT_COMMAND_REPLY_SIZE];
+    char command[MQTT_COMMAND_MAX_SIZE];
+    char error[MQTT_COMMAND_ERROR_SIZE];
+
+    //Later fragments of a long message carry no topic and are ignored along with other topics
+    if (event->topic_len != (int)strlen(command_topic) || memcmp(event->topic, command_topic, event->topic_len) != 0) return;
+
+    uint32_t id = 0;
+    bool ok = false;
+    if (event->total_data_len >= (int)sizeof(command)) {
+        snprintf(error, sizeof(error), "command over %d bytes", MQTT_COMMAND_MAX_SIZE - 1);
+    }
+    else {
+        memcpy(command, event->data, event->data_len);
+        command[event->data_len] = '\0';
+        ok = run_command(command, &id, error, sizeof(error));
+    }
+    if (!ok) ESP_LOGW(TAG, "Command %lu failed: %s", (unsigned long)id, error);
+
+    int len = format_reply(reply, sizeof(reply), id, ok, error);
+    if (len < 0) {
+        ESP_LOGE(TAG, "Reply too large");
+        return;
+    }
+
+    //The handler can't wait for the outbox to drain, a reply that doesn't fit is dropped and counted
+    int msg_id = mqtt_outbox_publish(reply_topic, reply, len, 1, MQTT_OUTBOX_DROP);
+    if (msg_id < 0 && msg_id != MQTT_OUTBOX_FULL) {
+        ESP_LOGE(TAG, "Failed to publish reply");
+    }
+}
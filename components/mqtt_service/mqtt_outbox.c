@@ -0,0 +1,94 @@
+#include "mqtt_outbox.h"
+
+#include <stdatomic.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#include "diagnostics.h"
+#include "stats.h"
+
+#define MQTT_OUTBOX_BUDGET_BYTES CONFIG_MQTT_OUTBOX_BUDGET_BYTES
+#define MQTT_OUTBOX_HIGH_WATERMARK_BYTES (MQTT_OUTBOX_BUDGET_BYTES * CONFIG_MQTT_OUTBOX_HIGH_WATERMARK_PERCENT / 100)
+//Acknowledgements tracked at once for the PUBACK latency, more messages in flight than this aren't timed
+#define MQTT_OUTBOX_ACK_SLOTS 16
+
+_Static_assert((MQTT_OUTBOX_ACK_SLOTS & (MQTT_OUTBOX_ACK_SLOTS - 1)) == 0, "Ack slots must be a power of two");
+
+static esp_mqtt_client_handle_t outbox_client;
+static uint32_t peak_bytes = 0;
+
+//msg_id of each tracked message and when it was enqueued, the ack arrives on the client's task
+static atomic_int ack_ids[MQTT_OUTBOX_ACK_SLOTS];
+static atomic_llong ack_starts[MQTT_OUTBOX_ACK_SLOTS];
+
+//PUBACK latency summary, only touched from the client's event handler
+static uint32_t ack_count = 0;
+static uint32_t ack_max_ms = 0;
+static stats_p2_t ack_p99;
+
+size_t mqtt_outbox_bytes(void) {
+    int size = esp_mqtt_client_get_outbox_size(outbox_client);
+    return size > 0 ? (size_t)size : 0;
+}
+
+void mqtt_outbox_init(esp_mqtt_client_handle_t client) {
+    outbox_client = client;
+    for (size_t i = 0; i < MQTT_OUTBOX_ACK_SLOTS; i++) {
+        atomic_store_explicit(&ack_ids[i], -1, memory_order_relaxed);
+    }
+}
+
+int mqtt_outbox_publish(const char *topic, const char *data, int len, int qos, mqtt_outbox_policy_t policy) {
+    //A message larger than the whole budget still goes out on its own, otherwise it would be refused forever
+    size_t bytes = mqtt_outbox_bytes();
+    if (bytes > 0 && bytes + (size_t)len > MQTT_OUTBOX_BUDGET_BYTES) {
+        diagnostics_count(policy == MQTT_OUTBOX_DROP ? DIAG_OUTBOX_DROPPED : DIAG_OUTBOX_REFUSED);
+        return MQTT_OUTBOX_FULL;
+    }
+
+    int64_t start_us = esp_timer_get_time();
+    //Stored even at QoS 0 so every message goes out from the client task instead of blocking this one.
+    //-2 is the client's own outbox limit, which is set to the budget as a backstop.
+    int msg_id = esp_mqtt_client_enqueue(outbox_client, topic, data, len, qos, 0, true);
+    if (msg_id == -2) {
+        diagnostics_count(policy == MQTT_OUTBOX_DROP ? DIAG_OUTBOX_DROPPED : DIAG_OUTBOX_REFUSED);
+        return MQTT_OUTBOX_FULL;
+    }
+    if (msg_id < 0) return -1;
+
+    if (qos > 0) {
+        size_t slot = (size_t)msg_id & (MQTT_OUTBOX_ACK_SLOTS - 1);
+        atomic_store_explicit(&ack_starts[slot], start_us, memory_order_relaxed);
+        //Published last so an ack never pairs the id with a stale start
+        atomic_store_explicit(&ack_ids[slot], msg_id, memory_order_release);
+    }
+    mqtt_outbox_update_gauges();
+    return msg_id;
+}
+
+void mqtt_outbox_acked(int msg_id) {
+    if (msg_id < 0) return;
+
+    size_t slot = (size_t)msg_id & (MQTT_OUTBOX_ACK_SLOTS - 1);
+    int expected = msg_id;
+    if (!atomic_compare_exchange_strong_explicit(&ack_ids[slot], &expected, -1, memory_order_acquire, memory_order_relaxed)) return;
+
+    uint32_t latency_ms = (uint32_t)((esp_timer_get_time() - atomic_load_explicit(&ack_starts[slot], memory_order_relaxed)) / 1000);
+    if (latency_ms > ack_max_ms) ack_max_ms = latency_ms;
+    stats_quantile_add(&ack_p99, 0.99f, (float)latency_ms, ++ack_count);
+    diagnostics_set_gauge(DIAG_PUBACK_LATENCY_MAX_MS, ack_max_ms);
+    diagnostics_set_gauge(DIAG_PUBACK_LATENCY_P99_MS, (uint32_t)stats_quantile_estimate(&ack_p99, 0.99f, ack_count));
+}
+
+bool mqtt_outbox_backpressure(void) {
+    return mqtt_outbox_bytes() >= MQTT_OUTBOX_HIGH_WATERMARK_BYTES;
+}
+
+void mqtt_outbox_update_gauges(void) {
+    uint32_t bytes = (uint32_t)mqtt_outbox_bytes();
+    if (bytes > peak_bytes) peak_bytes = bytes;
+    diagnostics_set_gauge(DIAG_OUTBOX_BYTES, bytes);
+    diagnostics_set_gauge(DIAG_OUTBOX_PEAK_BYTES, peak_bytes);
+}
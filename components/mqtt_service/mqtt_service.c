@@ -1,20 +1,133 @@
 #include "mqtt_service.h"
 
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_system.h"
 #include "mqtt_client.h"
 #include "esp_log.h"
 
 #include "sensor_service.h"
+#include "sensor_ring.h"
 #include "led_service.h"
+#include "telemetry_codec.h"
+#include "diagnostics.h"
+#include "latency.h"
+#include "mqtt_outbox.h"
+#if CONFIG_RUNTIME_EVENT_LOOP
+#include "runtime.h"
+#endif
+#if CONFIG_SAMPLE_STORE_ENABLE
+#include "sample_store.h"
+#endif
+#if CONFIG_MQTT_PUBLISH_STATS
+#include "sensor_stats.h"
+#endif
+#if CONFIG_MQTT_DEADBAND_ENABLE
+#include "report_filter.h"
+#endif
+#if CONFIG_MQTT_COMMANDS_ENABLE
+#include "mqtt_command.h"
+#endif
 
-static const char *TAG = "MQTT";
+#if CONFIG_MQTT_PAYLOAD_FORMAT_BINARY
+#define MQTT_TOPIC "AirQuality/bin"
+#define MQTT_REPLAY_TOPIC "AirQuality/replay/bin"
+#else
+#define MQTT_TOPIC "AirQuality"
+#define MQTT_REPLAY_TOPIC "AirQuality/replay"
+#endif
+#define MQTT_RETRY_PERIOD_MS 1000
+#define MQTT_SHUTDOWN_FLUSH_MS 2000
+#define MQTT_FLUSH_POLL_MS 10
+#define MQTT_DIAGNOSTICS_TOPIC "AirQuality/diagnostics"
+#define MQTT_DIAGNOSTICS_PAYLOAD_SIZE 1280
+#define MQTT_LATENCY_TOPIC "AirQuality/latency"
+#define MQTT_LATENCY_PAYLOAD_SIZE 2560
+#define MQTT_STATS_TOPIC "AirQuality/stats"
+#define MQTT_STATS_PAYLOAD_SIZE 768
+//Default eCO2 levels at which the LEDs turn yellow and red
+#define MQTT_CO2_WARNING_PPM 1000
+#define MQTT_CO2_DANGER_PPM 5000
+
+//Diagnostics, latency and stats snapshots that don't fit in the outbox are either dropped until the next
+//interval or retried on every step, each retry taking a fresh snapshot so only the newest one goes out
+#if CONFIG_MQTT_OUTBOX_SNAPSHOT_COALESCE
+#define MQTT_SNAPSHOT_POLICY MQTT_OUTBOX_HOLD
+#else
+#define MQTT_SNAPSHOT_POLICY MQTT_OUTBOX_DROP
+#endif
+
+#if CONFIG_MQTT_PUBLISH_SAMPLES
+#define MQTT_PUBLISH_SAMPLES 1
+#else
+#define MQTT_PUBLISH_SAMPLES 0
+#endif
+
+#if CONFIG_MQTT_BATCH_ENABLE
+#define MQTT_BATCH_ENABLED 1
+#define MQTT_BATCH_MAX_SAMPLES CONFIG_MQTT_BATCH_MAX_SAMPLES
+#define MQTT_BATCH_MAX_AGE_MS CONFIG_MQTT_BATCH_MAX_AGE_MS
+_Static_assert(CONFIG_MQTT_BATCH_MAX_SAMPLES <= CONFIG_SENSOR_RING_CAPACITY, "MQTT batch must fit in the sample ring");
+#else
+#define MQTT_BATCH_ENABLED 0
+#define MQTT_BATCH_MAX_SAMPLES 1
+#define MQTT_BATCH_MAX_AGE_MS 0
+#endif
+
+//Largest number of samples sent in one frame, either a live batch or a burst of stored samples
+#if CONFIG_SAMPLE_STORE_ENABLE && CONFIG_SAMPLE_STORE_REPLAY_BURST > MQTT_BATCH_MAX_SAMPLES
+#define MQTT_FRAME_MAX_SAMPLES CONFIG_SAMPLE_STORE_REPLAY_BURST
+#else
+#define MQTT_FRAME_MAX_SAMPLES MQTT_BATCH_MAX_SAMPLES
+#endif
+
+//Worst case size of one JSON sample with sequence number and timestamp, plus the batch envelope
+#define MQTT_SAMPLE_JSON_SIZE 128
+#define MQTT_PAYLOAD_SIZE (MQTT_FRAME_MAX_SAMPLES * MQTT_SAMPLE_JSON_SIZE + 64)
 
-extern QueueHandle_t sensor_queue;
+//The outbox takes a message larger than its whole budget while it is empty, so the client's own limit has to
+//leave room for the largest payload published. Command replies and binary frames are smaller than these.
+#define MQTT_MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MQTT_LARGEST_PAYLOAD_SIZE MQTT_MAX(MQTT_MAX(MQTT_PAYLOAD_SIZE, MQTT_LATENCY_PAYLOAD_SIZE), MQTT_MAX(MQTT_DIAGNOSTICS_PAYLOAD_SIZE, MQTT_STATS_PAYLOAD_SIZE))
+#define MQTT_CLIENT_OUTBOX_LIMIT MQTT_MAX(CONFIG_MQTT_OUTBOX_BUDGET_BYTES, MQTT_LARGEST_PAYLOAD_SIZE)
+
+static const char *TAG = "MQTT";
 
 static esp_mqtt_client_handle_t client = NULL;
+#if !CONFIG_RUNTIME_EVENT_LOOP
 static TaskHandle_t wifi_mqtt_task_handle;
+#endif
+static bool started = false;
+static bool client_started = false;
 static bool connected = false;
+//Set by the first connection, until then offline samples wait in the ring rather than going to flash
+static bool ever_connected = false;
+static volatile bool flush_requested = false;
+static SemaphoreHandle_t flush_done;
+//msg_id of the last batch the flush published, FLUSH_NONE if it published none and FLUSH_ACKED once its PUBACK arrived
+#define FLUSH_NONE -1
+#define FLUSH_ACKED -2
+static atomic_int flush_msg_id = FLUSH_NONE;
+#if CONFIG_SAMPLE_STORE_ENABLE
+static bool store_ready = false;
+//msg_id of the replay burst waiting for its PUBACK, REPLAY_IDLE if none and REPLAY_ACKED once it arrived. The
+//burst is only marked replayed in flash after that, so a reboot before then replays it again.
+#define REPLAY_IDLE -1
+#define REPLAY_ACKED -2
+static atomic_int replay_msg_id = REPLAY_IDLE;
+#endif
+//The settings can be replaced from any task. The publisher takes one copy per step, so a change made by a
+//command applies as a whole.
+static mqtt_publish_config_t publish_config;
+static portMUX_TYPE config_lock = portMUX_INITIALIZER_UNLOCKED;
+#if CONFIG_MQTT_DEADBAND_ENABLE
+//One state per probe, each probe's readings are filtered against what it last reported. Only touched by the publisher.
+static report_filter_state_t filter_state[SENSOR_MAX_PROBES];
+#endif
 
 typedef enum {
     CO2_LEVEL_INIT,
@@ -23,6 +136,10 @@ typedef enum {
     CO2_LEVEL_DANGER
 } co2_level_t;
 
+static inline uint32_t uptime_ms(void) {
+    return xTaskGetTickCount() * portTICK_PERIOD_MS;
+}
+
 static void log_error_if_nonzero(const char *message, int error_code)
 {
     if (error_code != 0) {
@@ -30,6 +147,24 @@ static void log_error_if_nonzero(const char *message, int error_code)
     }
 }
 
+//Called on the client's task with every PUBACK
+static void publish_acked(int msg_id) {
+    int expected = msg_id;
+    atomic_compare_exchange_strong(&flush_msg_id, &expected, FLUSH_ACKED);
+#if CONFIG_SAMPLE_STORE_ENABLE
+    expected = msg_id;
+    atomic_compare_exchange_strong(&replay_msg_id, &expected, REPLAY_ACKED);
+#endif
+}
+
+#if CONFIG_SAMPLE_STORE_ENABLE
+//Stops waiting for the burst in flight when the connection drops, it is peeked and sent again after reconnecting
+static void abandon_replay(void) {
+    int msg_id = atomic_load(&replay_msg_id);
+    if (msg_id >= 0) atomic_compare_exchange_strong(&replay_msg_id, &msg_id, REPLAY_IDLE);
+}
+#endif
+
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data) {
     ESP_LOGD(TAG, "Event dispatched from event loop base=%s, event_id=%" PRIi32 "", base, event_id);
     esp_mqtt_event_handle_t event = event_data;
@@ -37,10 +172,18 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     case MQTT_EVENT_CONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
         connected = true;
+        ever_connected = true;
+#if CONFIG_MQTT_COMMANDS_ENABLE
+        //Subscriptions don't outlive the session, so subscribe on every connect
+        mqtt_command_subscribe(client);
+#endif
         break;
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
         connected = false;
+#if CONFIG_SAMPLE_STORE_ENABLE
+        abandon_replay();
+#endif
         break;
     case MQTT_EVENT_SUBSCRIBED:
         ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
@@ -50,11 +193,18 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
         break;
     case MQTT_EVENT_PUBLISHED:
         ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+        LATENCY_END_ID(LATENCY_PUBACK, event->msg_id);
+        mqtt_outbox_acked(event->msg_id);
+        publish_acked(event->msg_id);
         break;
     case MQTT_EVENT_DATA:
         ESP_LOGI(TAG, "MQTT_EVENT_DATA");
+#if CONFIG_MQTT_COMMANDS_ENABLE
+        mqtt_command_handle(event);
+#else
         printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
         printf("DATA=%.*s\r\n", event->data_len, event->data);
+#endif
         break;
     case MQTT_EVENT_ERROR:
         ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
@@ -71,55 +221,567 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     }
 }
 
-static void wifi_mqtt_task(void *arg) {
-    sensor_data_t data;
-    uint32_t last_timestamp = 0;
-    co2_level_t last_co2 = CO2_LEVEL_INIT;
-    for (;;) {
-        if (xQueueReceive(sensor_queue, &data, portMAX_DELAY) == pdPASS) {
-            //Set LED according to co2 level
-            if(data.eco2 >= 5000 && last_co2 != CO2_LEVEL_DANGER) {
-                ESP_LOGI(TAG, "Entering first block co2 is: %u", data.eco2);
-                last_co2 = CO2_LEVEL_DANGER;
-                led_service_set_led(LED_RED, LED_STATE_BLINK, 200);
-                led_service_set_led(LED_YELLOW, LED_STATE_LOW, 0);
-                led_service_set_led(LED_GREEN, LED_STATE_LOW, 0);
-            }
-            else if(data.eco2 >= 1000 && data.eco2 < 5000 && last_co2 != CO2_LEVEL_WARNING) {
-                ESP_LOGI(TAG, "Entering second block co2 is: %u", data.eco2);
-                last_co2 = CO2_LEVEL_WARNING;
-                led_service_set_led(LED_RED, LED_STATE_LOW, 0);
-                led_service_set_led(LED_YELLOW, LED_STATE_BLINK, 200);
-                led_service_set_led(LED_GREEN, LED_STATE_LOW, 0);
-            }
-            else if(data.eco2 < 1000 && last_co2 != CO2_LEVEL_OK) {
-                ESP_LOGI(TAG, "Entering third block co2 is: %u", data.eco2);
-                last_co2 = CO2_LEVEL_OK;
-                led_service_set_led(LED_RED, LED_STATE_LOW, 0);
-                led_service_set_led(LED_YELLOW, LED_STATE_LOW, 0);
-                led_service_set_led(LED_GREEN, LED_STATE_BLINK, 200);
-            }
-            else {
-                ESP_LOGI(TAG, "State hasn't changed co2 is: %u", data.eco2);
+//One LED blinking, the others off
+#define CO2_LED_FRAME(blinking) (led_frame_t){ .leds = { [blinking] = { .state = LED_STATE_BLINK, .period_ms = 200 } } }
+
+//Sets the LEDs according to the co2 level of the newest sample
+static void update_co2_leds(const sensor_data_t *data, co2_level_t *last_co2, const mqtt_publish_config_t *config) {
+    if(data->eco2 >= config->co2_danger_ppm && *last_co2 != CO2_LEVEL_DANGER) {
+        ESP_LOGI(TAG, "Entering first block co2 is: %lu", (unsigned long)data->eco2);
+        *last_co2 = CO2_LEVEL_DANGER;
+        led_service_set_frame(&CO2_LED_FRAME(LED_RED));
+    }
+    else if(data->eco2 >= config->co2_warning_ppm && data->eco2 < config->co2_danger_ppm && *last_co2 != CO2_LEVEL_WARNING) {
+        ESP_LOGI(TAG, "Entering second block co2 is: %lu", (unsigned long)data->eco2);
+        *last_co2 = CO2_LEVEL_WARNING;
+        led_service_set_frame(&CO2_LED_FRAME(LED_YELLOW));
+    }
+    else if(data->eco2 < config->co2_warning_ppm && *last_co2 != CO2_LEVEL_OK) {
+        ESP_LOGI(TAG, "Entering third block co2 is: %lu", (unsigned long)data->eco2);
+        *last_co2 = CO2_LEVEL_OK;
+        led_service_set_frame(&CO2_LED_FRAME(LED_GREEN));
+    }
+    else {
+        ESP_LOGI(TAG, "State hasn't changed co2 is: %lu", (unsigned long)data->eco2);
+    }
+}
+
+//Centi values are printed as fixed point decimals so the payload is formatted without floats
+#define CENTI_FMT "%s%d.%02d"
+#define CENTI_ARGS(value) ((int)(value) < 0 ? "-" : ""), abs((int)(value)) / 100, abs((int)(value)) % 100
+
+//A batch is published once it is full or its oldest sample has waited long enough. Under backpressure only
+//full batches go out, so the outbox fills with fewer, larger messages while the broker catches up.
+static inline bool batch_is_due(const mqtt_publish_config_t *config, size_t count, uint32_t oldest_age_ms, bool backpressure) {
+#if CONFIG_MQTT_BATCH_ENABLE
+    return count >= config->batch_max_samples || (!backpressure && oldest_age_ms >= config->batch_max_age_ms);
+#else
+    return true;
+#endif
+}
+
+//Boot id sent with every frame so uptime based timestamps of stored samples can be told apart across reboots
+static inline uint16_t current_boot_id(void) {
+#if CONFIG_SAMPLE_STORE_ENABLE
+    return sample_store_boot_id();
+#else
+    return 0;
+#endif
+}
+
+//QoS 1 publish of a sample payload, timed up to the client accepting it and on to the broker's PUBACK
+//Samples are refused rather than dropped when the outbox is full, they stay in the ring or the store for a retry
+static int publish_timed(const char *topic, const char *payload, int len) {
+    LATENCY_START(publish_start);
+    int msg_id = mqtt_outbox_publish(topic, payload, len, 1, MQTT_OUTBOX_HOLD);
+    LATENCY_END(LATENCY_PUBLISH, publish_start);
+    LATENCY_BEGIN_ID(LATENCY_PUBACK, msg_id);
+    return msg_id;
+}
+
+#if CONFIG_MQTT_PAYLOAD_FORMAT_BINARY
+static void to_telemetry_sample(const sensor_data_t *data, telemetry_sample_t *out) {
+    out->seq = data->seq;
+    out->timestamp_ms = data->timestamp_ms;
+    out->temperature_centi = data->temperature_centi;
+    out->humidity_centi = data->humidity_centi;
+    out->eco2 = (uint16_t)data->eco2;
+    out->tvoc = (uint16_t)data->tvoc;
+    out->probe = data->probe;
+}
+
+//Publishes the samples as one binary frame, returns the msg_id from the client (-1 on failure)
+static int publish_samples(const char *topic, uint16_t boot_id, const sensor_data_t *samples, size_t count, bool envelope) {
+    static uint8_t frame[TELEMETRY_FRAME_SIZE(MQTT_FRAME_MAX_SAMPLES)];
+    static telemetry_sample_t packed[MQTT_FRAME_MAX_SAMPLES];
+
+    if(count > MQTT_FRAME_MAX_SAMPLES) return -1;
+    LATENCY_START(encode_start);
+    for(size_t i = 0; i < count; i++) {
+        to_telemetry_sample(&samples[i], &packed[i]);
+    }
+
+    int len = telemetry_encode(frame, sizeof(frame), boot_id, uptime_ms(), packed, count);
+    LATENCY_END(LATENCY_ENCODE, encode_start);
+    if(len < 0) return -1;
+
+    return publish_timed(topic, (const char *)frame, len);
+}
+#else
+//Appends one sample as a JSON object to the payload buffer, returns the new length or -1 if it didn't fit
+static int append_sample_json(char *buf, size_t size, int len, const sensor_data_t *data, bool with_meta) {
+    int written;
+    if(with_meta) {
+        written = snprintf(&buf[len], size - len, "{\"seq\": %lu, \"ts\": %lu, \"probe\": %u, \"temperature\": " CENTI_FMT ", \"humidity\": " CENTI_FMT ", \"eco2\": %lu, \"tvoc\": %lu}",
+                (unsigned long)data->seq,
+                (unsigned long)data->timestamp_ms,
+                data->probe,
+                CENTI_ARGS(data->temperature_centi),
+                CENTI_ARGS(data->humidity_centi),
+                (unsigned long)data->eco2,
+                (unsigned long)data->tvoc);
+    }
+    else {
+        written = snprintf(&buf[len], size - len, "{\"probe\": %u, \"temperature\": " CENTI_FMT ", \"humidity\": " CENTI_FMT ", \"eco2\": %lu, \"tvoc\": %lu}",
+                data->probe,
+                CENTI_ARGS(data->temperature_centi),
+                CENTI_ARGS(data->humidity_centi),
+                (unsigned long)data->eco2,
+                (unsigned long)data->tvoc);
+    }
+    if(written < 0 || (size_t)written >= size - len) return -1;
+    return len + written;
+}
+
+//Publishes the samples as one payload, returns the msg_id from the client (-1 on failure).
+//Without the envelope only the first sample is sent, in the original single sample format.
+static int publish_samples(const char *topic, uint16_t boot_id, const sensor_data_t *samples, size_t count, bool envelope) {
+    static char payload[MQTT_PAYLOAD_SIZE];
+    int len = 0;
+
+    if(count > MQTT_FRAME_MAX_SAMPLES) return -1;
+    LATENCY_START(encode_start);
+
+    if(!envelope) {
+        len = append_sample_json(payload, sizeof(payload), len, &samples[0], false);
+        LATENCY_END(LATENCY_ENCODE, encode_start);
+        if(len < 0) return -1;
+        return publish_timed(topic, payload, len);
+    }
+
+    //uptime_ms lets the receiver turn the per-sample uptime timestamps into wall clock time, as long as
+    //boot matches the boot the samples were taken in
+    len = snprintf(payload, sizeof(payload), "{\"boot\": %u, \"uptime_ms\": %lu, \"samples\": [", boot_id, (unsigned long)uptime_ms());
+    for(size_t i = 0; i < count && len >= 0; i++) {
+        if(i > 0) payload[len++] = ',';
+        len = append_sample_json(payload, sizeof(payload) - 2, len, &samples[i], true);
+    }
+    if(len < 0) return -1;
+    payload[len++] = ']';
+    payload[len++] = '}';
+    payload[len] = '\0';
+    LATENCY_END(LATENCY_ENCODE, encode_start);
+
+    return publish_timed(topic, payload, len);
+}
+#endif
+
+#if CONFIG_MQTT_DEADBAND_ENABLE
+//Drops the samples that stayed inside every deadband, keeping the rest in order. Returns how many are left.
+static size_t filter_samples(report_filter_state_t state[SENSOR_MAX_PROBES], const report_filter_config_t *config, sensor_data_t *samples, size_t count) {
+    size_t kept = 0;
+    for(size_t i = 0; i < count; i++) {
+        if(samples[i].probe < SENSOR_MAX_PROBES && report_filter_check(&state[samples[i].probe], config, &samples[i])) {
+            samples[kept++] = samples[i];
+        }
+    }
+    return kept;
+}
+#endif
+
+#if CONFIG_SAMPLE_STORE_ENABLE
+//Moves every sample since the cursor from the ring into the flash store, returns the new cursor
+static uint32_t store_offline_samples(uint32_t next_seq, sensor_data_t *samples) {
+    size_t count;
+    while((count = sensor_ring_read_since(&next_seq, samples, MQTT_FRAME_MAX_SAMPLES)) > 0) {
+        for(size_t i = 0; i < count; i++) {
+            esp_err_t err = sample_store_append(&samples[i]);
+            if(err != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to store sample %lu: %s", (unsigned long)samples[i].seq, esp_err_to_name(err));
             }
+        }
+    }
+    return next_seq;
+}
+
+//Marks the burst in flight replayed once the broker acknowledged it. A burst that left the outbox without an
+//acknowledgement, because it expired or was acknowledged before its msg_id was recorded, is sent again.
+static void settle_replay(void) {
+    int msg_id = atomic_load(&replay_msg_id);
+    if(msg_id >= 0 && mqtt_outbox_bytes() == 0) {
+        atomic_compare_exchange_strong(&replay_msg_id, &msg_id, REPLAY_IDLE);
+        return;
+    }
+    if(msg_id != REPLAY_ACKED) return;
+
+    esp_err_t err = sample_store_mark_replayed();
+    if(err != ESP_OK) {
+        //The store recycled the burst's sector while it was in flight, the next peek starts after it
+        ESP_LOGE(TAG, "Failed to mark samples replayed: %s", esp_err_to_name(err));
+    }
+    atomic_store(&replay_msg_id, REPLAY_IDLE);
+}
+
+//Publishes one burst of the oldest stored samples, one at a time. They stay in the store until the broker
+//acknowledges them, settle_replay() marks them replayed.
+static void replay_stored_samples(sensor_data_t *samples) {
+    if(atomic_load(&replay_msg_id) != REPLAY_IDLE) return;
+
+    uint16_t boot_id;
+    size_t count = sample_store_peek(samples, CONFIG_SAMPLE_STORE_REPLAY_BURST, &boot_id);
+    if(count == 0) return;
+
+    int msg_id = publish_samples(MQTT_REPLAY_TOPIC, boot_id, samples, count, true);
+    if(msg_id == MQTT_OUTBOX_FULL) return;
+    if(msg_id < 0) {
+        diagnostics_count(DIAG_PUBLISH_FAILURES);
+        ESP_LOGW(TAG, "Replay publish failed, %lu samples still stored", (unsigned long)sample_store_pending());
+        return;
+    }
+    atomic_store(&replay_msg_id, msg_id);
+}
+#endif
+
+#if CONFIG_MQTT_PUBLISH_STATS
+_Static_assert(STATS_QUANTILE_COUNT == 3, "Stats payload names the 10th, 50th and 90th percentiles");
+
+static const char *const stats_channel_names[SENSOR_STATS_CHANNEL_COUNT] = {
+    [SENSOR_STATS_TEMPERATURE] = "temperature",
+    [SENSOR_STATS_HUMIDITY] = "humidity",
+    [SENSOR_STATS_ECO2] = "eco2",
+    [SENSOR_STATS_TVOC] = "tvoc",
+};
+
+//Appends one channel summary as a JSON member, returns the new length or -1 if it didn't fit
+static int append_stats_json(char *buf, size_t size, int len, const char *name, const stats_summary_t *summary, bool centi) {
+    int written;
+    if(centi) {
+        written = snprintf(&buf[len], size - len, "\"%s\": {\"n\": %lu, \"min\": " CENTI_FMT ", \"max\": " CENTI_FMT ", \"mean\": " CENTI_FMT ", \"sd\": " CENTI_FMT ", \"p10\": " CENTI_FMT ", \"p50\": " CENTI_FMT ", \"p90\": " CENTI_FMT "}",
+                name,
+                (unsigned long)summary->count,
+                CENTI_ARGS(summary->min),
+                CENTI_ARGS(summary->max),
+                CENTI_ARGS(summary->mean),
+                CENTI_ARGS(summary->stddev),
+                CENTI_ARGS(summary->quantile[0]),
+                CENTI_ARGS(summary->quantile[1]),
+                CENTI_ARGS(summary->quantile[2]));
+    }
+    else {
+        written = snprintf(&buf[len], size - len, "\"%s\": {\"n\": %lu, \"min\": %ld, \"max\": %ld, \"mean\": %ld, \"sd\": %ld, \"p10\": %ld, \"p50\": %ld, \"p90\": %ld}",
+                name,
+                (unsigned long)summary->count,
+                (long)summary->min,
+                (long)summary->max,
+                (long)summary->mean,
+                (long)summary->stddev,
+                (long)summary->quantile[0],
+                (long)summary->quantile[1],
+                (long)summary->quantile[2]);
+    }
+    if(written < 0 || (size_t)written >= size - len) return -1;
+    return len + written;
+}
+
+//Publishes one completed window, channels without readings are left out. Returns the msg_id from the client (-1 on failure)
+static int publish_stats_window(const sensor_stats_window_t *window) {
+    static char payload[MQTT_STATS_PAYLOAD_SIZE];
+
+    int len = snprintf(payload, sizeof(payload), "{\"boot\": %u, \"window_s\": %lu, \"start_ms\": %lu, \"end_ms\": %lu",
+            current_boot_id(), (unsigned long)window->window_s, (unsigned long)window->start_ms, (unsigned long)window->end_ms);
+    for(size_t i = 0; i < SENSOR_STATS_CHANNEL_COUNT && len >= 0; i++) {
+        if(window->channel[i].count == 0) continue;
+        payload[len++] = ',';
+        payload[len++] = ' ';
+        bool centi = i == SENSOR_STATS_TEMPERATURE || i == SENSOR_STATS_HUMIDITY;
+        len = append_stats_json(payload, sizeof(payload) - 1, len, stats_channel_names[i], &window->channel[i], centi);
+    }
+    if(len < 0) return -1;
+    payload[len++] = '}';
+    payload[len] = '\0';
+
+    return mqtt_outbox_publish(MQTT_STATS_TOPIC, payload, len, 1, MQTT_SNAPSHOT_POLICY);
+}
+
+//Publishes every window completed since the last call. Only the latest result of each window length is
+//kept, so a window that completes again while disconnected replaces the one that wasn't sent.
+static void publish_completed_stats(void) {
+    static uint32_t stats_seq[SENSOR_STATS_WINDOW_COUNT];
+    sensor_stats_window_t window;
+
+    for(size_t i = 0; i < SENSOR_STATS_WINDOW_COUNT; i++) {
+        if(!sensor_stats_read(i, &stats_seq[i], &window)) continue;
+
+        int msg_id = publish_stats_window(&window);
+        if(msg_id == MQTT_OUTBOX_FULL && MQTT_SNAPSHOT_POLICY == MQTT_OUTBOX_DROP) continue;
+        if(msg_id < 0) {
+            if(msg_id != MQTT_OUTBOX_FULL) diagnostics_count(DIAG_PUBLISH_FAILURES);
+            //Retried on the next step unless a newer window replaces it
+            stats_seq[i] = window.seq - 1;
+        }
+    }
+}
+#endif
+
+#if CONFIG_DIAGNOSTICS_ENABLE
+//Refreshes the gauges owned by the ring, the store and the outbox, then publishes a diagnostics snapshot.
+//Returns false if it should be retried on the next step.
+static bool publish_diagnostics(void) {
+    static char payload[MQTT_DIAGNOSTICS_PAYLOAD_SIZE];
+
+    sensor_ring_stats_t ring;
+    sensor_ring_get_stats(&ring);
+    uint32_t dropped = ring.overruns;
+#if CONFIG_SAMPLE_STORE_ENABLE
+    sample_store_stats_t store;
+    sample_store_get_stats(&store);
+    dropped += store.dropped;
+    diagnostics_set_gauge(DIAG_STORE_PENDING, store.pending);
+#endif
+    diagnostics_set_gauge(DIAG_SAMPLES_DROPPED, dropped);
+    mqtt_outbox_update_gauges();
+
+    int len = diagnostics_format_json(payload, sizeof(payload));
+    if(len < 0) {
+        ESP_LOGE(TAG, "Diagnostics payload too large");
+        return true;
+    }
 
-            if(connected) {
-                if(data.timestamp_ms != last_timestamp) {
-                    last_timestamp = data.timestamp_ms;
-                    char payload[128];
-                    // Convert sensor data to string JSON or plain
-                    snprintf(payload, sizeof(payload), "{\"temperature\": %.2f, \"humidity\": %.2f, \"eco2\": %lu, \"tvoc\": %lu}",
-                            data.temperature,
-                            data.humidity,
-                            (unsigned long)data.eco2,
-                            (unsigned long)data.tvoc);
-                    esp_mqtt_client_publish(client, "AirQuality", payload, 0, 1, 0);
-                }
-            } else {
-                ESP_LOGW(TAG, "MQTT not connected, dropping data");
+    int msg_id = mqtt_outbox_publish(MQTT_DIAGNOSTICS_TOPIC, payload, len, 0, MQTT_SNAPSHOT_POLICY);
+    if(msg_id == MQTT_OUTBOX_FULL) return MQTT_SNAPSHOT_POLICY == MQTT_OUTBOX_DROP;
+    if(msg_id < 0) {
+        diagnostics_count(DIAG_PUBLISH_FAILURES);
+    }
+    return true;
+}
+#endif
+
+#if CONFIG_LATENCY_PROBES_ENABLE
+//Publishes the latency histograms if connected, returns false if it should be retried on the next step
+static bool publish_latency(void) {
+    static char payload[MQTT_LATENCY_PAYLOAD_SIZE];
+
+    if(!connected) return true;
+
+    int len = latency_format_json(payload, sizeof(payload));
+    if(len < 0) {
+        ESP_LOGE(TAG, "Latency payload too large");
+        return true;
+    }
+
+    int msg_id = mqtt_outbox_publish(MQTT_LATENCY_TOPIC, payload, len, 0, MQTT_SNAPSHOT_POLICY);
+    if(msg_id == MQTT_OUTBOX_FULL) return MQTT_SNAPSHOT_POLICY == MQTT_OUTBOX_DROP;
+    if(msg_id < 0) {
+        diagnostics_count(DIAG_PUBLISH_FAILURES);
+    }
+    return true;
+}
+#endif
+
+//Every probe pushes its sample in the same cycle, so the newest SENSOR_MAX_PROBES samples hold the latest
+//reading of each one. The LEDs follow whichever has the highest eCO2.
+static const sensor_data_t *worst_recent_sample(uint32_t head) {
+    static sensor_data_t recent[SENSOR_MAX_PROBES];
+    uint32_t since = head > SENSOR_MAX_PROBES ? head - SENSOR_MAX_PROBES : 0;
+    size_t count = sensor_ring_read_since(&since, recent, SENSOR_MAX_PROBES);
+
+    const sensor_data_t *worst = &recent[0];
+    for(size_t i = 1; i < count; i++) {
+        if(recent[i].eco2 > worst->eco2) worst = &recent[i];
+    }
+    return count > 0 ? worst : NULL;
+}
+
+//Publisher state, only touched from the MQTT task or the runtime
+static sensor_data_t samples[MQTT_FRAME_MAX_SAMPLES];
+static uint32_t next_seq = 0;
+static uint32_t led_seq = 0;
+static co2_level_t last_co2 = CO2_LEVEL_INIT;
+#if CONFIG_SAMPLE_STORE_ENABLE
+static TickType_t next_replay;
+#endif
+#if CONFIG_DIAGNOSTICS_ENABLE
+static TickType_t next_diagnostics;
+#endif
+#if CONFIG_LATENCY_PROBES_ENABLE
+static TickType_t next_latency;
+static bool latency_held = false;
+#endif
+
+//Handles new samples, publishing, replay and diagnostics, returns how long until it needs to run again
+static TickType_t mqtt_step(void) {
+    TickType_t wait = pdMS_TO_TICKS(MQTT_RETRY_PERIOD_MS);
+
+    mqtt_publish_config_t config;
+    mqtt_service_get_publish_config(&config);
+
+    uint32_t head = sensor_ring_head_seq();
+    bool new_sample = head != led_seq;
+    if(new_sample) {
+        LATENCY_MARK_END(LATENCY_QUEUE_HOP);
+        const sensor_data_t *worst = worst_recent_sample(head);
+        if(worst) {
+            update_co2_leds(worst, &last_co2, &config);
+        }
+        led_seq = head;
+    }
+
+    bool flush = flush_requested;
+    flush_requested = false;
+    int last_msg_id = FLUSH_NONE;
+
+    if(MQTT_PUBLISH_SAMPLES && !connected) {
+#if CONFIG_SAMPLE_STORE_ENABLE
+        //At boot the network is usually up within a few samples, so they are held in the ring and only moved
+        //to flash if the ring is filling up. After that a lost connection moves them straight away.
+        if(store_ready && (ever_connected || head - next_seq >= CONFIG_SENSOR_RING_CAPACITY / 2)) {
+            if(new_sample) {
+                ESP_LOGW(TAG, "MQTT not connected, storing %lu samples", (unsigned long)(head - next_seq));
             }
+            next_seq = store_offline_samples(next_seq, samples);
+        }
+        else
+#endif
+        if(new_sample) {
+            ESP_LOGW(TAG, "MQTT not connected, %lu samples held", (unsigned long)(head - next_seq));
+        }
+    }
+
+    //Publish full batches, and a partial one when its oldest sample has reached the maximum age or a flush
+    //was requested. The cursor only moves past samples the client accepted.
+    bool backpressure = mqtt_outbox_backpressure();
+    while(MQTT_PUBLISH_SAMPLES && connected) {
+        uint32_t read_seq = next_seq;
+        size_t count = sensor_ring_read_since(&read_seq, samples, config.batch_max_samples);
+        if(count == 0) break;
+
+#if CONFIG_MQTT_DEADBAND_ENABLE
+        //Filtered against a copy of the state, which is only kept once the samples are accepted so a retry
+        //picks the same samples again
+        report_filter_state_t filter_trial[SENSOR_MAX_PROBES];
+        memcpy(filter_trial, filter_state, sizeof(filter_trial));
+        count = filter_samples(filter_trial, &config.filter, samples, count);
+        if(count == 0) {
+            next_seq = read_seq;
+            continue;
+        }
+#endif
+
+        //Samples lost to a ring overrun have already been counted, don't count them again on a retry
+        next_seq = samples[0].seq;
+
+        uint32_t age_ms = uptime_ms() - samples[0].timestamp_ms;
+        if(!flush && !batch_is_due(&config, count, age_ms, backpressure)) {
+            TickType_t until_due = pdMS_TO_TICKS(config.batch_max_age_ms - age_ms) + 1;
+            if(until_due < wait) wait = until_due;
+            break;
+        }
+
+        int msg_id = publish_samples(MQTT_TOPIC, current_boot_id(), samples, count, MQTT_BATCH_ENABLED);
+        if(msg_id == MQTT_OUTBOX_FULL) {
+            //The samples stay in the ring, the periodic wake retries once the outbox drains
+            ESP_LOGD(TAG, "Outbox full, holding from seq %lu", (unsigned long)next_seq);
+            break;
+        }
+        if(msg_id < 0) {
+            diagnostics_count(DIAG_PUBLISH_FAILURES);
+            ESP_LOGW(TAG, "Publish failed, retrying from seq %lu", (unsigned long)next_seq);
+            break;
+        }
+        next_seq = read_seq;
+        last_msg_id = msg_id;
+#if CONFIG_MQTT_DEADBAND_ENABLE
+        memcpy(filter_state, filter_trial, sizeof(filter_state));
+#endif
+    }
+
+#if CONFIG_MQTT_PUBLISH_STATS
+    //Windows complete on the sensor side, the step runs at least every MQTT_RETRY_PERIOD_MS to pick them up
+    if(connected) {
+        publish_completed_stats();
+    }
+#endif
+
+#if CONFIG_SAMPLE_STORE_ENABLE
+    if(store_ready) {
+        settle_replay();
+    }
+
+    //Stored samples are replayed at a paced rate after the live samples so the live stream isn't starved, and
+    //not at all while the outbox is under backpressure
+    if(connected && store_ready && sample_store_pending() > 0 && !mqtt_outbox_backpressure()) {
+        TickType_t now = xTaskGetTickCount();
+        if((int32_t)(now - next_replay) >= 0) {
+            replay_stored_samples(samples);
+            next_replay = now + pdMS_TO_TICKS(CONFIG_SAMPLE_STORE_REPLAY_INTERVAL_MS);
+        }
+        TickType_t until_replay = next_replay - now;
+        if(until_replay < wait) wait = until_replay;
+    }
+#endif
+
+#if CONFIG_DIAGNOSTICS_ENABLE
+    //Low rate and best effort, the loop wakes at least every MQTT_RETRY_PERIOD_MS so no extra wake up is needed
+    if(connected && (int32_t)(xTaskGetTickCount() - next_diagnostics) >= 0 && publish_diagnostics()) {
+        next_diagnostics = xTaskGetTickCount() + pdMS_TO_TICKS(CONFIG_DIAGNOSTICS_PUBLISH_INTERVAL_S * 1000);
+    }
+#endif
+
+#if CONFIG_LATENCY_PROBES_ENABLE
+    //Dumped to the console even while disconnected, a publish held back by the outbox is retried without
+    //dumping again
+    if((int32_t)(xTaskGetTickCount() - next_latency) >= 0) {
+        if(!latency_held) latency_dump();
+        latency_held = !publish_latency();
+        if(!latency_held) {
+            next_latency = xTaskGetTickCount() + pdMS_TO_TICKS(CONFIG_LATENCY_PUBLISH_INTERVAL_S * 1000);
         }
     }
+#endif
+
+    if(flush) {
+        atomic_store(&flush_msg_id, last_msg_id);
+        xSemaphoreGive(flush_done);
+    }
+
+    return wait;
+}
+
+#if CONFIG_RUNTIME_EVENT_LOOP
+
+static runtime_timer_t step_timer;
+
+//Wakes on every new sample and flush request, and when the timer from the last step expires
+static void run_step(void *ctx) {
+    runtime_timer_start(&step_timer, pdTICKS_TO_MS(mqtt_step()), 0);
+}
+
+static esp_err_t start_publisher(void) {
+    runtime_timer_init(&step_timer, run_step, NULL);
+    runtime_timer_start(&step_timer, 0, 0);
+
+    esp_err_t err = runtime_subscribe(RUNTIME_EVENT_SAMPLE_READY, run_step, NULL);
+    if (err != ESP_OK) return err;
+
+    return runtime_subscribe(RUNTIME_EVENT_MQTT_FLUSH, run_step, NULL);
+}
+
+#else
+
+static void wifi_mqtt_task(void *arg) {
+    TickType_t wait = pdMS_TO_TICKS(MQTT_RETRY_PERIOD_MS);
+    for (;;) {
+        //Wake on every new sample, when the pending batch gets too old, when a replay is due, and periodically
+        //so samples held while disconnected go out soon after reconnecting
+        sensor_ring_wait(wait);
+        wait = mqtt_step();
+    }
+}
+
+static esp_err_t start_publisher(void) {
+    BaseType_t ok = xTaskCreate(wifi_mqtt_task, "Wifi MQTT Task", 4096, NULL, 5, &wifi_mqtt_task_handle);
+    if (ok != pdPASS) return ESP_ERR_NO_MEM;
+
+    return diagnostics_register_task(wifi_mqtt_task_handle);
+}
+
+#endif
+
+//Runs from esp_restart() before Wi-Fi is stopped so a partial batch isn't lost on an OTA restart. Shutdown
+//handlers run newest first, so it is registered by mqtt_service_connect(), after esp_wifi_init() has registered
+//the one that stops Wi-Fi.
+static void mqtt_shutdown_handler(void) {
+    mqtt_service_flush(MQTT_SHUTDOWN_FLUSH_MS);
 }
 
 esp_err_t mqtt_service_start(void) {
@@ -127,21 +789,145 @@ esp_err_t mqtt_service_start(void) {
         .broker.address.uri = CONFIG_MQTT_URI,
         .credentials.username = CONFIG_MQTT_USERNAME,
         .credentials.authentication.password = CONFIG_MQTT_PASSWORD,
+        //Backstop for the budget mqtt_outbox_publish() checks, the client refuses enqueues beyond it
+        .outbox.limit = MQTT_CLIENT_OUTBOX_LIMIT,
     };
 
     client = esp_mqtt_client_init(&mqtt_cfg);
     if (!client) return ESP_ERR_NO_MEM;
+    mqtt_outbox_init(client);
+
+    flush_done = xSemaphoreCreateBinary();
+    if (!flush_done) return ESP_ERR_NO_MEM;
 
     esp_err_t err = esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
     if (err != ESP_OK) return err;
 
-    err = esp_mqtt_client_start(client);
+#if CONFIG_SAMPLE_STORE_ENABLE
+    //Without the store the service still runs, samples taken while offline are then only held in the sample ring
+    err = sample_store_init();
+    store_ready = err == ESP_OK;
+    if (!store_ready) ESP_LOGW(TAG, "Sample store unavailable: %s", esp_err_to_name(err));
+#endif
+
+    publish_config = (mqtt_publish_config_t){
+        .batch_max_samples = MQTT_BATCH_MAX_SAMPLES,
+        .batch_max_age_ms = MQTT_BATCH_MAX_AGE_MS,
+        .co2_warning_ppm = MQTT_CO2_WARNING_PPM,
+        .co2_danger_ppm = MQTT_CO2_DANGER_PPM,
+    };
+#if CONFIG_MQTT_DEADBAND_ENABLE
+    report_filter_default_config(&publish_config.filter);
+#endif
+#if CONFIG_MQTT_COMMANDS_ENABLE
+    //Settings persisted by earlier commands replace the defaults before anything is published
+    err = mqtt_command_init();
+    if (err != ESP_OK) return err;
+#endif
+
+
+    //The client is started by mqtt_service_connect() once there is a network to connect over
+#if CONFIG_SAMPLE_STORE_ENABLE
+    next_replay = xTaskGetTickCount();
+#endif
+#if CONFIG_DIAGNOSTICS_ENABLE
+    next_diagnostics = xTaskGetTickCount();
+#endif
+#if CONFIG_LATENCY_PROBES_ENABLE
+    next_latency = xTaskGetTickCount() + pdMS_TO_TICKS(CONFIG_LATENCY_PUBLISH_INTERVAL_S * 1000);
+#endif
+
+    err = start_publisher();
     if (err != ESP_OK) return err;
+    started = true;
 
-    BaseType_t ok = xTaskCreate(wifi_mqtt_task, "Wifi MQTT Task", 4096, NULL, 5, &wifi_mqtt_task_handle);
-    return ok == pdPASS ? ESP_OK : ESP_ERR_NO_MEM;
+    return ESP_OK;
+}
+
+esp_err_t mqtt_service_connect(void) {
+    if (!started) return ESP_ERR_INVALID_STATE;
+    if (client_started) return ESP_OK;
+
+    //The client reconnects on its own from here on, later calls have nothing to do
+    esp_err_t err = esp_mqtt_client_start(client);
+    if (err != ESP_OK) return err;
+    client_started = true;
+
+    return esp_register_shutdown_handler(mqtt_shutdown_handler);
+}
+
+//The flushed batch has only been enqueued on the client. Waits for its PUBACK or, if the flush published
+//nothing, for the outbox to drain, so a restart that follows doesn't drop it from RAM.
+static esp_err_t wait_delivered(TickType_t start, uint32_t timeout_ms) {
+    while (mqtt_outbox_bytes() > 0 && atomic_load(&flush_msg_id) != FLUSH_ACKED) {
+        if (xTaskGetTickCount() - start >= pdMS_TO_TICKS(timeout_ms)) return ESP_ERR_TIMEOUT;
+        vTaskDelay(pdMS_TO_TICKS(MQTT_FLUSH_POLL_MS));
+    }
+    return ESP_OK;
+}
+
+esp_err_t mqtt_service_flush(uint32_t timeout_ms) {
+    if (!started) return ESP_ERR_INVALID_STATE;
+    if (!connected) return ESP_ERR_INVALID_STATE;
+
+    TickType_t start = xTaskGetTickCount();
+    xSemaphoreTake(flush_done, 0);
+    atomic_store(&flush_msg_id, FLUSH_NONE);
+    flush_requested = true;
+#if CONFIG_RUNTIME_EVENT_LOOP
+    //Called from a handler, e.g. a shutdown started by another service on the runtime, so run the step here
+    //rather than waiting on ourselves. The PUBACK arrives on the client's task, so waiting for it is safe.
+    if (runtime_in_dispatcher()) {
+        runtime_timer_start(&step_timer, pdTICKS_TO_MS(mqtt_step()), 0);
+        if (xSemaphoreTake(flush_done, 0) != pdTRUE) return ESP_ERR_TIMEOUT;
+        return wait_delivered(start, timeout_ms);
+    }
+    runtime_signal(RUNTIME_EVENT_MQTT_FLUSH);
+#else
+    //The task picks the request up on its next wake, at most MQTT_RETRY_PERIOD_MS away
+#endif
+    if (xSemaphoreTake(flush_done, pdMS_TO_TICKS(timeout_ms)) != pdTRUE) return ESP_ERR_TIMEOUT;
+    return wait_delivered(start, timeout_ms);
 }
 
 bool mqtt_client_connected(void) {
     return connected;
 }
+
+bool mqtt_service_backpressure(void) {
+    return started && mqtt_outbox_backpressure();
+}
+
+esp_err_t mqtt_service_set_publish_config(const mqtt_publish_config_t *config) {
+    if (!config) return ESP_ERR_INVALID_ARG;
+    if (config->batch_max_samples < 1 || config->batch_max_samples > MQTT_BATCH_MAX_SAMPLES) return ESP_ERR_INVALID_ARG;
+    if (config->co2_warning_ppm >= config->co2_danger_ppm) return ESP_ERR_INVALID_ARG;
+
+    taskENTER_CRITICAL(&config_lock);
+    publish_config = *config;
+    taskEXIT_CRITICAL(&config_lock);
+    return ESP_OK;
+}
+
+void mqtt_service_get_publish_config(mqtt_publish_config_t *config) {
+    taskENTER_CRITICAL(&config_lock);
+    *config = publish_config;
+    taskEXIT_CRITICAL(&config_lock);
+}
+
+#if CONFIG_MQTT_DEADBAND_ENABLE
+esp_err_t mqtt_service_set_report_filter(const report_filter_config_t *config) {
+    if (!config) return ESP_ERR_INVALID_ARG;
+
+    taskENTER_CRITICAL(&config_lock);
+    publish_config.filter = *config;
+    taskEXIT_CRITICAL(&config_lock);
+    return ESP_OK;
+}
+
+void mqtt_service_get_report_filter(report_filter_config_t *config) {
+    taskENTER_CRITICAL(&config_lock);
+    *config = publish_config.filter;
+    taskEXIT_CRITICAL(&config_lock);
+}
+#endif
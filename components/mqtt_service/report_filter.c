@@ -0,0 +1,54 @@
+#include "report_filter.h"
+
+#include <stdlib.h>
+
+#include "sdkconfig.h"
+
+void report_filter_default_config(report_filter_config_t *config) {
+    *config = (report_filter_config_t){
+        .deadband = {
+            [REPORT_CHANNEL_TEMPERATURE] = { CONFIG_MQTT_DEADBAND_TEMPERATURE_CENTI, 0 },
+            [REPORT_CHANNEL_HUMIDITY] = { CONFIG_MQTT_DEADBAND_HUMIDITY_CENTI, 0 },
+            [REPORT_CHANNEL_ECO2] = { CONFIG_MQTT_DEADBAND_ECO2_PPM, CONFIG_MQTT_DEADBAND_ECO2_PERMILLE },
+            [REPORT_CHANNEL_TVOC] = { CONFIG_MQTT_DEADBAND_TVOC_PPB, CONFIG_MQTT_DEADBAND_TVOC_PERMILLE },
+        },
+        .heartbeat_s = CONFIG_MQTT_HEARTBEAT_S,
+    };
+}
+
+static void sample_channels(const sensor_data_t *sample, int32_t *values) {
+    values[REPORT_CHANNEL_TEMPERATURE] = sample->temperature_centi;
+    values[REPORT_CHANNEL_HUMIDITY] = sample->humidity_centi;
+    values[REPORT_CHANNEL_ECO2] = (int32_t)sample->eco2;
+    values[REPORT_CHANNEL_TVOC] = (int32_t)sample->tvoc;
+}
+
+static bool outside_deadband(const report_deadband_t *deadband, int32_t last, int32_t value) {
+    uint32_t change = (uint32_t)abs(value - last);
+    if (deadband->absolute == 0 && deadband->relative_permille == 0) return change > 0;
+
+    uint32_t relative = (uint32_t)(((uint64_t)abs(last) * deadband->relative_permille) / 1000);
+    uint32_t threshold = deadband->absolute > relative ? deadband->absolute : relative;
+    return change > threshold;
+}
+
+bool report_filter_check(report_filter_state_t *state, const report_filter_config_t *config, const sensor_data_t *sample) {
+    int32_t values[REPORT_CHANNEL_COUNT];
+    sample_channels(sample, values);
+
+    bool report = !state->reported;
+    if (!report && config->heartbeat_s > 0) {
+        report = sample->timestamp_ms - state->last_report_ms >= config->heartbeat_s * 1000u;
+    }
+    for (size_t i = 0; i < REPORT_CHANNEL_COUNT && !report; i++) {
+        report = outside_deadband(&config->deadband[i], state->last[i], values[i]);
+    }
+    if (!report) return false;
+
+    state->reported = true;
+    state->last_report_ms = sample->timestamp_ms;
+    for (size_t i = 0; i < REPORT_CHANNEL_COUNT; i++) {
+        state->last[i] = values[i];
+    }
+    return true;
+}
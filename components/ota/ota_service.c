@@ -5,6 +5,7 @@
 #include "esp_system.h"
 #include "esp_https_ota.h"
 #include "ota_service.h"
+#include "diagnostics.h"
 
 static const char *TAG = "OTA";
 
@@ -73,6 +74,8 @@ static esp_err_t check_for_updates() {
 *
 */
 void ota_task(void *arg) {
+    diagnostics_register_task(xTaskGetCurrentTaskHandle());
+
     //Uses HTTP only for testing, for production this should use HTTPS and TLS certificates
     esp_http_client_config_t http_config = {
         .url = CONFIG_OTA_UPDATE_FIRMWARE_URL,
@@ -95,6 +98,7 @@ void ota_task(void *arg) {
         }
     }
 
+    diagnostics_unregister_task(xTaskGetCurrentTaskHandle());
     vTaskDelete(NULL);
 }
 
@@ -0,0 +1,100 @@
+/**
+* @file runtime.h
+* @brief Cooperative single task runtime the services run on when CONFIG_RUNTIME_EVENT_LOOP is enabled
+*
+* One dispatcher task runs every service as handlers, called either when a timer expires or when an event is
+* signalled. Handlers run to completion one at a time, so they must not block for long and never wait on
+* another handler. Compared to one task per service this saves their stacks and the context switches between
+* them. With CONFIG_RUNTIME_EVENT_LOOP disabled the services keep their own tasks and this component is unused.
+*
+* Timers are owned by the caller and may only be started or stopped before runtime_start() or from a handler.
+* runtime_signal() may be called from any task at any time.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+typedef void (*runtime_handler_t)(void *ctx);
+
+typedef enum {
+    RUNTIME_EVENT_SAMPLE_READY,     /*!< A sample was pushed to the sensor ring */
+    RUNTIME_EVENT_MQTT_FLUSH,       /*!< mqtt_service_flush() was called */
+    RUNTIME_EVENT_COUNT
+} runtime_event_t;
+
+typedef struct runtime_timer runtime_timer_t;
+
+/**
+* @brief A timer owned by the caller, must stay valid while it is started
+*/
+struct runtime_timer {
+    runtime_handler_t handler;
+    void *ctx;
+
+    /* Runtime private */
+    TickType_t due;
+    TickType_t period;
+    bool armed;
+    runtime_timer_t *next;
+};
+
+/**
+* @brief Initialises a timer
+*
+* @param timer Pointer to the timer
+* @param handler Function called from the dispatcher when the timer expires
+* @param ctx Context passed to the handler
+*/
+void runtime_timer_init(runtime_timer_t *timer, runtime_handler_t handler, void *ctx);
+
+/**
+* @brief Starts or restarts a timer
+*
+* @param timer Pointer to the timer
+* @param delay_ms Time until the first expiry, rounded up to whole ticks
+* @param period_ms Period of a repeating timer measured from the previous due time so it doesn't drift, 0 for a one shot timer
+*/
+void runtime_timer_start(runtime_timer_t *timer, uint32_t delay_ms, uint32_t period_ms);
+
+/**
+* @brief Stops a timer, does nothing if it isn't running
+*
+* @param timer Pointer to the timer
+*/
+void runtime_timer_stop(runtime_timer_t *timer);
+
+/**
+* @brief Sets the handler called when an event is signalled, one handler per event
+*
+* @param event The event
+* @param handler Function called from the dispatcher
+* @param ctx Context passed to the handler
+* @return esp_err_t ESP_ERR_INVALID_STATE if the event already has a handler
+*/
+esp_err_t runtime_subscribe(runtime_event_t event, runtime_handler_t handler, void *ctx);
+
+/**
+* @brief Signals an event, safe from any task. Signals raised again before the handler runs are merged.
+*
+* @param event The event
+*/
+void runtime_signal(runtime_event_t event);
+
+/**
+* @brief Checks whether the caller is running on the dispatcher task
+*
+* @return bool True if called from a handler
+*/
+bool runtime_in_dispatcher(void);
+
+/**
+* @brief Creates the dispatcher task, call once every service has registered its timers and events
+*
+* @return esp_err_t The esp error code
+*/
+esp_err_t runtime_start(void);
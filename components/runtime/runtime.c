@@ -0,0 +1,138 @@
+#include "runtime.h"
+
+#include <stdatomic.h>
+#include "freertos/task.h"
+#include "esp_log.h"
+
+#include "diagnostics.h"
+
+static const char *TAG = "RUNTIME";
+
+typedef struct {
+    runtime_handler_t handler;
+    void *ctx;
+} runtime_subscriber_t;
+
+static runtime_subscriber_t subscribers[RUNTIME_EVENT_COUNT];
+static atomic_uint_fast32_t pending_events;
+
+//Started timers, only touched from the dispatcher or before it starts
+static runtime_timer_t *timers;
+
+static TaskHandle_t dispatcher_handle;
+
+//Rounds up and adds a tick, the first tick of a delay can be cut short
+static inline TickType_t ms_to_ticks_ceil(uint32_t ms) {
+    return ms == 0 ? 0 : pdMS_TO_TICKS(ms + portTICK_PERIOD_MS - 1) + 1;
+}
+
+void runtime_timer_init(runtime_timer_t *timer, runtime_handler_t handler, void *ctx) {
+    timer->handler = handler;
+    timer->ctx = ctx;
+    timer->armed = false;
+    timer->next = NULL;
+}
+
+void runtime_timer_start(runtime_timer_t *timer, uint32_t delay_ms, uint32_t period_ms) {
+    if (!timer->armed) {
+        timer->next = timers;
+        timers = timer;
+    }
+    timer->due = xTaskGetTickCount() + ms_to_ticks_ceil(delay_ms);
+    timer->period = pdMS_TO_TICKS(period_ms);
+    timer->armed = true;
+}
+
+void runtime_timer_stop(runtime_timer_t *timer) {
+    if (!timer->armed) return;
+
+    for (runtime_timer_t **link = &timers; *link; link = &(*link)->next) {
+        if (*link == timer) {
+            *link = timer->next;
+            break;
+        }
+    }
+    timer->armed = false;
+    timer->next = NULL;
+}
+
+esp_err_t runtime_subscribe(runtime_event_t event, runtime_handler_t handler, void *ctx) {
+    if (event >= RUNTIME_EVENT_COUNT || !handler) return ESP_ERR_INVALID_ARG;
+    if (subscribers[event].handler) return ESP_ERR_INVALID_STATE;
+
+    subscribers[event].ctx = ctx;
+    subscribers[event].handler = handler;
+    return ESP_OK;
+}
+
+void runtime_signal(runtime_event_t event) {
+    if (event >= RUNTIME_EVENT_COUNT) return;
+
+    atomic_fetch_or_explicit(&pending_events, 1u << event, memory_order_release);
+    if (dispatcher_handle) {
+        xTaskNotifyGive(dispatcher_handle);
+    }
+}
+
+bool runtime_in_dispatcher(void) {
+    return dispatcher_handle && xTaskGetCurrentTaskHandle() == dispatcher_handle;
+}
+
+//Runs the handler of every expired timer, returns the ticks until the next one is due
+static TickType_t run_timers(void) {
+    TickType_t now = xTaskGetTickCount();
+    runtime_timer_t *timer = timers;
+
+    while (timer) {
+        //A handler may stop or restart any timer, including this one, so find the next one afterwards
+        runtime_timer_t *current = timer;
+        timer = timer->next;
+        if ((int32_t)(now - current->due) < 0) continue;
+
+        if (current->period) {
+            current->due += current->period;
+            //Skip missed periods instead of running the handler back to back to catch up
+            if ((int32_t)(now - current->due) >= 0) current->due = now + current->period;
+        }
+        else {
+            runtime_timer_stop(current);
+        }
+        current->handler(current->ctx);
+        now = xTaskGetTickCount();
+        //The list may have changed under us, start again from the head
+        timer = timers;
+    }
+
+    TickType_t wait = portMAX_DELAY;
+    for (timer = timers; timer; timer = timer->next) {
+        TickType_t until = (int32_t)(timer->due - now) > 0 ? timer->due - now : 0;
+        if (until < wait) wait = until;
+    }
+    return wait;
+}
+
+static void runtime_task(void *arg) {
+    for (;;) {
+        TickType_t wait = run_timers();
+        if (wait > 0) {
+            ulTaskNotifyTake(pdTRUE, wait);
+        }
+
+        uint32_t events = atomic_exchange_explicit(&pending_events, 0, memory_order_acquire);
+        for (size_t i = 0; i < RUNTIME_EVENT_COUNT; i++) {
+            if ((events & (1u << i)) && subscribers[i].handler) {
+                subscribers[i].handler(subscribers[i].ctx);
+            }
+        }
+    }
+}
+
+esp_err_t runtime_start(void) {
+    if (dispatcher_handle) return ESP_ERR_INVALID_STATE;
+
+    ESP_LOGI(TAG, "Starting event loop runtime");
+    BaseType_t ok = xTaskCreate(runtime_task, "Runtime", CONFIG_RUNTIME_TASK_STACK_SIZE, NULL, 5, &dispatcher_handle);
+    if (ok != pdPASS) return ESP_ERR_NO_MEM;
+
+    return diagnostics_register_task(dispatcher_handle);
+}
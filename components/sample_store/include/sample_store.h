@@ -0,0 +1,88 @@
+/**
+* @file sample_store.h
+* @brief Flash backed store-and-forward log for samples that couldn't be published
+*
+* Samples are appended to a dedicated data partition as fixed size records in a circular, log structured
+* layout. Sectors are used strictly in order and each one is only erased when the log wraps around to it,
+* which spreads erase cycles evenly over the partition. When the log is full the oldest sector is recycled
+* and any samples in it that were never replayed are counted as dropped.
+*
+* Replay progress is kept in flash by clearing bits in each record's state byte, so samples that were already
+* forwarded are not sent again after a reboot. Records carry the boot they were taken in because their
+* timestamps are uptime based.
+*
+* The store is not thread safe, it is owned by the MQTT task.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+
+#include "sensor_service.h"
+
+/**
+* @brief Store counters
+*/
+typedef struct {
+    uint32_t capacity;      /*!< Number of records the log can hold */
+    uint32_t pending;       /*!< Records waiting to be replayed */
+    uint32_t dropped;       /*!< Records recycled before they were replayed since boot */
+} sample_store_stats_t;
+
+/**
+* @brief Finds the store partition, recovers the write and replay positions from flash and takes the boot id
+*        from the state store
+*
+* @return esp_err_t The esp error code
+*/
+esp_err_t sample_store_init(void);
+
+/**
+* @brief Appends a sample to the log, recycling the oldest sector if the log is full
+*
+* @param data Pointer to the sample to store
+* @return esp_err_t The esp error code
+*/
+esp_err_t sample_store_append(const sensor_data_t *data);
+
+/**
+* @brief Reads the oldest samples that haven't been replayed yet without consuming them. Stops early at a change
+*        of boot so the samples returned always share one boot id.
+*
+* @param out Pointer to the buffer that receives the samples, oldest first
+* @param max_count Maximum number of samples to read
+* @param boot_id Pointer that receives the boot id the samples were taken in
+* @return size_t The number of samples read
+*/
+size_t sample_store_peek(sensor_data_t *out, size_t max_count, uint16_t *boot_id);
+
+/**
+* @brief Marks every sample returned by the last sample_store_peek() call as replayed
+*
+* @return esp_err_t The esp error code
+*/
+esp_err_t sample_store_mark_replayed(void);
+
+/**
+* @brief Returns the number of samples waiting to be replayed
+*
+* @return uint32_t Pending sample count
+*/
+uint32_t sample_store_pending(void);
+
+/**
+* @brief Returns the id of the current boot, samples stored now are tagged with it
+*
+* @return uint16_t The boot id
+*/
+uint16_t sample_store_boot_id(void);
+
+/**
+* @brief Reads the store counters
+*
+* @param stats Pointer to a structure that receives the counters
+*/
+void sample_store_get_stats(sample_store_stats_t *stats);
@@ -0,0 +1,401 @@
+#include "sample_store.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include "esp_partition.h"
+#include "esp_log.h"
+
+#include "crc8.h"
+#include "state_store.h"
+
+#define STORE_SECTOR_SIZE 4096
+#define STORE_MAGIC 0x51415353      /*!< "SSAQ" */
+#define STORE_VERSION 2
+#define STORE_SCAN_CHUNK 16         /*!< Records read per flash access while scanning a sector */
+
+//Record states, each step only clears bits so it can be programmed over the previous state without an erase
+#define RECORD_ERASED 0xFF
+#define RECORD_VALID 0x7F
+#define RECORD_REPLAYED 0x3F
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t sector_seq;
+    uint8_t version;
+    uint8_t reserved[6];
+    uint8_t crc;
+} sector_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t state;
+    uint8_t crc;                /*!< crc8 over every byte after this one */
+    uint16_t boot_id;
+    uint32_t seq;
+    uint32_t timestamp_ms;
+    int16_t temperature_centi;
+    uint16_t humidity_centi;
+    uint16_t eco2;
+    uint16_t tvoc;
+    uint8_t probe;
+    uint8_t reserved;           /*!< Keeps the record 16 bit aligned, written as 0xFF */
+} store_record_t;
+
+#define RECORDS_PER_SECTOR ((STORE_SECTOR_SIZE - sizeof(sector_header_t)) / sizeof(store_record_t))
+
+typedef struct {
+    uint32_t sector;
+    uint32_t slot;
+} store_pos_t;
+
+typedef struct {
+    uint32_t valid;             /*!< Records waiting to be replayed */
+    int32_t first_valid;        /*!< Slot of the first of those records, -1 if none */
+    int32_t last_used;          /*!< Slot of the last record that isn't fully erased, -1 if none */
+} sector_scan_t;
+
+static const char *TAG = "SAMPLE_STORE";
+
+static const esp_partition_t *partition;
+static uint32_t sector_count;
+static uint32_t oldest_sector;      //First sector of the run of sectors in use
+static uint32_t head_seq;           //Sector sequence number of the sector being written
+static store_pos_t head;            //Next free record slot, always in a prepared sector
+static store_pos_t tail;            //No record before this position still needs replaying
+static store_pos_t peek_end;        //Position just after the last record returned by sample_store_peek
+static bool peek_valid;
+static uint32_t pending;
+static uint32_t dropped;
+static uint16_t boot_id;
+
+static inline size_t sector_offset(uint32_t sector) {
+    return (size_t)sector * STORE_SECTOR_SIZE;
+}
+
+static inline size_t record_offset(store_pos_t pos) {
+    return sector_offset(pos.sector) + sizeof(sector_header_t) + pos.slot * sizeof(store_record_t);
+}
+
+static inline bool pos_equal(store_pos_t a, store_pos_t b) {
+    return a.sector == b.sector && a.slot == b.slot;
+}
+
+static inline void pos_next(store_pos_t *pos) {
+    if (++pos->slot >= RECORDS_PER_SECTOR) {
+        pos->slot = 0;
+        pos->sector = (pos->sector + 1) % sector_count;
+    }
+}
+
+static inline uint8_t record_crc(const store_record_t *record) {
+    return crc8((const uint8_t *)record + 2, sizeof(*record) - 2);
+}
+
+static inline bool record_is_valid(const store_record_t *record) {
+    return record->state == RECORD_VALID && record->crc == record_crc(record);
+}
+
+static bool record_is_erased(const store_record_t *record) {
+    const uint8_t *bytes = (const uint8_t *)record;
+    for (size_t i = 0; i < sizeof(*record); i++) {
+        if (bytes[i] != 0xFF) return false;
+    }
+    return true;
+}
+
+static bool read_header(uint32_t sector, sector_header_t *header) {
+    if (esp_partition_read(partition, sector_offset(sector), header, sizeof(*header)) != ESP_OK) return false;
+
+    return header->magic == STORE_MAGIC &&
+           header->version == STORE_VERSION &&
+           header->crc == crc8((const uint8_t *)header, sizeof(*header) - 1);
+}
+
+//Erases a sector and writes a fresh header to it
+static esp_err_t start_sector(uint32_t sector, uint32_t seq) {
+    esp_err_t err = esp_partition_erase_range(partition, sector_offset(sector), STORE_SECTOR_SIZE);
+    if (err != ESP_OK) return err;
+
+    sector_header_t header = {
+        .magic = STORE_MAGIC,
+        .sector_seq = seq,
+        .version = STORE_VERSION,
+    };
+    memset(header.reserved, 0xFF, sizeof(header.reserved));
+    header.crc = crc8((const uint8_t *)&header, sizeof(header) - 1);
+
+    return esp_partition_write(partition, sector_offset(sector), &header, sizeof(header));
+}
+
+static esp_err_t scan_sector(uint32_t sector, sector_scan_t *scan) {
+    store_record_t records[STORE_SCAN_CHUNK];
+
+    scan->valid = 0;
+    scan->first_valid = -1;
+    scan->last_used = -1;
+
+    for (uint32_t slot = 0; slot < RECORDS_PER_SECTOR; slot += STORE_SCAN_CHUNK) {
+        uint32_t n = RECORDS_PER_SECTOR - slot;
+        if (n > STORE_SCAN_CHUNK) n = STORE_SCAN_CHUNK;
+
+        store_pos_t pos = { .sector = sector, .slot = slot };
+        esp_err_t err = esp_partition_read(partition, record_offset(pos), records, n * sizeof(store_record_t));
+        if (err != ESP_OK) return err;
+
+        for (uint32_t i = 0; i < n; i++) {
+            if (record_is_valid(&records[i])) {
+                if (scan->first_valid < 0) scan->first_valid = slot + i;
+                scan->valid++;
+            }
+            if (!record_is_erased(&records[i])) {
+                scan->last_used = slot + i;
+            }
+        }
+    }
+    return ESP_OK;
+}
+
+//Moves the head to the next sector, recycling it if the log has wrapped around onto unreplayed samples
+static esp_err_t advance_head(void) {
+    uint32_t next = (head.sector + 1) % sector_count;
+
+    if (next == oldest_sector) {
+        sector_scan_t scan;
+        if (scan_sector(next, &scan) == ESP_OK && scan.valid > 0) {
+            ESP_LOGW(TAG, "Store full, dropping %lu unreplayed samples", (unsigned long)scan.valid);
+            pending -= scan.valid;
+            dropped += scan.valid;
+        }
+        oldest_sector = (next + 1) % sector_count;
+        if (tail.sector == next) {
+            tail.sector = oldest_sector;
+            tail.slot = 0;
+        }
+        peek_valid = false;
+    }
+
+    esp_err_t err = start_sector(next, head_seq + 1);
+    if (err != ESP_OK) return err;
+
+    head_seq++;
+    head.sector = next;
+    head.slot = 0;
+    return ESP_OK;
+}
+
+esp_err_t sample_store_init(void) {
+    esp_err_t err = state_store_init();
+    if (err != ESP_OK) return err;
+
+    //Persisted before any record is tagged with it, so a reset can't hand the next boot the same id
+    boot_id = (uint16_t)state_store_boot_count();
+    err = state_store_commit();
+    if (err != ESP_OK) return err;
+
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, CONFIG_SAMPLE_STORE_PARTITION_LABEL);
+    if (!partition) {
+        ESP_LOGE(TAG, "No partition labelled %s", CONFIG_SAMPLE_STORE_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    sector_count = partition->size / STORE_SECTOR_SIZE;
+    if (sector_count > CONFIG_SAMPLE_STORE_SECTORS) sector_count = CONFIG_SAMPLE_STORE_SECTORS;
+    if (sector_count < 2) {
+        partition = NULL;
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    //The sector with the highest sequence number is the one being written
+    sector_header_t header;
+    bool found = false;
+    for (uint32_t sector = 0; sector < sector_count; sector++) {
+        if (read_header(sector, &header) && (!found || (int32_t)(header.sector_seq - head_seq) > 0)) {
+            head.sector = sector;
+            head_seq = header.sector_seq;
+            found = true;
+        }
+    }
+
+    if (!found) {
+        ESP_LOGI(TAG, "Formatting %lu sectors", (unsigned long)sector_count);
+        err = start_sector(0, 1);
+        if (err != ESP_OK) {
+            partition = NULL;
+            return err;
+        }
+        head_seq = 1;
+        head.sector = 0;
+        head.slot = 0;
+        oldest_sector = 0;
+        tail = head;
+        return ESP_OK;
+    }
+
+    //Sectors are used strictly in order, walk back from the head to the start of the unbroken run
+    oldest_sector = head.sector;
+    for (uint32_t i = 1; i < sector_count; i++) {
+        uint32_t sector = (head.sector + sector_count - i) % sector_count;
+        if (!read_header(sector, &header) || header.sector_seq != head_seq - i) break;
+        oldest_sector = sector;
+    }
+
+    //Count what still needs replaying and find the oldest of it
+    bool tail_found = false;
+    pending = 0;
+    for (uint32_t sector = oldest_sector; ; sector = (sector + 1) % sector_count) {
+        sector_scan_t scan;
+        err = scan_sector(sector, &scan);
+        if (err != ESP_OK) {
+            partition = NULL;
+            return err;
+        }
+
+        pending += scan.valid;
+        if (!tail_found && scan.first_valid >= 0) {
+            tail.sector = sector;
+            tail.slot = scan.first_valid;
+            tail_found = true;
+        }
+        if (sector == head.sector) {
+            //Records are appended in order, so the first free slot follows the last one written
+            head.slot = scan.last_used + 1;
+            break;
+        }
+    }
+    if (!tail_found) {
+        tail = head;
+    }
+
+    if (head.slot >= RECORDS_PER_SECTOR) {
+        err = advance_head();
+        if (err != ESP_OK) {
+            partition = NULL;
+            return err;
+        }
+    }
+
+    ESP_LOGI(TAG, "Boot %u, %lu samples pending replay", boot_id, (unsigned long)pending);
+    return ESP_OK;
+}
+
+esp_err_t sample_store_append(const sensor_data_t *data) {
+    if (!partition) return ESP_ERR_INVALID_STATE;
+    if (!data) return ESP_ERR_INVALID_ARG;
+
+    store_record_t record = {
+        .state = RECORD_ERASED,
+        .boot_id = boot_id,
+        .seq = data->seq,
+        .timestamp_ms = data->timestamp_ms,
+        .temperature_centi = data->temperature_centi,
+        .humidity_centi = data->humidity_centi,
+        .eco2 = (uint16_t)data->eco2,
+        .tvoc = (uint16_t)data->tvoc,
+        .probe = data->probe,
+        .reserved = 0xFF,
+    };
+    record.crc = record_crc(&record);
+
+    //The body is written first and the state byte last, so a record torn by a reset never reads back as valid
+    size_t offset = record_offset(head);
+    esp_err_t err = esp_partition_write(partition, offset + 1, (const uint8_t *)&record + 1, sizeof(record) - 1);
+    if (err == ESP_OK) {
+        uint8_t state = RECORD_VALID;
+        err = esp_partition_write(partition, offset, &state, sizeof(state));
+    }
+
+    //The slot is used up even on failure, it can't be programmed again without an erase
+    if (err == ESP_OK) pending++;
+    head.slot++;
+
+    if (head.slot >= RECORDS_PER_SECTOR) {
+        esp_err_t advance_err = advance_head();
+        if (err == ESP_OK) err = advance_err;
+    }
+    return err;
+}
+
+size_t sample_store_peek(sensor_data_t *out, size_t max_count, uint16_t *boot) {
+    size_t count = 0;
+    uint16_t first_boot = 0;
+    store_pos_t pos = tail;
+
+    peek_valid = false;
+    if (!partition || !out) return 0;
+
+    while (count < max_count && !pos_equal(pos, head)) {
+        store_record_t record;
+        if (esp_partition_read(partition, record_offset(pos), &record, sizeof(record)) != ESP_OK) break;
+
+        if (record_is_valid(&record)) {
+            if (count == 0) {
+                first_boot = record.boot_id;
+            }
+            else if (record.boot_id != first_boot) {
+                break;
+            }
+
+            out[count].seq = record.seq;
+            out[count].timestamp_ms = record.timestamp_ms;
+            out[count].temperature_centi = record.temperature_centi;
+            out[count].humidity_centi = record.humidity_centi;
+            out[count].eco2 = record.eco2;
+            out[count].tvoc = record.tvoc;
+            out[count].probe = record.probe;
+            count++;
+        }
+        pos_next(&pos);
+    }
+
+    if (count == 0) {
+        //Nothing valid between the tail and the head, skip over it next time
+        tail = pos;
+        return 0;
+    }
+
+    if (boot) *boot = first_boot;
+    peek_end = pos;
+    peek_valid = true;
+    return count;
+}
+
+esp_err_t sample_store_mark_replayed(void) {
+    if (!partition || !peek_valid) return ESP_ERR_INVALID_STATE;
+
+    for (store_pos_t pos = tail; !pos_equal(pos, peek_end); pos_next(&pos)) {
+        store_record_t record;
+        size_t offset = record_offset(pos);
+
+        esp_err_t err = esp_partition_read(partition, offset, &record, sizeof(record));
+        if (err != ESP_OK) return err;
+        if (!record_is_valid(&record)) continue;
+
+        uint8_t state = RECORD_REPLAYED;
+        err = esp_partition_write(partition, offset, &state, sizeof(state));
+        if (err != ESP_OK) return err;
+
+        pending--;
+        tail = pos;
+        pos_next(&tail);
+    }
+
+    tail = peek_end;
+    peek_valid = false;
+    return ESP_OK;
+}
+
+uint32_t sample_store_pending(void) {
+    return pending;
+}
+
+uint16_t sample_store_boot_id(void) {
+    return boot_id;
+}
+
+void sample_store_get_stats(sample_store_stats_t *stats) {
+    if (!stats) return;
+
+    //The sector after the head is recycled as soon as the head sector fills, so one sector is always in transition
+    stats->capacity = sector_count > 0 ? (sector_count - 1) * RECORDS_PER_SECTOR : 0;
+    stats->pending = pending;
+    stats->dropped = dropped;
+}
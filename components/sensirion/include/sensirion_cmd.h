@@ -0,0 +1,77 @@
+/**
+* @file sensirion_cmd.h
+* @brief Command engine shared by the Sensirion SGP30 and SHT3X drivers
+*
+* Both sensors speak the same protocol: a 16 bit command, optionally followed by argument words, an execution
+* time, then a reply of data words. Every word on the wire carries its own crc. The drivers describe each
+* command with a const descriptor, which lives in flash, and send them all through this one path, blocking or
+* on the I2C scheduler.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+#include "i2c_controller.h"
+#include "i2c_scheduler.h"
+
+#define SENSIRION_MAX_ARG_WORDS 2       /*!< Argument words that fit in a transaction's command phase */
+#define SENSIRION_MAX_REPLY_WORDS 3     /*!< Reply words that fit in a transaction's read phase */
+
+/**
+* @brief A sensor command
+*/
+typedef struct {
+    uint16_t opcode;
+    uint8_t arg_words;          /*!< Argument words sent after the opcode */
+    uint8_t reply_words;        /*!< Data words read back, 0 for a write only command */
+    uint32_t exec_us;           /*!< Time before the reply can be read or the sensor accepts the next command, 0 to read straight away */
+} sensirion_cmd_t;
+
+/**
+* @brief Fills in a transaction for a command, appending the arguments with their crcs. The callback and
+*        context are cleared.
+*
+* @param txn Pointer to the transaction
+* @param dev I2C device handle of the sensor
+* @param cmd Pointer to the command descriptor
+* @param args Pointer to cmd->arg_words argument words, may be NULL if the command has none
+* @return esp_err_t ESP error code
+*/
+esp_err_t sensirion_prepare(i2c_txn_t *txn, i2c_master_dev_handle_t dev, const sensirion_cmd_t *cmd, const uint16_t *args);
+
+/**
+* @brief Checks the crcs of a completed transaction's reply and decodes its words
+*
+* @param txn Pointer to the completed transaction
+* @param reply Pointer to the buffer that receives the reply words
+* @param reply_words Number of words expected, must match the command's reply
+* @return esp_err_t ESP error code
+*/
+esp_err_t sensirion_decode(const i2c_txn_t *txn, uint16_t *reply, size_t reply_words);
+
+/**
+* @brief Runs a command to completion in the calling task, sleeping through its execution time
+*
+* @param dev I2C device handle of the sensor
+* @param cmd Pointer to the command descriptor
+* @param args Pointer to the argument words, may be NULL if the command has none
+* @param reply Pointer to the buffer that receives cmd->reply_words words, may be NULL if the command has none
+* @return esp_err_t ESP error code
+*/
+esp_err_t sensirion_execute(i2c_master_dev_handle_t dev, const sensirion_cmd_t *cmd, const uint16_t *args, uint16_t *reply);
+
+/**
+* @brief Queues a command on the I2C scheduler. Decode the reply with sensirion_decode() from the callback.
+*
+* @param txn Pointer to the transaction to use, must stay valid until the callback has run
+* @param dev I2C device handle of the sensor
+* @param cmd Pointer to the command descriptor
+* @param args Pointer to the argument words, may be NULL if the command has none
+* @param cb Completion callback, may be NULL
+* @param ctx Caller context passed back through txn->ctx
+* @return esp_err_t ESP error code
+*/
+esp_err_t sensirion_submit(i2c_txn_t *txn, i2c_master_dev_handle_t dev, const sensirion_cmd_t *cmd, const uint16_t *args, i2c_txn_cb_t cb, void *ctx);
@@ -0,0 +1,61 @@
+#include "sensirion_cmd.h"
+
+#include "crc8.h"
+
+esp_err_t sensirion_prepare(i2c_txn_t *txn, i2c_master_dev_handle_t dev, const sensirion_cmd_t *cmd, const uint16_t *args) {
+    if (txn == NULL || cmd == NULL || cmd->arg_words > SENSIRION_MAX_ARG_WORDS || cmd->reply_words > SENSIRION_MAX_REPLY_WORDS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (cmd->arg_words > 0 && args == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    txn->dev = dev;
+    txn->tx[0] = cmd->opcode >> 8;
+    txn->tx[1] = cmd->opcode & 0xFF;
+    txn->tx_len = 2;
+
+    //Each argument word is followed by its crc
+    for (size_t i = 0; i < cmd->arg_words; i++) {
+        uint8_t *word = &txn->tx[txn->tx_len];
+        word[0] = args[i] >> 8;
+        word[1] = args[i] & 0xFF;
+        word[2] = crc8(word, 2);
+        txn->tx_len += CRC8_WORD_SIZE;
+    }
+
+    txn->wait_us = cmd->exec_us;
+    txn->rx_len = cmd->reply_words * CRC8_WORD_SIZE;
+    txn->cb = NULL;
+    txn->ctx = NULL;
+    return ESP_OK;
+}
+
+esp_err_t sensirion_decode(const i2c_txn_t *txn, uint16_t *reply, size_t reply_words) {
+    if (txn == NULL || reply == NULL || txn->rx_len != reply_words * CRC8_WORD_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    return crc8_decode_words(txn->rx, reply, reply_words) ? ESP_OK : ESP_ERR_INVALID_CRC;
+}
+
+esp_err_t sensirion_execute(i2c_master_dev_handle_t dev, const sensirion_cmd_t *cmd, const uint16_t *args, uint16_t *reply) {
+    i2c_txn_t txn;
+    esp_err_t error = sensirion_prepare(&txn, dev, cmd, args);
+    if (error != ESP_OK) return error;
+    if (cmd->reply_words > 0 && reply == NULL) return ESP_ERR_INVALID_ARG;
+
+    error = i2c_txn_execute(&txn);
+    if (error != ESP_OK || cmd->reply_words == 0) return error;
+
+    return sensirion_decode(&txn, reply, cmd->reply_words);
+}
+
+esp_err_t sensirion_submit(i2c_txn_t *txn, i2c_master_dev_handle_t dev, const sensirion_cmd_t *cmd, const uint16_t *args, i2c_txn_cb_t cb, void *ctx) {
+    esp_err_t error = sensirion_prepare(txn, dev, cmd, args);
+    if (error != ESP_OK) return error;
+
+    txn->cb = cb;
+    txn->ctx = ctx;
+    return i2c_sched_submit(txn);
+}
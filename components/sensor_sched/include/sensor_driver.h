@@ -0,0 +1,98 @@
+/**
+* @file sensor_driver.h
+* @brief Interface a sensor driver implements to be run by the sampling scheduler, see sensor_sched.h
+*
+* A driver states how often its part has to be read and how long a conversion takes, and supplies the steps the
+* scheduler calls: init brings the part up, start submits a conversion on the I2C scheduler, decode turns the
+* completed transaction into channel values and poll runs the driver's own upkeep after each result. A driver
+* that uses readings from another sensor, like the SGP30's humidity compensation, implements accept and the
+* owner declares the dependency as an edge between the two nodes.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "i2c_controller.h"
+#include "i2c_scheduler.h"
+
+/*!< Most edges leaving one node */
+#define SENSOR_NODE_MAX_EDGES 2
+
+/**
+* @brief Quantities a sensor can report
+*/
+typedef enum {
+    SENSOR_CHANNEL_TEMPERATURE,         /*!< 0.01 degC */
+    SENSOR_CHANNEL_HUMIDITY,            /*!< 0.01 %RH */
+    SENSOR_CHANNEL_ECO2,                /*!< ppm */
+    SENSOR_CHANNEL_TVOC,                /*!< ppb */
+    SENSOR_CHANNEL_COUNT,
+} sensor_channel_t;
+
+#define SENSOR_CHANNEL_BIT(channel) (1u << (channel))
+
+/**
+* @brief Decoded result of one conversion
+*/
+typedef struct {
+    uint32_t channels;                  /*!< SENSOR_CHANNEL_BIT() of every value filled in */
+    int32_t value[SENSOR_CHANNEL_COUNT];
+} sensor_reading_t;
+
+typedef struct sensor_node sensor_node_t;
+
+/**
+* @brief Sensor driver, one constant instance per part shared by every node that uses it
+*/
+typedef struct {
+    const char *name;
+    uint32_t period_ms;                 /*!< Default cadence, how often the part needs to be read */
+    uint32_t conversion_us;             /*!< Worst case time from start until the result is read */
+
+    /**
+    * @brief Brings the part up, may block. Called once when the node is added.
+    */
+    esp_err_t (*init)(sensor_node_t *node);
+
+    /**
+    * @brief Submits a conversion on node->txn with done as its completion callback and the node as its context
+    */
+    esp_err_t (*start)(sensor_node_t *node, i2c_txn_cb_t done);
+
+    /**
+    * @brief Decodes the completed conversion. Called on failure too, with the transfer error in err, so the
+    *        driver can track a part that stopped answering. Returns err or the decode error.
+    */
+    esp_err_t (*decode)(sensor_node_t *node, esp_err_t err, sensor_reading_t *out);
+
+    /**
+    * @brief Upkeep after each conversion, may submit further transactions. May be NULL.
+    */
+    void (*poll)(sensor_node_t *node, int64_t now_us);
+
+    /**
+    * @brief Takes a reading from a node this one depends on, it applies from the next conversion. May be NULL.
+    */
+    void (*accept)(sensor_node_t *node, const sensor_reading_t *input);
+} sensor_driver_t;
+
+/**
+* @brief One part on the bus. Owned by the caller and must stay valid while the scheduler runs.
+*/
+struct sensor_node {
+    const sensor_driver_t *driver;
+    i2c_master_dev_handle_t dev;
+    uint32_t period_ms;                 /*!< Cadence, 0 for the driver's default */
+    void *state;                        /*!< Driver specific state, see the driver's header */
+    void *owner;                        /*!< Caller context, passed back through the result callback */
+    i2c_txn_t txn;                      /*!< Conversion transaction */
+
+    /* Scheduler private */
+    uint32_t release_ticks;
+    uint8_t edge_count;
+    sensor_node_t *edges[SENSOR_NODE_MAX_EDGES];
+    sensor_node_t *next;
+};
@@ -0,0 +1,108 @@
+/**
+* @file sensor_sched.h
+* @brief Rate monotonic sampling scheduler for sensor drivers
+*
+* Every node is released at its own period. The scheduler ticks at the greatest common divisor of the periods
+* and the release pattern repeats every hyperperiod, their least common multiple. On each tick the nodes due
+* are started back to back in rate monotonic order, shortest period first and the longest conversion first
+* among equal periods, so their conversions overlap on the bus and the parts with the tightest cadence are
+* never held back by slower ones.
+*
+* A reading flows along the declared edges to the nodes that depend on it before their next conversion.
+*
+* Like the I2C scheduler it runs on, it is not thread safe. Releases and polling must happen in one task.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+#include "sensor_driver.h"
+
+/*!< Longest hyperperiod a plan may have */
+#define SENSOR_SCHED_MAX_HYPERPERIOD_MS (3600u * 1000u)
+
+/**
+* @brief Result callback, called for every conversion and for failed auxiliary transactions
+*
+* @param node The node the result belongs to
+* @param err ESP_OK or the error from the transfer or the decode
+* @param reading The decoded reading, NULL on error
+*/
+typedef void (*sensor_result_cb_t)(sensor_node_t *node, esp_err_t err, const sensor_reading_t *reading);
+
+/**
+* @brief Adds a node and initialises its part. The node's period is filled in from the driver if it is 0.
+*
+* @param node Pointer to the node, driver and dev must be set
+* @return esp_err_t ESP_ERR_INVALID_ARG if the conversion doesn't fit in the period, otherwise the error from init
+*/
+esp_err_t sensor_sched_add(sensor_node_t *node);
+
+/**
+* @brief Declares that a node uses the readings of another
+*
+* @param from The node whose readings are used
+* @param to The node that takes them, its driver must implement accept
+* @return esp_err_t ESP_ERR_INVALID_ARG if to doesn't take inputs, ESP_ERR_NO_MEM if from has no edge left
+*/
+esp_err_t sensor_sched_connect(sensor_node_t *from, sensor_node_t *to);
+
+/**
+* @brief Changes the period of a node that has been added. Takes effect from the next sensor_sched_plan(), which
+*        must be called before the next release. Only call it between cycles, once every conversion has completed.
+*
+* @param node Pointer to the node
+* @param period_ms The new period
+* @return esp_err_t ESP_ERR_INVALID_ARG if the conversion doesn't fit in the period
+*/
+esp_err_t sensor_sched_set_period(sensor_node_t *node, uint32_t period_ms);
+
+/**
+* @brief Works out the tick and the hyperperiod once every node has been added, and again after a period
+*        changes. The release pattern restarts, every node is due on the next release.
+*
+* @param report_period_ms How often the owner reports, included so sensor_sched_due() holds for it, 0 if unused
+* @param cb Result callback
+* @return esp_err_t ESP_ERR_INVALID_STATE with no nodes, ESP_ERR_INVALID_ARG if the hyperperiod is too long
+*/
+esp_err_t sensor_sched_plan(uint32_t report_period_ms, sensor_result_cb_t cb);
+
+/**
+* @brief Returns the tick, the interval sensor_sched_release() must be called at
+*
+* @return uint32_t The tick in milliseconds
+*/
+uint32_t sensor_sched_tick_ms(void);
+
+/**
+* @brief Returns the hyperperiod, after which the release pattern repeats
+*
+* @return uint32_t The hyperperiod in milliseconds
+*/
+uint32_t sensor_sched_hyperperiod_ms(void);
+
+/**
+* @brief Checks whether the next release falls on a multiple of a period
+*
+* @param period_ms A node period or the report period given to sensor_sched_plan()
+* @return bool True if the next release is due for that period
+*/
+bool sensor_sched_due(uint32_t period_ms);
+
+/**
+* @brief Starts the conversions of every node due on this tick and moves on to the next tick. The results
+*        arrive through i2c_sched_poll().
+*/
+void sensor_sched_release(void);
+
+/**
+* @brief Reports an error from a driver's auxiliary transaction through the result callback
+*
+* @param node The node the transaction belongs to
+* @param err The error, ignored if ESP_OK
+*/
+void sensor_sched_report(sensor_node_t *node, esp_err_t err);
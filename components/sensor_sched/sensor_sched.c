@@ -0,0 +1,169 @@
+#include "sensor_sched.h"
+
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include "latency.h"
+
+static const char *TAG = "SENSOR_SCHED";
+
+//Nodes in release order, see higher_priority()
+static sensor_node_t *nodes;
+static sensor_result_cb_t result_cb;
+static uint32_t tick_ms = 0;
+static uint32_t hyperperiod_ticks = 0;
+static uint32_t tick = 0;
+
+static uint32_t gcd(uint32_t a, uint32_t b) {
+    while (b) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+//Rate monotonic, the shorter period goes first. Among equal periods the longer conversion starts first so the
+//conversions of a release end as close together as possible.
+static bool higher_priority(const sensor_node_t *a, const sensor_node_t *b) {
+    if (a->period_ms != b->period_ms) return a->period_ms < b->period_ms;
+    return a->driver->conversion_us > b->driver->conversion_us;
+}
+
+static void insert_node(sensor_node_t *node) {
+    sensor_node_t **link = &nodes;
+    while (*link && !higher_priority(node, *link)) link = &(*link)->next;
+    node->next = *link;
+    *link = node;
+}
+
+static void unlink_node(sensor_node_t *node) {
+    for (sensor_node_t **link = &nodes; *link; link = &(*link)->next) {
+        if (*link == node) {
+            *link = node->next;
+            node->next = NULL;
+            return;
+        }
+    }
+}
+
+static void report(sensor_node_t *node, esp_err_t err, const sensor_reading_t *reading) {
+    if (result_cb) result_cb(node, err, reading);
+}
+
+//Completion of a node's conversion, the reading goes along the node's edges before it is reported
+static void conversion_done(i2c_txn_t *txn, esp_err_t err) {
+    sensor_node_t *node = txn->ctx;
+    sensor_reading_t reading = {0};
+
+    LATENCY_START(decode_start);
+    err = node->driver->decode(node, err, &reading);
+    LATENCY_END(LATENCY_CRC_CHECK, decode_start);
+
+    if (err == ESP_OK) {
+        for (uint8_t i = 0; i < node->edge_count; i++) {
+            node->edges[i]->driver->accept(node->edges[i], &reading);
+        }
+    }
+    report(node, err, err == ESP_OK ? &reading : NULL);
+
+    if (node->driver->poll) node->driver->poll(node, esp_timer_get_time());
+}
+
+esp_err_t sensor_sched_add(sensor_node_t *node) {
+    if (!node || !node->driver || !node->driver->start || !node->driver->decode) return ESP_ERR_INVALID_ARG;
+
+    if (node->period_ms == 0) node->period_ms = node->driver->period_ms;
+    if (node->period_ms == 0 || node->driver->conversion_us >= node->period_ms * 1000ULL) {
+        ESP_LOGE(TAG, "%s conversion doesn't fit in its %lu ms period", node->driver->name, (unsigned long)node->period_ms);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (node->driver->init) {
+        esp_err_t err = node->driver->init(node);
+        if (err != ESP_OK) return err;
+    }
+
+    node->edge_count = 0;
+    insert_node(node);
+    return ESP_OK;
+}
+
+esp_err_t sensor_sched_connect(sensor_node_t *from, sensor_node_t *to) {
+    if (!from || !to || from == to || !to->driver->accept) return ESP_ERR_INVALID_ARG;
+    if (from->edge_count >= SENSOR_NODE_MAX_EDGES) return ESP_ERR_NO_MEM;
+
+    from->edges[from->edge_count++] = to;
+    return ESP_OK;
+}
+
+esp_err_t sensor_sched_set_period(sensor_node_t *node, uint32_t period_ms) {
+    if (!node || period_ms == 0 || node->driver->conversion_us >= period_ms * 1000ULL) return ESP_ERR_INVALID_ARG;
+
+    //Moved to where the new period puts it in the release order
+    unlink_node(node);
+    node->period_ms = period_ms;
+    insert_node(node);
+    return ESP_OK;
+}
+
+esp_err_t sensor_sched_plan(uint32_t report_period_ms, sensor_result_cb_t cb) {
+    if (!nodes) return ESP_ERR_INVALID_STATE;
+
+    uint32_t tick_gcd = report_period_ms;
+    for (sensor_node_t *node = nodes; node; node = node->next) {
+        tick_gcd = gcd(tick_gcd, node->period_ms);
+    }
+
+    //Least common multiple, checked as it grows so it can't overflow
+    uint32_t hyperperiod_ms = report_period_ms ? report_period_ms : tick_gcd;
+    for (sensor_node_t *node = nodes; node; node = node->next) {
+        uint64_t lcm = (uint64_t)(hyperperiod_ms / gcd(hyperperiod_ms, node->period_ms)) * node->period_ms;
+        hyperperiod_ms = (uint32_t)lcm;
+        if (lcm > SENSOR_SCHED_MAX_HYPERPERIOD_MS) {
+            ESP_LOGE(TAG, "Periods don't line up, hyperperiod over %lu ms", (unsigned long)SENSOR_SCHED_MAX_HYPERPERIOD_MS);
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    tick_ms = tick_gcd;
+    hyperperiod_ticks = hyperperiod_ms / tick_ms;
+    tick = 0;
+    result_cb = cb;
+
+    for (sensor_node_t *node = nodes; node; node = node->next) {
+        node->release_ticks = node->period_ms / tick_ms;
+        ESP_LOGI(TAG, "%s every %lu ms, conversion %lu us", node->driver->name, (unsigned long)node->period_ms, (unsigned long)node->driver->conversion_us);
+    }
+    ESP_LOGI(TAG, "Tick %lu ms, hyperperiod %lu ms", (unsigned long)tick_ms, (unsigned long)hyperperiod_ms);
+    return ESP_OK;
+}
+
+uint32_t sensor_sched_tick_ms(void) {
+    return tick_ms;
+}
+
+uint32_t sensor_sched_hyperperiod_ms(void) {
+    return hyperperiod_ticks * tick_ms;
+}
+
+bool sensor_sched_due(uint32_t period_ms) {
+    if (tick_ms == 0 || period_ms == 0) return false;
+    return (tick * tick_ms) % period_ms == 0;
+}
+
+void sensor_sched_release(void) {
+    if (hyperperiod_ticks == 0) return;
+
+    for (sensor_node_t *node = nodes; node; node = node->next) {
+        if (tick % node->release_ticks != 0) continue;
+
+        esp_err_t err = node->driver->start(node, conversion_done);
+        if (err != ESP_OK) report(node, err, NULL);
+    }
+    tick = (tick + 1) % hyperperiod_ticks;
+}
+
+void sensor_sched_report(sensor_node_t *node, esp_err_t err) {
+    if (err != ESP_OK) report(node, err, NULL);
+}
@@ -0,0 +1,75 @@
+/**
+* @file sensor_ring.h
+* @brief Fixed capacity single-producer ring of sensor samples shared between the sensor service and its consumers
+*
+* The sensor task is the only writer. Every pushed sample is given a sequence number and readers keep their
+* own cursor, asking for everything published since the sequence number they last saw. If a reader falls more
+* than the ring capacity behind, the oldest samples are lost and counted as overruns instead of the newest
+* sample silently replacing the one that was still waiting to be sent.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#include "sensor_service.h"
+
+/**
+* @brief Ring buffer counters
+*/
+typedef struct {
+    uint32_t capacity;      /*!< Number of samples the ring retains */
+    uint32_t pushed;        /*!< Total samples pushed since boot, also the next sequence number */
+    uint32_t overruns;      /*!< Samples that were overwritten before a reader got to them */
+} sensor_ring_stats_t;
+
+/**
+* @brief Initialises the ring, must be called before the producer or any reader use it
+*
+* @return esp_err_t The esp error code
+*/
+esp_err_t sensor_ring_init(void);
+
+/**
+* @brief Pushes a sample into the ring, overwriting the oldest sample if the ring is full. Producer side only.
+*
+* @param data Pointer to the sample, its seq field is filled in with the assigned sequence number
+*/
+void sensor_ring_push(sensor_data_t *data);
+
+/**
+* @brief Copies every retained sample with a sequence number >= *seq into out, oldest first
+*
+* @param seq Pointer to the reader cursor, advanced past the last sample copied
+* @param out Pointer to the buffer that receives the samples
+* @param max_count Maximum number of samples to copy into out
+* @return size_t The number of samples copied
+*/
+size_t sensor_ring_read_since(uint32_t *seq, sensor_data_t *out, size_t max_count);
+
+/**
+* @brief Blocks the calling task until a new sample has been pushed. Intended for a single blocking consumer.
+*
+* @param timeout The timeout value in FreeRTOS ticks
+* @return bool True if a sample was pushed, false on timeout
+*/
+bool sensor_ring_wait(TickType_t timeout);
+
+/**
+* @brief Returns the sequence number that will be assigned to the next pushed sample
+*
+* @return uint32_t The next sequence number
+*/
+uint32_t sensor_ring_head_seq(void);
+
+/**
+* @brief Reads the ring counters
+*
+* @param stats Pointer to a structure that receives the counters
+*/
+void sensor_ring_get_stats(sensor_ring_stats_t *stats);
@@ -10,17 +10,49 @@
 #include "stdbool.h"
 #include "esp_err.h"
 
+/*!< Range of the sample period, a whole number of seconds so it stays a multiple of the SGP30's 1 s period */
+#define SENSOR_SAMPLE_PERIOD_MIN_MS 1000
+#define SENSOR_SAMPLE_PERIOD_MAX_MS (3600u * 1000u)
+
+/*!< Most measuring points the service reads, two SHT3X addresses on each of two buses */
+#define SENSOR_MAX_PROBES 4
+
+/**
+* @brief One sample from one probe. A probe is a measuring point made of an SHT3X, an SGP30 or both on one bus. Its id
+*        is bus * 2 plus the SHT3X address offset from 0x44, a lone SGP30 takes the bus's first id. Fields the probe
+*        has no sensor for are left at 0. A sample is only pushed once every sensor of its probe has a reading, so
+*        the other fields always hold one.
+*/
 typedef struct {
-    float temperature;
-    float humidity;
+    int16_t temperature_centi;      /*!< Temperature in 0.01 degC */
+    uint16_t humidity_centi;        /*!< Relative humidity in 0.01 %RH */
     uint32_t eco2;
     uint32_t tvoc;
     uint32_t timestamp_ms;
+    uint32_t seq;
+    uint8_t probe;                  /*!< Id of the probe the sample came from */
 } sensor_data_t;
 
 /**
-* @brief Initialises the sensors and the i2c bus and starts the FreeRTOS sensor measurement task
+* @brief Initialises the i2c buses, registers every sensor found on them and starts the FreeRTOS sensor measurement task
 *
 * @return esp_err_t The esp error code
 */
 esp_err_t sensor_service_start(void);
+
+/**
+* @brief Changes how often a sample of every probe is pushed, also the SHT3X period. Can be called from any task,
+*        the sensor task picks it up at the start of its next cycle. sensor_service_start() loads the period
+*        from the state store, so this doesn't persist it.
+*
+* @param period_ms The new period, a whole number of seconds between SENSOR_SAMPLE_PERIOD_MIN_MS and SENSOR_SAMPLE_PERIOD_MAX_MS
+* @return esp_err_t ESP_ERR_INVALID_ARG if the period is out of range
+*/
+esp_err_t sensor_service_set_sample_period(uint32_t period_ms);
+
+/**
+* @brief Returns the sample period, including a change the sensor task hasn't picked up yet
+*
+* @return uint32_t The sample period in milliseconds
+*/
+uint32_t sensor_service_sample_period(void);
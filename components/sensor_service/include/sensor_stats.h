@@ -0,0 +1,70 @@
+/**
+* @file sensor_stats.h
+* @brief Windowed statistics of every sensor reading, including the 1 Hz SGP30 readings that aren't sampled
+*
+* Each configured window (CONFIG_SENSOR_STATS_WINDOW_1_S and friends) accumulates every reading of every
+* channel in constant memory. When a window's duration has elapsed its results are latched as the latest
+* completed window, the accumulators are emptied and the next window starts where the last one ended.
+* Windows are tumbling rather than sliding, a sliding window can't be kept without storing its samples.
+*
+* The sensor service is the only writer, readers on other tasks poll for completed windows with their
+* own sequence cursor, like the sample ring.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+#include "stats.h"
+
+#define SENSOR_STATS_WINDOW_COUNT 3
+
+typedef enum {
+    SENSOR_STATS_TEMPERATURE,       /*!< 0.01 degC */
+    SENSOR_STATS_HUMIDITY,          /*!< 0.01 %RH */
+    SENSOR_STATS_ECO2,              /*!< ppm */
+    SENSOR_STATS_TVOC,              /*!< ppb */
+    SENSOR_STATS_CHANNEL_COUNT
+} sensor_stats_channel_t;
+
+/**
+* @brief Results of one completed window
+*/
+typedef struct {
+    uint32_t seq;                   /*!< Number of windows of this length completed since boot */
+    uint32_t window_s;              /*!< Window length */
+    uint32_t start_ms;              /*!< Uptime the window started */
+    uint32_t end_ms;                /*!< Uptime the window ended */
+    stats_summary_t channel[SENSOR_STATS_CHANNEL_COUNT];
+} sensor_stats_window_t;
+
+/**
+* @brief Creates the lock guarding the completed windows, safe to call more than once
+*
+* @return esp_err_t The esp error code
+*/
+esp_err_t sensor_stats_init(void);
+
+/**
+* @brief Adds a reading to every enabled window, closing any window whose duration has elapsed first.
+*        Only called by the sensor service.
+*
+* @param channel The channel the reading belongs to
+* @param value The reading in the channel's units
+* @param timestamp_ms Uptime of the reading
+*/
+void sensor_stats_add(sensor_stats_channel_t channel, int32_t value, uint32_t timestamp_ms);
+
+/**
+* @brief Reads the latest completed window if it is newer than the caller's cursor
+*
+* @param window Index of the window, below SENSOR_STATS_WINDOW_COUNT
+* @param seq Pointer to the caller's cursor, 0 before the first read. Updated when a window is returned.
+* @param out Pointer to a structure that receives the window
+* @return bool True if a newer window was copied to out
+*/
+bool sensor_stats_read(size_t window, uint32_t *seq, sensor_stats_window_t *out);
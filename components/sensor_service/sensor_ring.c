@@ -0,0 +1,102 @@
+#include "sensor_ring.h"
+
+#include <stdatomic.h>
+#include <string.h>
+#include "freertos/semphr.h"
+
+#include "latency.h"
+
+#if CONFIG_RUNTIME_EVENT_LOOP
+#include "runtime.h"
+#endif
+
+//One spare slot is kept so the slot the producer is currently writing is never inside the readable window
+#define SENSOR_RING_CAPACITY CONFIG_SENSOR_RING_CAPACITY
+#define SENSOR_RING_SLOTS (SENSOR_RING_CAPACITY + 1)
+
+static sensor_data_t ring[SENSOR_RING_SLOTS];
+static atomic_uint_fast32_t head;
+static atomic_uint_fast32_t overruns;
+static SemaphoreHandle_t data_ready;
+
+//Returns the oldest sequence number that can be read safely for a given head
+static inline uint32_t oldest_readable(uint32_t head_seq) {
+    return head_seq > SENSOR_RING_CAPACITY ? head_seq - SENSOR_RING_CAPACITY : 0;
+}
+
+esp_err_t sensor_ring_init(void) {
+    if (data_ready) return ESP_OK;
+
+    data_ready = xSemaphoreCreateBinary();
+    return data_ready ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+void sensor_ring_push(sensor_data_t *data) {
+    uint32_t seq = atomic_load_explicit(&head, memory_order_relaxed);
+
+    data->seq = seq;
+    ring[seq % SENSOR_RING_SLOTS] = *data;
+
+    //Publish the slot to readers only after it has been fully written
+    atomic_store_explicit(&head, seq + 1, memory_order_release);
+    LATENCY_MARK(LATENCY_QUEUE_HOP);
+    xSemaphoreGive(data_ready);
+#if CONFIG_RUNTIME_EVENT_LOOP
+    runtime_signal(RUNTIME_EVENT_SAMPLE_READY);
+#endif
+}
+
+size_t sensor_ring_read_since(uint32_t *seq, sensor_data_t *out, size_t max_count) {
+    if (!seq || !out || max_count == 0) return 0;
+
+    uint32_t head_seq = atomic_load_explicit(&head, memory_order_acquire);
+    uint32_t start = *seq;
+    uint32_t oldest = oldest_readable(head_seq);
+
+    if (start > head_seq) {
+        //Cursor from the future, e.g. a reader that outlived a restart of the producer. Resync to the oldest sample.
+        start = oldest;
+    }
+    else if (start < oldest) {
+        atomic_fetch_add_explicit(&overruns, oldest - start, memory_order_relaxed);
+        start = oldest;
+    }
+
+    size_t count = head_seq - start;
+    if (count > max_count) count = max_count;
+
+    for (size_t i = 0; i < count; i++) {
+        out[i] = ring[(start + i) % SENSOR_RING_SLOTS];
+    }
+
+    //The producer may have lapped us while copying, anything that fell out of the readable window is torn
+    atomic_thread_fence(memory_order_acquire);
+    uint32_t oldest_after = oldest_readable(atomic_load_explicit(&head, memory_order_relaxed));
+    if (oldest_after > start) {
+        size_t torn = oldest_after - start;
+        if (torn > count) torn = count;
+        atomic_fetch_add_explicit(&overruns, torn, memory_order_relaxed);
+        memmove(out, &out[torn], (count - torn) * sizeof(sensor_data_t));
+        count -= torn;
+        start += torn;
+    }
+
+    *seq = start + count;
+    return count;
+}
+
+bool sensor_ring_wait(TickType_t timeout) {
+    return xSemaphoreTake(data_ready, timeout) == pdTRUE;
+}
+
+uint32_t sensor_ring_head_seq(void) {
+    return atomic_load_explicit(&head, memory_order_acquire);
+}
+
+void sensor_ring_get_stats(sensor_ring_stats_t *stats) {
+    if (!stats) return;
+
+    stats->capacity = SENSOR_RING_CAPACITY;
+    stats->pushed = atomic_load_explicit(&head, memory_order_relaxed);
+    stats->overruns = atomic_load_explicit(&overruns, memory_order_relaxed);
+}
@@ -1,187 +1,471 @@
 #include "sensor_service.h"
 
-#include <math.h>
-#include "driver/i2c_master.h"
+#include <stdatomic.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "nvs.h"
 #include "esp_timer.h"
 #include "esp_log.h"
 
-#include "sgp30_controller.h"
-#include "sht3x_controller.h"
+#include "sgp30_sensor.h"
+#include "sht3x_sensor.h"
+#include "sensor_sched.h"
 #include "i2c_controller.h"
+#include "sensor_ring.h"
+#if CONFIG_COMPENSATION_BENCHMARK
+#include "compensation.h"
+#endif
+#include "diagnostics.h"
+#include "state_store.h"
+#include "stats.h"
+#if CONFIG_SENSOR_STATS_ENABLE
+#include "sensor_stats.h"
+#endif
+#if CONFIG_RUNTIME_EVENT_LOOP
+#include "runtime.h"
+#endif
 
 
 #define SGP30_ADDR 0x58
 #define SHT3X_ADDR 0x44
+#define SHT3X_ALT_ADDR 0x45         //ADDR pin pulled high
+#define SENSOR_BUS_COUNT 2
 
-#define SENSOR_TASK_PERIOD_MS 1000
+//By default a sample of every probe is pushed this often, also the SHT3X period. The SGP30 keeps its own 1 s period.
+#define SENSOR_SAMPLE_PERIOD_MS 10000
+//A cycle starting later than this after its nominal time counts as an overrun
+#define SENSOR_CYCLE_SLACK_US 100000
+#define SGP30_BASELINE_MAX_AGE_S (CONFIG_SGP30_BASELINE_MAX_AGE_H * 3600u)
 
 static const char *TAG = "SENSOR_SERVICE";
 
-static bool load_baseline_from_nvs(sgp30_measurement_t *baseline);
-static bool store_baseline_to_nvs(const sgp30_measurement_t *baseline);
-static float calculate_absolute_humidity(float temp, float humidity);
-
-static i2c_master_bus_handle_t bus_handle;
-static i2c_master_dev_handle_t sgp_handle;
-static i2c_master_dev_handle_t sht_handle;
-
+//A measuring point, an SHT3X and/or an SGP30 on one bus. Only touched from the sensor task or the runtime.
+typedef struct {
+    uint8_t id;
+    uint8_t bus;
+    bool has_sht;
+    bool has_sgp;
+    sensor_node_t sht;
+    sensor_node_t sgp;
+    sht3x_sensor_t sht_state;
+    sgp30_sensor_t sgp_state;
+    sensor_data_t data;                 //Sample being filled in by the current cycle
+    uint32_t channels;                  //Channels that have a reading in data
+} probe_t;
+
+static i2c_master_bus_handle_t bus_handles[SENSOR_BUS_COUNT];
+static probe_t probes[SENSOR_MAX_PROBES];
+static size_t probe_count = 0;
+
+#if !CONFIG_RUNTIME_EVENT_LOOP
 static TaskHandle_t sensor_task_handle;
-QueueHandle_t sensor_queue;
+#endif
+
+//The period in use, and a new one waiting for the start of the next cycle (0 if none)
+static _Atomic uint32_t sample_period_ms = SENSOR_SAMPLE_PERIOD_MS;
+static _Atomic uint32_t requested_period_ms = 0;
+
+//Time to the first valid sample has been recorded
+static bool first_sample_seen = false;
+
+//Acquisition mode from the config, the driver picks the periodic rate from the node's period
+static sht3x_mode_t sht_mode_from_config(void) {
+    sht3x_mode_t mode = {
+#if CONFIG_SHT3X_ACQUISITION_ART
+        .acquisition = SHT3X_ART,
+#elif CONFIG_SHT3X_ACQUISITION_SINGLE_SHOT
+        .acquisition = SHT3X_SINGLE_SHOT,
+#elif CONFIG_SHT3X_ACQUISITION_SINGLE_SHOT_STRETCH
+        .acquisition = SHT3X_SINGLE_SHOT_STRETCH,
+#else
+        .acquisition = SHT3X_PERIODIC,
+#endif
+#if CONFIG_SHT3X_REPEATABILITY_MEDIUM
+        .repeatability = SHT3X_REPEATABILITY_MEDIUM,
+#elif CONFIG_SHT3X_REPEATABILITY_LOW
+        .repeatability = SHT3X_REPEATABILITY_LOW,
+#else
+        .repeatability = SHT3X_REPEATABILITY_HIGH,
+#endif
+    };
+    return mode;
+}
 
-static void sensor_task(void *arg) {
-    TickType_t last_wake = xTaskGetTickCount();
+//Counts a failed transaction against its device, returns true if err is an error
+static bool count_error(const sensor_node_t *node, esp_err_t err) {
+    if (err == ESP_OK) return false;
 
-    static int64_t boot_us = 0;
-    static int64_t last_baseline_store_us = 0;
-    static bool baseline_training_complete = false;
-    static uint8_t shtSampleCount = 10;
-    
-    if (boot_us == 0) {
-        boot_us = esp_timer_get_time();
+    bool crc = err == ESP_ERR_INVALID_CRC;
+    if (node->driver == &sgp30_sensor_driver) {
+        diagnostics_count(crc ? DIAG_SGP30_CRC_ERRORS : DIAG_SGP30_I2C_ERRORS);
+    }
+    else {
+        diagnostics_count(crc ? DIAG_SHT3X_CRC_ERRORS : DIAG_SHT3X_I2C_ERRORS);
     }
+    return true;
+}
 
-    for (;;) {
-        sht3x_measurement_t sht_measurement;
-        sgp30_measurement_t sgp_measurement;
-
-        sensor_data_t data;
-
-        if(shtSampleCount == 10) {
-            data.timestamp_ms = xTaskGetTickCount() * portTICK_PERIOD_MS;
-
-            if (sht3x_measure(sht_handle, &sht_measurement) == ESP_OK) {
-                data.temperature = sht_measurement.temp;
-                data.humidity = sht_measurement.humidity;
-                sgp30_send_absolute_humidity(sgp_handle, calculate_absolute_humidity(sht_measurement.temp, sht_measurement.humidity));
-            }
-            if (sgp30_measure(sgp_handle, &sgp_measurement) == ESP_OK) {
-                data.eco2 = sgp_measurement.eco2;
-                data.tvoc = sgp_measurement.tvoc;
-            }
-
-            xQueueOverwrite(sensor_queue, &data);
-            shtSampleCount = 1;
-        }
-        else {
-            //SGP30 needs a measurement every second to maintain accuracy, even if we only need a sample every 10 seconds
-            sgp30_measure(sgp_handle, &sgp_measurement);
+#if CONFIG_SENSOR_STATS_ENABLE
+static const sensor_stats_channel_t stats_channel[SENSOR_CHANNEL_COUNT] = {
+    [SENSOR_CHANNEL_TEMPERATURE] = SENSOR_STATS_TEMPERATURE,
+    [SENSOR_CHANNEL_HUMIDITY] = SENSOR_STATS_HUMIDITY,
+    [SENSOR_CHANNEL_ECO2] = SENSOR_STATS_ECO2,
+    [SENSOR_CHANNEL_TVOC] = SENSOR_STATS_TVOC,
+};
+#endif
+
+//Every result from every node lands here and goes into its probe's sample. The SGP30 reports every second,
+//the sample keeps its latest reading.
+static void sensor_result(sensor_node_t *node, esp_err_t err, const sensor_reading_t *reading) {
+    probe_t *probe = node->owner;
+    if (count_error(node, err)) return;
+
+    sensor_data_t *data = &probe->data;
+    probe->channels |= reading->channels;
+    if (reading->channels & SENSOR_CHANNEL_BIT(SENSOR_CHANNEL_TEMPERATURE)) data->temperature_centi = (int16_t)reading->value[SENSOR_CHANNEL_TEMPERATURE];
+    if (reading->channels & SENSOR_CHANNEL_BIT(SENSOR_CHANNEL_HUMIDITY)) data->humidity_centi = (uint16_t)reading->value[SENSOR_CHANNEL_HUMIDITY];
+    if (reading->channels & SENSOR_CHANNEL_BIT(SENSOR_CHANNEL_ECO2)) data->eco2 = (uint32_t)reading->value[SENSOR_CHANNEL_ECO2];
+    if (reading->channels & SENSOR_CHANNEL_BIT(SENSOR_CHANNEL_TVOC)) data->tvoc = (uint32_t)reading->value[SENSOR_CHANNEL_TVOC];
+
+#if CONFIG_SENSOR_STATS_ENABLE
+    //Every reading goes into the statistics, not just the sampled ones. Statistics are kept for the primary
+    //probe only so their memory doesn't grow with the probe count.
+    if (probe == &probes[0]) {
+        uint32_t timestamp_ms = xTaskGetTickCount() * portTICK_PERIOD_MS;
+        for (int channel = 0; channel < SENSOR_CHANNEL_COUNT; channel++) {
+            if (reading->channels & SENSOR_CHANNEL_BIT(channel)) sensor_stats_add(stats_channel[channel], reading->value[channel], timestamp_ms);
         }
-        shtSampleCount++;
+    }
+#endif
+}
+
+static void store_baseline(sensor_node_t *node, const sgp30_measurement_t *baseline) {
+    probe_t *probe = node->owner;
 
-        int64_t now_us = esp_timer_get_time();
-        int64_t uptime_sec = (now_us - boot_us) / 1000000;
+    //Written by the store's worker so a slow flash erase can't stretch the cycle. Skipped if the baseline
+    //hasn't changed, so reading it every hour costs no flash writes.
+    state_store_set_sgp30_baseline(probe->bus, baseline->eco2, baseline->tvoc);
+    state_store_commit_async();
+}
+
+#if CONFIG_DIAGNOSTICS_ENABLE
+//Measures the period between cycle starts against the scheduler tick, the SGP30 needs its 1 Hz measurement
+//on time to keep its baseline compensation accurate
+static void measure_cycle_jitter(void) {
+    static int64_t last_start_us = 0;
+    static uint32_t count = 0;
+    static uint32_t max_us = 0;
+    static stats_p2_t p99;
+
+    int64_t now_us = esp_timer_get_time();
+    int64_t period_us = now_us - last_start_us;
+    last_start_us = now_us;
+    if (count++ == 0) return;
+
+    int64_t late_us = period_us - sensor_sched_tick_ms() * 1000LL;
+    uint32_t jitter_us = (uint32_t)(late_us < 0 ? -late_us : late_us);
+    if (late_us > SENSOR_CYCLE_SLACK_US) diagnostics_count(DIAG_CYCLE_OVERRUNS);
+
+    if (jitter_us > max_us) max_us = jitter_us;
+    stats_quantile_add(&p99, 0.99f, (float)jitter_us, count - 1);
+    diagnostics_set_gauge(DIAG_CYCLE_JITTER_MAX_US, max_us);
+    diagnostics_set_gauge(DIAG_CYCLE_JITTER_P99_US, (uint32_t)stats_quantile_estimate(&p99, 0.99f, count - 1));
+}
+#endif
+
+static bool valid_sample_period(uint32_t period_ms) {
+    return period_ms >= SENSOR_SAMPLE_PERIOD_MIN_MS && period_ms <= SENSOR_SAMPLE_PERIOD_MAX_MS && period_ms % 1000 == 0;
+}
+
+//Moves the SHT3X nodes to the new period and plans again, the release pattern restarts with a sample cycle.
+//Runs between cycles, so no conversion is in flight.
+static void apply_sample_period(uint32_t period_ms) {
+    for (size_t i = 0; i < probe_count; i++) {
+        if (probes[i].has_sht) sensor_sched_set_period(&probes[i].sht, period_ms);
+    }
 
-        if (!baseline_training_complete && uptime_sec >= 12 * 3600) {
-            baseline_training_complete = true;
+    esp_err_t err = sensor_sched_plan(period_ms, sensor_result);
+    if (err != ESP_OK) {
+        //Can't happen for a period that passed valid_sample_period(), put the old one back all the same
+        ESP_LOGE(TAG, "Sample period %lu ms rejected: %s", (unsigned long)period_ms, esp_err_to_name(err));
+        period_ms = sample_period_ms;
+        for (size_t i = 0; i < probe_count; i++) {
+            if (probes[i].has_sht) sensor_sched_set_period(&probes[i].sht, period_ms);
         }
+        sensor_sched_plan(period_ms, sensor_result);
+        return;
+    }
+
+    ESP_LOGI(TAG, "Sample period now %lu ms", (unsigned long)period_ms);
+    sample_period_ms = period_ms;
+}
+
+static bool sample_cycle;
+
+//Releases the nodes due on this tick, the results are filled in by sensor_result()
+static void start_cycle(void) {
+#if CONFIG_DIAGNOSTICS_ENABLE
+    measure_cycle_jitter();
+#endif
+    uint32_t requested = atomic_exchange(&requested_period_ms, 0);
+    if (requested != 0 && requested != sample_period_ms) {
+        apply_sample_period(requested);
+    }
 
-        if (baseline_training_complete && (now_us - last_baseline_store_us >= 3600LL * 1000000LL)) {
-            sgp30_measurement_t baseline;
-            if (sgp30_get_iaq_baseline(sgp_handle, &baseline) == ESP_OK) {
-                if(store_baseline_to_nvs(&baseline)) {
-                    last_baseline_store_us = now_us;
-                }
-            }
+    sample_cycle = sensor_sched_due(sample_period_ms);
+    if (sample_cycle) {
+        uint32_t timestamp_ms = xTaskGetTickCount() * portTICK_PERIOD_MS;
+        for (size_t i = 0; i < probe_count; i++) {
+            probes[i].data = (sensor_data_t){ .timestamp_ms = timestamp_ms, .probe = probes[i].id };
+            probes[i].channels = 0;
         }
-        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(SENSOR_TASK_PERIOD_MS));
     }
+    sensor_sched_release();
 }
 
-esp_err_t sensor_service_start(void) {
-    esp_err_t err = i2c_init_bus(&bus_handle);
-    if(err != ESP_OK) return err;
+//Channels the probe's sensors report once they are running
+static uint32_t probe_channels(const probe_t *probe) {
+    uint32_t channels = 0;
+    if (probe->has_sht) channels |= SENSOR_CHANNEL_BIT(SENSOR_CHANNEL_TEMPERATURE) | SENSOR_CHANNEL_BIT(SENSOR_CHANNEL_HUMIDITY);
+    if (probe->has_sgp) channels |= SENSOR_CHANNEL_BIT(SENSOR_CHANNEL_ECO2) | SENSOR_CHANNEL_BIT(SENSOR_CHANNEL_TVOC);
+    return channels;
+}
 
-    err = i2c_add_device(&bus_handle, SGP30_ADDR, &sgp_handle);
-    if(err != ESP_OK) return err;
+//True once every sensor of the probe has a reading in the sample. The SGP30 reports none during its warm up and
+//a failed transfer leaves its channels empty, the sample would otherwise go out with zeros in their place.
+static bool sample_complete(const probe_t *probe) {
+    return (probe->channels & probe_channels(probe)) == probe_channels(probe);
+}
 
-    err = i2c_add_device(&bus_handle, SHT3X_ADDR, &sht_handle);
-    if(err != ESP_OK) return err;
+//Records how long after boot the first sample with a reading from every sensor of its probe was taken, which
+//includes the bus setup and the SGP30 warm up but not the network
+static void record_first_sample(const probe_t *probe) {
+    if (first_sample_seen) return;
 
-    err = sgp_init(sgp_handle);
-    if(err != ESP_OK) return err;
+    first_sample_seen = true;
+    uint32_t elapsed_ms = (uint32_t)(esp_timer_get_time() / 1000);
+    diagnostics_set_gauge(DIAG_FIRST_SAMPLE_MS, elapsed_ms);
+    ESP_LOGI(TAG, "First valid sample after %lu ms, probe %u", (unsigned long)elapsed_ms, probe->id);
+}
 
-    //Check for NVS baseline and send to SGP30 if found
-    sgp30_measurement_t baseline;
-    if(load_baseline_from_nvs(&baseline)) {
-        ESP_LOGI(TAG, "Baseline values loaded, co2: %u tvoc: %u", baseline.eco2, baseline.tvoc);
-        err = sgp30_set_iaq_baseline(sgp_handle, &baseline);
-        if(err != ESP_OK) return err;
+//Called once every transaction of the cycle has completed. An incomplete sample is held back, the next one
+//follows a sample period later.
+static void finish_cycle(void) {
+    if(sample_cycle) {
+        for(size_t i = 0; i < probe_count; i++) {
+            if (!sample_complete(&probes[i])) continue;
+            record_first_sample(&probes[i]);
+            sensor_ring_push(&probes[i].data);
+        }
     }
-    else {
-        ESP_LOGI(TAG, "Couldn't load baseline");
+}
+
+#if CONFIG_RUNTIME_EVENT_LOOP
+
+static runtime_timer_t cycle_timer;
+static runtime_timer_t poll_timer;
+
+//Runs the read phases that are due, then either waits for the next deadline or closes the cycle
+static void poll_transactions(void *ctx) {
+    int64_t wait_us = i2c_sched_poll();
+    if (wait_us < 0) {
+        finish_cycle();
+        return;
     }
+    runtime_timer_start(&poll_timer, (wait_us + 999) / 1000, 0);
+}
 
-    err = sht3x_init(sht_handle);
-    if(err != ESP_OK) return err;
+static void cycle_timer_expired(void *ctx) {
+    if (!i2c_sched_idle()) {
+        //The previous cycle overran its period, let it finish rather than queueing a second set of conversions
+        ESP_LOGW(TAG, "Cycle overrun");
+        return;
+    }
+    //Without an SGP30 the tick is the sample period, so the timer follows a change of period
+    uint32_t tick_ms = sensor_sched_tick_ms();
+    start_cycle();
+    if (sensor_sched_tick_ms() != tick_ms) {
+        runtime_timer_start(&cycle_timer, sensor_sched_tick_ms(), sensor_sched_tick_ms());
+    }
+    poll_transactions(NULL);
+}
+
+static esp_err_t start_cycles(void) {
+    runtime_timer_init(&cycle_timer, cycle_timer_expired, NULL);
+    runtime_timer_init(&poll_timer, poll_transactions, NULL);
+    runtime_timer_start(&cycle_timer, 0, sensor_sched_tick_ms());
+    return ESP_OK;
+}
+
+#else
+
+//Runs the scheduler until every transaction of the cycle has completed, sleeping between deadlines
+static void run_transactions(void) {
+    int64_t wait_us;
+    while ((wait_us = i2c_sched_poll()) >= 0) {
+        if (wait_us > 0) {
+            //Round up and add a tick, the first tick of a delay can be cut short
+            vTaskDelay(pdMS_TO_TICKS((wait_us + 999) / 1000) + 1);
+        }
+    }
+}
 
-    sensor_queue = xQueueCreate(1, sizeof(sensor_data_t));
+static void sensor_task(void *arg) {
+    TickType_t last_wake = xTaskGetTickCount();
+
+    for (;;) {
+        start_cycle();
+        run_transactions();
+        finish_cycle();
+
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(sensor_sched_tick_ms()));
+    }
+}
+
+static esp_err_t start_cycles(void) {
     BaseType_t ok = xTaskCreate(sensor_task, "Sensor Task", 4096, NULL, 5, &sensor_task_handle);
+    if (ok != pdPASS) return ESP_ERR_NO_MEM;
 
-    return ok == pdPASS ? ESP_OK : ESP_ERR_NO_MEM;
+    return diagnostics_register_task(sensor_task_handle);
 }
 
-//Calculates and returns the absolute humidity in g/m^3
-static float calculate_absolute_humidity(float temp, float humidity) {
-    return 216.7f * (((humidity/100.0f) * 6.112f * expf((17.62f * temp) / (243.12f + temp))) / (273.15f + temp));
+#endif
+
+//Hands the stored baseline to the SGP30 node unless it is too old to trust, otherwise the sensor has to train from scratch
+static void load_sgp30_baseline(probe_t *probe) {
+    sgp30_sensor_t *sgp = &probe->sgp_state;
+    uint32_t baseline_age_s;
+
+    if(!state_store_get_sgp30_baseline(probe->bus, &sgp->baseline.eco2, &sgp->baseline.tvoc, &baseline_age_s)) {
+        ESP_LOGI(TAG, "Couldn't load baseline for probe %u", probe->id);
+        return;
+    }
+
+    if(baseline_age_s > SGP30_BASELINE_MAX_AGE_S) {
+        ESP_LOGW(TAG, "Probe %u baseline is %lu h old, discarding it", probe->id, (unsigned long)(baseline_age_s / 3600));
+        return;
+    }
+
+    ESP_LOGI(TAG, "Probe %u baseline values loaded, co2: %u tvoc: %u age: %lu h", probe->id, sgp->baseline.eco2, sgp->baseline.tvoc, (unsigned long)(baseline_age_s / 3600));
+    sgp->restore_baseline = true;
 }
 
-//Checks NVS for baseline CO2 and TVOC values, returns true if the values are loaded into *baseline
-static bool load_baseline_from_nvs(sgp30_measurement_t *baseline) {
-    if (baseline == NULL) return false;
+//Registers a probe and adds its sensors to the scheduler. The SGP30 is compensated with the SHT3X readings, a
+//declared edge between the two nodes.
+static esp_err_t add_probe(uint8_t bus, uint8_t id, uint16_t sht_addr, bool with_sgp) {
+    probe_t *probe = &probes[probe_count];
+    *probe = (probe_t){ .id = id, .bus = bus, .has_sht = sht_addr != 0, .has_sgp = with_sgp };
 
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open("storage", NVS_READONLY, &nvs_handle);
-    if (err != ESP_OK) {
-        return false;
+    esp_err_t err;
+    if(probe->has_sht) {
+        probe->sht_state.mode = sht_mode_from_config();
+        probe->sht = (sensor_node_t){ .driver = &sht3x_sensor_driver, .period_ms = sample_period_ms, .state = &probe->sht_state, .owner = probe };
+
+        err = i2c_add_device(&bus_handles[bus], sht_addr, CONFIG_SHT3X_I2C_SPEED_HZ, &probe->sht.dev);
+        if(err != ESP_OK) return err;
+
+        err = sensor_sched_add(&probe->sht);
+        if(err != ESP_OK) return err;
     }
 
-    err = nvs_get_u16(nvs_handle, "co2_baseline", &baseline->eco2);
-    if (err != ESP_OK) {
-        nvs_close(nvs_handle);
-        return false;
+    if(probe->has_sgp) {
+        probe->sgp_state.baseline_cb = store_baseline;
+        probe->sgp = (sensor_node_t){ .driver = &sgp30_sensor_driver, .state = &probe->sgp_state, .owner = probe };
+
+        err = i2c_add_device(&bus_handles[bus], SGP30_ADDR, CONFIG_SGP30_I2C_SPEED_HZ, &probe->sgp.dev);
+        if(err != ESP_OK) return err;
+
+        load_sgp30_baseline(probe);
+        err = sensor_sched_add(&probe->sgp);
+        if(err != ESP_OK) return err;
     }
 
-    err = nvs_get_u16(nvs_handle, "tvoc_baseline", &baseline->tvoc);
-    if (err != ESP_OK) {
-        nvs_close(nvs_handle);
-        return false;
+    if(probe->has_sht && probe->has_sgp) {
+        err = sensor_sched_connect(&probe->sht, &probe->sgp);
+        if(err != ESP_OK) return err;
     }
 
-    nvs_close(nvs_handle);
-    return true;
+    ESP_LOGI(TAG, "Probe %u: bus %u, SHT3X %s, SGP30 %s", id, bus, sht_addr ? (sht_addr == SHT3X_ADDR ? "0x44" : "0x45") : "none", with_sgp ? "0x58" : "none");
+    probe_count++;
+    return ESP_OK;
 }
 
-//Stores the baseline values in the *baseline buffer to NVS, returns true if successful
-static bool store_baseline_to_nvs(const sgp30_measurement_t *baseline) {
-    if (baseline == NULL) return false;
+//Finds the sensors on a bus and registers them as probes. Ids follow the wiring, bus * 2 plus the SHT3X address
+//offset, so a probe keeps its id across reboots whatever else is connected. The SGP30's address is fixed, so
+//there is at most one per bus. It joins the first SHT3X, which compensates it for humidity, or stands alone.
+static esp_err_t register_bus(uint8_t bus) {
+    bool sgp_found = i2c_probe(&bus_handles[bus], SGP30_ADDR) == ESP_OK;
 
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open("storage", NVS_READWRITE, &nvs_handle);
-    if (err != ESP_OK) {
-        return false;
+    for(uint16_t addr = SHT3X_ADDR; addr <= SHT3X_ALT_ADDR; addr++) {
+        if(i2c_probe(&bus_handles[bus], addr) != ESP_OK) continue;
+
+        esp_err_t err = add_probe(bus, bus * 2 + (addr - SHT3X_ADDR), addr, sgp_found);
+        if(err != ESP_OK) return err;
+        sgp_found = false;
     }
 
-    err = nvs_set_u16(nvs_handle, "co2_baseline", baseline->eco2);
-    if (err != ESP_OK) {
-        nvs_close(nvs_handle);
-        return false;
+    if(sgp_found) {
+        return add_probe(bus, bus * 2, 0, true);
     }
+    return ESP_OK;
+}
 
-    err = nvs_set_u16(nvs_handle, "tvoc_baseline", baseline->tvoc);
-    if (err != ESP_OK) {
-        nvs_close(nvs_handle);
-        return false;
+esp_err_t sensor_service_start(void) {
+    i2c_bus_params_t bus_params[] = {
+        I2C_BUS_PARAMS_DEFAULT(),
+#if CONFIG_I2C_BUS2_ENABLE
+        I2C_BUS2_PARAMS_DEFAULT(),
+#endif
+    };
+
+    esp_err_t err = state_store_init();
+    if(err != ESP_OK) return err;
+
+    //A period set at runtime and persisted by the MQTT commands is used from the first cycle
+    state_store_settings_t settings;
+    if(state_store_get_settings(&settings) && valid_sample_period(settings.sample_period_ms)) {
+        sample_period_ms = settings.sample_period_ms;
+        ESP_LOGI(TAG, "Stored sample period %lu ms", (unsigned long)settings.sample_period_ms);
     }
 
-    err = nvs_commit(nvs_handle);
-    if (err != ESP_OK) {
-        nvs_close(nvs_handle);
-        return false;
+    for(uint8_t bus = 0; bus < sizeof(bus_params) / sizeof(bus_params[0]); bus++) {
+        err = i2c_init_bus(&bus_params[bus], &bus_handles[bus]);
+        if(err != ESP_OK) return err;
+
+        err = register_bus(bus);
+        if(err != ESP_OK) return err;
     }
 
-    nvs_close(nvs_handle);
-    return true;
+    if(probe_count == 0) {
+        ESP_LOGE(TAG, "No sensors found");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    err = sensor_sched_plan(sample_period_ms, sensor_result);
+    if(err != ESP_OK) return err;
+
+    err = sensor_ring_init();
+    if(err != ESP_OK) return err;
+
+#if CONFIG_SENSOR_STATS_ENABLE
+    err = sensor_stats_init();
+    if(err != ESP_OK) return err;
+#endif
+
+#if CONFIG_COMPENSATION_BENCHMARK
+    compensation_benchmark();
+#endif
+
+    return start_cycles();
+}
+
+esp_err_t sensor_service_set_sample_period(uint32_t period_ms) {
+    if(!valid_sample_period(period_ms)) return ESP_ERR_INVALID_ARG;
+
+    requested_period_ms = period_ms;
+    return ESP_OK;
+}
+
+uint32_t sensor_service_sample_period(void) {
+    uint32_t requested = requested_period_ms;
+    return requested != 0 ? requested : sample_period_ms;
 }
@@ -0,0 +1,86 @@
+#include "sensor_stats.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+typedef struct {
+    uint32_t duration_ms;           /*!< 0 if the window is disabled */
+    uint32_t start_ms;
+    bool started;
+    stats_acc_t acc[SENSOR_STATS_CHANNEL_COUNT];
+} stats_window_t;
+
+static stats_window_t windows[SENSOR_STATS_WINDOW_COUNT] = {
+    { .duration_ms = CONFIG_SENSOR_STATS_WINDOW_1_S * 1000u },
+    { .duration_ms = CONFIG_SENSOR_STATS_WINDOW_2_S * 1000u },
+    { .duration_ms = CONFIG_SENSOR_STATS_WINDOW_3_S * 1000u },
+};
+
+//Latest completed windows, written by the sensor service and read by consumers under the lock
+static sensor_stats_window_t completed[SENSOR_STATS_WINDOW_COUNT];
+static SemaphoreHandle_t completed_lock;
+
+esp_err_t sensor_stats_init(void) {
+    if (completed_lock) return ESP_OK;
+
+    completed_lock = xSemaphoreCreateMutex();
+    return completed_lock ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+//Latches the results of a window and starts the next one
+static void close_window(size_t index, uint32_t timestamp_ms) {
+    stats_window_t *window = &windows[index];
+    uint32_t end_ms = window->start_ms + window->duration_ms;
+
+    //Summarised outside the lock, the lock only covers the copy
+    sensor_stats_window_t result = {
+        .seq = completed[index].seq + 1,
+        .window_s = window->duration_ms / 1000,
+        .start_ms = window->start_ms,
+        .end_ms = end_ms,
+    };
+    for (size_t channel = 0; channel < SENSOR_STATS_CHANNEL_COUNT; channel++) {
+        stats_summarise(&window->acc[channel], &result.channel[channel]);
+        stats_reset(&window->acc[channel]);
+    }
+
+    xSemaphoreTake(completed_lock, portMAX_DELAY);
+    completed[index] = result;
+    xSemaphoreGive(completed_lock);
+
+    //Back to back windows, unless there was a gap in the readings longer than a window
+    window->start_ms = timestamp_ms - end_ms < window->duration_ms ? end_ms : timestamp_ms;
+}
+
+void sensor_stats_add(sensor_stats_channel_t channel, int32_t value, uint32_t timestamp_ms) {
+    if (channel >= SENSOR_STATS_CHANNEL_COUNT || !completed_lock) return;
+
+    for (size_t i = 0; i < SENSOR_STATS_WINDOW_COUNT; i++) {
+        stats_window_t *window = &windows[i];
+        if (window->duration_ms == 0) continue;
+
+        if (!window->started) {
+            window->started = true;
+            window->start_ms = timestamp_ms;
+        }
+        else if (timestamp_ms - window->start_ms >= window->duration_ms) {
+            close_window(i, timestamp_ms);
+        }
+
+        stats_add(&window->acc[channel], (float)value);
+    }
+}
+
+bool sensor_stats_read(size_t window, uint32_t *seq, sensor_stats_window_t *out) {
+    if (window >= SENSOR_STATS_WINDOW_COUNT || !seq || !out || !completed_lock) return false;
+
+    bool newer = false;
+    xSemaphoreTake(completed_lock, portMAX_DELAY);
+    if (completed[window].seq != *seq) {
+        *out = completed[window];
+        *seq = out->seq;
+        newer = true;
+    }
+    xSemaphoreGive(completed_lock);
+    return newer;
+}
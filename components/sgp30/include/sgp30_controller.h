@@ -1,5 +1,5 @@
 /**
-* @file sgp30.h
+* @file sgp30_controller.h
 * @brief Driver interface for the SGP30 air quality sensor
 *
 * Provides initialisation and measurement functions for the Sensirion
@@ -12,7 +12,8 @@
 #include <stdint.h>
 
 #include "esp_err.h"
-#include "driver/i2c_master.h"
+#include "i2c_controller.h"
+#include "i2c_scheduler.h"
 
 /**
 * @brief SGP30 air quality measurement data
@@ -22,6 +23,20 @@ typedef struct {
     uint16_t tvoc;
 } sgp30_measurement_t;
 
+/*!< Fields of the feature set word */
+#define SGP30_PRODUCT_TYPE(feature_set) ((feature_set) >> 12)
+#define SGP30_PRODUCT_VERSION(feature_set) ((feature_set) & 0xFF)
+/*!< First product version with the TVOC inceptive baseline */
+#define SGP30_TVOC_INCEPTIVE_MIN_VERSION 0x21
+
+/**
+* @brief SGP30 raw signals, proportional to the log of the gas concentrations
+*/
+typedef struct {
+    uint16_t h2;
+    uint16_t ethanol;
+} sgp30_raw_t;
+
 /**
 * @brief Initializes the SGP30 sensor
 *
@@ -43,10 +58,10 @@ esp_err_t sgp30_measure(i2c_master_dev_handle_t dev, sgp30_measurement_t *out);
  * @brief Sends an absolute humidity reading to the sgp30 to use for more accurate co2 and tvoc measurements
  *
  * @param dev I2C device handle for the SGP30
- * @param absolute_humidity Float value of the humidity in g/m^3
+ * @param absolute_humidity Absolute humidity in 8.8 fixed point g/m^3, see compensation_absolute_humidity()
  * @return esp_err_t ESP error code
  */
-esp_err_t sgp30_send_absolute_humidity(i2c_master_dev_handle_t dev, float absolute_humidity);
+esp_err_t sgp30_send_absolute_humidity(i2c_master_dev_handle_t dev, uint16_t absolute_humidity);
 
 /**
  * @brief Sets the air quality baseline levels on the SGP30
@@ -65,3 +80,95 @@ esp_err_t sgp30_set_iaq_baseline(i2c_master_dev_handle_t dev, const sgp30_measur
  * @return esp_err_t ESP error code
  */
 esp_err_t sgp30_get_iaq_baseline(i2c_master_dev_handle_t dev, sgp30_measurement_t *baseline);
+
+/**
+ * @brief Starts an air quality measurement on the I2C scheduler without waiting for it to complete.
+ *        Decode the result with sgp30_parse_measurement() from the completion callback.
+ *
+ * @param txn Pointer to the transaction to use, must stay valid until the callback has run
+ * @param dev I2C device handle for the SGP30
+ * @param cb Completion callback
+ * @param ctx Caller context passed back through txn->ctx
+ * @return esp_err_t ESP error code
+ */
+esp_err_t sgp30_measure_async(i2c_txn_t *txn, i2c_master_dev_handle_t dev, i2c_txn_cb_t cb, void *ctx);
+
+/**
+ * @brief Starts a read of the iaq baseline on the I2C scheduler without waiting for it to complete.
+ *        Decode the result with sgp30_parse_measurement() from the completion callback.
+ *
+ * @param txn Pointer to the transaction to use, must stay valid until the callback has run
+ * @param dev I2C device handle for the SGP30
+ * @param cb Completion callback
+ * @param ctx Caller context passed back through txn->ctx
+ * @return esp_err_t ESP error code
+ */
+esp_err_t sgp30_get_iaq_baseline_async(i2c_txn_t *txn, i2c_master_dev_handle_t dev, i2c_txn_cb_t cb, void *ctx);
+
+/**
+ * @brief Queues an absolute humidity update on the I2C scheduler, it is sent once the SGP30 is free
+ *
+ * @param txn Pointer to the transaction to use, must stay valid until the callback has run
+ * @param dev I2C device handle for the SGP30
+ * @param absolute_humidity Absolute humidity in 8.8 fixed point g/m^3, see compensation_absolute_humidity()
+ * @param cb Completion callback, may be NULL
+ * @param ctx Caller context passed back through txn->ctx
+ * @return esp_err_t ESP error code
+ */
+esp_err_t sgp30_send_absolute_humidity_async(i2c_txn_t *txn, i2c_master_dev_handle_t dev, uint16_t absolute_humidity, i2c_txn_cb_t cb, void *ctx);
+
+/**
+ * @brief Checks the crc and decodes a completed measurement or baseline transaction
+ *
+ * @param txn Pointer to the completed transaction
+ * @param out Pointer to a structure that receives the measurement data
+ * @return esp_err_t ESP error code
+ */
+esp_err_t sgp30_parse_measurement(const i2c_txn_t *txn, sgp30_measurement_t *out);
+
+/**
+ * @brief Reads the raw H2 and ethanol signals, for part verification and testing. Must not be called more than
+ *        once a second between the 1 Hz air quality measurements.
+ *
+ * @param dev I2C device handle for the SGP30
+ * @param out Pointer to a structure that receives the raw signals
+ * @return esp_err_t ESP error code
+ */
+esp_err_t sgp30_measure_raw(i2c_master_dev_handle_t dev, sgp30_raw_t *out);
+
+/**
+ * @brief Reads the product type and version, see SGP30_PRODUCT_TYPE() and SGP30_PRODUCT_VERSION()
+ *
+ * @param dev I2C device handle for the SGP30
+ * @param feature_set Pointer that receives the feature set word
+ * @return esp_err_t ESP error code
+ */
+esp_err_t sgp30_get_feature_set(i2c_master_dev_handle_t dev, uint16_t *feature_set);
+
+/**
+ * @brief Runs the on chip self test, blocks for 220 ms. The datasheet rules it out once sgp_init() has been
+ *        sent, so it is for production checks before initialisation.
+ *
+ * @param dev I2C device handle for the SGP30
+ * @return esp_err_t ESP_OK if the test passed, ESP_FAIL if it failed, otherwise the error from the bus
+ */
+esp_err_t sgp30_measure_test(i2c_master_dev_handle_t dev);
+
+/**
+ * @brief Reads the TVOC inceptive baseline, a factory starting point for the TVOC baseline that shortens its
+ *        first training when no stored baseline is available. Needs product version SGP30_TVOC_INCEPTIVE_MIN_VERSION.
+ *
+ * @param dev I2C device handle for the SGP30
+ * @param baseline Pointer that receives the inceptive baseline
+ * @return esp_err_t ESP error code
+ */
+esp_err_t sgp30_get_tvoc_inceptive_baseline(i2c_master_dev_handle_t dev, uint16_t *baseline);
+
+/**
+ * @brief Sets the TVOC baseline on its own, used with the inceptive baseline right after sgp_init()
+ *
+ * @param dev I2C device handle for the SGP30
+ * @param baseline The TVOC baseline
+ * @return esp_err_t ESP error code
+ */
+esp_err_t sgp30_set_tvoc_baseline(i2c_master_dev_handle_t dev, uint16_t baseline);
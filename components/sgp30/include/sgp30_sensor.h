@@ -0,0 +1,42 @@
+/**
+* @file sgp30_sensor.h
+* @brief SGP30 implementation of the sensor driver interface, see sensor_driver.h
+*
+* Reports eCO2 and TVOC. The SGP30 runs its baseline compensation on chip and needs a measurement every second
+* to keep it accurate, so the node keeps the driver's 1 s period. Temperature and humidity from a node connected
+* to it are sent to the sensor as absolute humidity before its next measurement. The fixed readings of the 15 s
+* warm up after initialisation are reported with no channels.
+*
+* Once the baseline has trained it is read every hour and handed to the owner to store, and a stored baseline
+* can be restored when the node is added.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sensor_driver.h"
+#include "sgp30_controller.h"
+
+/**
+* @brief Node state, set node->state to one of these before adding the node
+*/
+typedef struct {
+    bool restore_baseline;          /*!< Restore baseline when the node is added */
+    sgp30_measurement_t baseline;   /*!< Stored baseline to restore */
+    /*!< Receives the baseline every hour once it has trained, may be NULL */
+    void (*baseline_cb)(sensor_node_t *node, const sgp30_measurement_t *baseline);
+
+    /* Driver private */
+    i2c_txn_t humidity_txn;
+    i2c_txn_t baseline_txn;
+    bool humidity_pending;
+    uint16_t absolute_humidity;
+    bool training_complete;
+    bool baseline_pending;
+    int64_t init_us;
+    int64_t last_baseline_us;
+} sgp30_sensor_t;
+
+extern const sensor_driver_t sgp30_sensor_driver;
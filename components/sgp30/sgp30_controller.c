@@ -4,26 +4,26 @@
 #include "freertos/task.h"
 
 #include "i2c_controller.h"
-#include "crc8.h"
-
-#define SGP30_CMD_INIT 0x2003
-#define SGP30_CMD_MEASURE 0x2008
-#define SGP30_CMD_SET_ABSOLUTE_HUMIDITY 0x2061
-#define SGP30_CMD_GET_IAQ_BASELINE 0x2015
-#define SGP30_CMD_SET_IAQ_BASELINE 0x201E
-#define SGP_TIMEOUT_MS 100
-#define SGP_INIT_WARM_UP_MS 15000
-#define SGP_MEASURE_WAIT_MS 20
+#include "sensirion_cmd.h"
 
-//Helper function to send commands
-static inline esp_err_t sgp30_send_cmd(i2c_master_dev_handle_t dev, uint16_t cmd) {
-    uint8_t buf[2] = { cmd >> 8, cmd & 0xFF };
-    return i2c_write_to_device(dev, buf, sizeof(buf), pdMS_TO_TICKS(SGP_TIMEOUT_MS));
-}
+#define SGP_INIT_WARM_UP_MS 15000
+#define SGP_MEASURE_TEST_PASSED 0xD400
+
+//Commands with their maximum execution times from the datasheet
+static const sensirion_cmd_t cmd_init = { .opcode = 0x2003, .exec_us = 10000 };
+static const sensirion_cmd_t cmd_measure = { .opcode = 0x2008, .reply_words = 2, .exec_us = 12000 };
+static const sensirion_cmd_t cmd_get_iaq_baseline = { .opcode = 0x2015, .reply_words = 2, .exec_us = 10000 };
+static const sensirion_cmd_t cmd_set_iaq_baseline = { .opcode = 0x201E, .arg_words = 2, .exec_us = 10000 };
+static const sensirion_cmd_t cmd_set_absolute_humidity = { .opcode = 0x2061, .arg_words = 1, .exec_us = 10000 };
+static const sensirion_cmd_t cmd_measure_test = { .opcode = 0x2032, .reply_words = 1, .exec_us = 220000 };
+static const sensirion_cmd_t cmd_get_feature_set = { .opcode = 0x202F, .reply_words = 1, .exec_us = 10000 };
+static const sensirion_cmd_t cmd_measure_raw = { .opcode = 0x2050, .reply_words = 2, .exec_us = 25000 };
+static const sensirion_cmd_t cmd_get_tvoc_inceptive_baseline = { .opcode = 0x20B3, .reply_words = 1, .exec_us = 10000 };
+static const sensirion_cmd_t cmd_set_tvoc_baseline = { .opcode = 0x2077, .arg_words = 1, .exec_us = 10000 };
 
 esp_err_t sgp_init(i2c_master_dev_handle_t dev) {
     //Send the init message to the device
-    esp_err_t error = sgp30_send_cmd(dev, SGP30_CMD_INIT);
+    esp_err_t error = sensirion_execute(dev, &cmd_init, NULL, NULL);
     if(error != ESP_OK) return error;
 
     //Need to wait 15 seconds for sensor to initialise
@@ -31,97 +31,110 @@ esp_err_t sgp_init(i2c_master_dev_handle_t dev) {
     return ESP_OK;
 }
 
-esp_err_t sgp30_measure(i2c_master_dev_handle_t dev, sgp30_measurement_t *out) {
-    //Send measure command, wait for measure to complete (max 12 ms) then read in the measurement
-    uint8_t read_buf[6];
-    esp_err_t error = sgp30_send_cmd(dev, SGP30_CMD_MEASURE);
-    if(error != ESP_OK) return error;
-
-    vTaskDelay(pdMS_TO_TICKS(SGP_MEASURE_WAIT_MS));
+esp_err_t sgp30_parse_measurement(const i2c_txn_t *txn, sgp30_measurement_t *out) {
+    if (out == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
 
-    error = i2c_read_from_device(dev, read_buf, sizeof(read_buf), pdMS_TO_TICKS(SGP_TIMEOUT_MS));
+    uint16_t words[2];
+    esp_err_t error = sensirion_decode(txn, words, 2);
     if(error != ESP_OK) return error;
 
-    //Parse measurement and check crc
-
-    uint8_t eco2_crc = read_buf[2];
-    uint8_t tvoc_crc = read_buf[5];
+    out->eco2 = words[0];
+    out->tvoc = words[1];
+    return ESP_OK;
+}
 
-    if(eco2_crc != crc8(&read_buf[0], 2) || tvoc_crc != crc8(&read_buf[3], 2)) {
-        return ESP_ERR_INVALID_CRC;
+esp_err_t sgp30_measure(i2c_master_dev_handle_t dev, sgp30_measurement_t *out) {
+    if (out == NULL) {
+        return ESP_ERR_INVALID_ARG;
     }
 
-    out->eco2 = (read_buf[0] << 8) | read_buf[1];
-    out->tvoc = (read_buf[3] << 8) | read_buf[4];
+    uint16_t words[2];
+    esp_err_t error = sensirion_execute(dev, &cmd_measure, NULL, words);
+    if(error != ESP_OK) return error;
 
+    out->eco2 = words[0];
+    out->tvoc = words[1];
     return ESP_OK;
 }
 
-esp_err_t sgp30_send_absolute_humidity(i2c_master_dev_handle_t dev, float absolute_humidity) {
-    if (absolute_humidity < 1.0f/256.0f) absolute_humidity = 1.0f/256.0f; // min
-    if (absolute_humidity > 255.99609375f) absolute_humidity = 255.99609375f; // max
-
-    //Need to send the humidity as the CMD (2 bytes) + the payload (2 bytes + 1 crc byte)
-    uint8_t out[5];
-    
-    //Convert float to fixed point bytes
-    //Example: 0x0F80 corresponds to a humidity value of 15.50 g/m3 (15 g/m3 + 128/256 g/m3)
-    uint16_t humidity_bytes = (uint16_t)(absolute_humidity * 256.0f + 0.5f); 
+esp_err_t sgp30_measure_async(i2c_txn_t *txn, i2c_master_dev_handle_t dev, i2c_txn_cb_t cb, void *ctx) {
+    return sensirion_submit(txn, dev, &cmd_measure, NULL, cb, ctx);
+}
 
-    out[0] = SGP30_CMD_SET_ABSOLUTE_HUMIDITY >> 8;
-    out[1] = SGP30_CMD_SET_ABSOLUTE_HUMIDITY & 0xFF;
-    out[2] = humidity_bytes >> 8;
-    out[3] = humidity_bytes & 0xFF;
-    out[4] = crc8(&out[2], 2);
+esp_err_t sgp30_send_absolute_humidity(i2c_master_dev_handle_t dev, uint16_t absolute_humidity) {
+    //Example: 0x0F80 corresponds to a humidity value of 15.50 g/m3 (15 g/m3 + 128/256 g/m3), 0 disables compensation
+    return sensirion_execute(dev, &cmd_set_absolute_humidity, &absolute_humidity, NULL);
+}
 
-    return i2c_write_to_device(dev, out, sizeof(out), pdMS_TO_TICKS(SGP_TIMEOUT_MS));
+esp_err_t sgp30_send_absolute_humidity_async(i2c_txn_t *txn, i2c_master_dev_handle_t dev, uint16_t absolute_humidity, i2c_txn_cb_t cb, void *ctx) {
+    return sensirion_submit(txn, dev, &cmd_set_absolute_humidity, &absolute_humidity, cb, ctx);
 }
 
 esp_err_t sgp30_set_iaq_baseline(i2c_master_dev_handle_t dev, const sgp30_measurement_t *baseline) {
-    uint8_t out[8];
-
     if (baseline == NULL) {
         return ESP_ERR_INVALID_ARG;
     }
 
-    out[0] = SGP30_CMD_SET_IAQ_BASELINE >> 8;
-    out[1] = SGP30_CMD_SET_IAQ_BASELINE & 0xFF;
+    const uint16_t words[2] = { baseline->eco2, baseline->tvoc };
+    return sensirion_execute(dev, &cmd_set_iaq_baseline, words, NULL);
+}
 
-    out[2] = baseline->eco2 >> 8;
-    out[3] = baseline->eco2 & 0xFF;
-    out[4] = crc8(&out[2], 2);
+esp_err_t sgp30_get_iaq_baseline(i2c_master_dev_handle_t dev, sgp30_measurement_t *baseline) {
+    if (baseline == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
 
-    out[5] = baseline->tvoc >> 8;
-    out[6] = baseline->tvoc & 0xFF;
-    out[7] = crc8(&out[5], 2);
+    uint16_t words[2];
+    esp_err_t error = sensirion_execute(dev, &cmd_get_iaq_baseline, NULL, words);
+    if(error != ESP_OK) return error;
 
-    return i2c_write_to_device(dev, out, sizeof(out), SGP_TIMEOUT_MS);
+    baseline->eco2 = words[0];
+    baseline->tvoc = words[1];
+    return ESP_OK;
 }
 
-esp_err_t sgp30_get_iaq_baseline(i2c_master_dev_handle_t dev, sgp30_measurement_t *baseline) {
-    uint8_t read_buf[6];
+esp_err_t sgp30_get_iaq_baseline_async(i2c_txn_t *txn, i2c_master_dev_handle_t dev, i2c_txn_cb_t cb, void *ctx) {
+    return sensirion_submit(txn, dev, &cmd_get_iaq_baseline, NULL, cb, ctx);
+}
 
-    if (baseline == NULL) {
+esp_err_t sgp30_measure_raw(i2c_master_dev_handle_t dev, sgp30_raw_t *out) {
+    if (out == NULL) {
         return ESP_ERR_INVALID_ARG;
     }
 
-    esp_err_t error = sgp30_send_cmd(dev, SGP30_CMD_GET_IAQ_BASELINE);
+    uint16_t words[2];
+    esp_err_t error = sensirion_execute(dev, &cmd_measure_raw, NULL, words);
     if(error != ESP_OK) return error;
 
-    vTaskDelay(pdMS_TO_TICKS(SGP_MEASURE_WAIT_MS));
+    out->h2 = words[0];
+    out->ethanol = words[1];
+    return ESP_OK;
+}
+
+esp_err_t sgp30_get_feature_set(i2c_master_dev_handle_t dev, uint16_t *feature_set) {
+    if (feature_set == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return sensirion_execute(dev, &cmd_get_feature_set, NULL, feature_set);
+}
 
-    error = i2c_read_from_device(dev, read_buf, sizeof(read_buf), pdMS_TO_TICKS(SGP_TIMEOUT_MS));
+esp_err_t sgp30_measure_test(i2c_master_dev_handle_t dev) {
+    uint16_t result;
+    esp_err_t error = sensirion_execute(dev, &cmd_measure_test, NULL, &result);
     if(error != ESP_OK) return error;
 
-    uint8_t eco2_crc = read_buf[2];
-    uint8_t tvoc_crc = read_buf[5];
+    return result == SGP_MEASURE_TEST_PASSED ? ESP_OK : ESP_FAIL;
+}
 
-    if(eco2_crc != crc8(&read_buf[0], 2) || tvoc_crc != crc8(&read_buf[3], 2)) {
-        return ESP_ERR_INVALID_CRC;
+esp_err_t sgp30_get_tvoc_inceptive_baseline(i2c_master_dev_handle_t dev, uint16_t *baseline) {
+    if (baseline == NULL) {
+        return ESP_ERR_INVALID_ARG;
     }
+    return sensirion_execute(dev, &cmd_get_tvoc_inceptive_baseline, NULL, baseline);
+}
 
-    baseline->eco2 = (read_buf[0] << 8) | read_buf[1];
-    baseline->tvoc = (read_buf[3] << 8) | read_buf[4];
-
-    return ESP_OK;
+esp_err_t sgp30_set_tvoc_baseline(i2c_master_dev_handle_t dev, uint16_t baseline) {
+    return sensirion_execute(dev, &cmd_set_tvoc_baseline, &baseline, NULL);
 }
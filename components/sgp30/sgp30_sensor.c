@@ -0,0 +1,136 @@
+#include "sgp30_sensor.h"
+
+#include "esp_timer.h"
+
+#include "sensor_sched.h"
+#include "compensation.h"
+
+#define SGP30_SENSOR_CONVERSION_US 12000
+//After Init_air_quality the sensor reports a fixed 400 ppm and 0 ppb for this long
+#define SGP30_SENSOR_WARM_UP_US (15LL * 1000000LL)
+//The baseline needs this long to train from scratch before it is worth storing
+#define SGP30_SENSOR_TRAINING_US (12LL * 3600LL * 1000000LL)
+#define SGP30_SENSOR_BASELINE_PERIOD_US (3600LL * 1000000LL)
+
+//Without a stored baseline TVOC readings take hours to settle, parts that have one start from the factory
+//inceptive baseline instead. Failing here only costs the faster start.
+static void apply_tvoc_inceptive_baseline(i2c_master_dev_handle_t dev) {
+    uint16_t feature_set;
+    uint16_t tvoc_baseline;
+
+    esp_err_t err = sgp30_get_feature_set(dev, &feature_set);
+    if (err != ESP_OK || SGP30_PRODUCT_VERSION(feature_set) < SGP30_TVOC_INCEPTIVE_MIN_VERSION) return;
+
+    err = sgp30_get_tvoc_inceptive_baseline(dev, &tvoc_baseline);
+    if (err == ESP_OK) sgp30_set_tvoc_baseline(dev, tvoc_baseline);
+}
+
+static esp_err_t sgp30_sensor_init(sensor_node_t *node) {
+    sgp30_sensor_t *sgp = node->state;
+
+    esp_err_t err = sgp_init(node->dev);
+    if (err != ESP_OK) return err;
+
+    sgp->humidity_pending = false;
+    sgp->training_complete = false;
+    sgp->baseline_pending = false;
+    sgp->init_us = esp_timer_get_time();
+    sgp->last_baseline_us = sgp->init_us;
+
+    if (sgp->restore_baseline) {
+        err = sgp30_set_iaq_baseline(node->dev, &sgp->baseline);
+        if (err != ESP_OK) return err;
+        //A restored baseline is already trained, the sensor only needs an hour before it is read again
+        sgp->training_complete = true;
+    }
+    else {
+        apply_tvoc_inceptive_baseline(node->dev);
+    }
+    return ESP_OK;
+}
+
+static void humidity_sent(i2c_txn_t *txn, esp_err_t err) {
+    sensor_sched_report(txn->ctx, err);
+}
+
+static esp_err_t sgp30_sensor_start(sensor_node_t *node, i2c_txn_cb_t done) {
+    sgp30_sensor_t *sgp = node->state;
+
+    //Queued ahead of the measurement, the scheduler sends it first
+    if (sgp->humidity_pending) {
+        sgp->humidity_pending = false;
+        sensor_sched_report(node, sgp30_send_absolute_humidity_async(&sgp->humidity_txn, node->dev, sgp->absolute_humidity, humidity_sent, node));
+    }
+    return sgp30_measure_async(&node->txn, node->dev, done, node);
+}
+
+static esp_err_t sgp30_sensor_decode(sensor_node_t *node, esp_err_t err, sensor_reading_t *out) {
+    sgp30_sensor_t *sgp = node->state;
+    sgp30_measurement_t measurement;
+
+    if (err == ESP_OK) err = sgp30_parse_measurement(&node->txn, &measurement);
+    if (err != ESP_OK) return err;
+
+    //The measurements still have to run every second during the warm up, but the placeholder values aren't
+    //readings, so they are left out
+    if (esp_timer_get_time() - sgp->init_us < SGP30_SENSOR_WARM_UP_US) {
+        out->channels = 0;
+        return ESP_OK;
+    }
+
+    out->channels = SENSOR_CHANNEL_BIT(SENSOR_CHANNEL_ECO2) | SENSOR_CHANNEL_BIT(SENSOR_CHANNEL_TVOC);
+    out->value[SENSOR_CHANNEL_ECO2] = measurement.eco2;
+    out->value[SENSOR_CHANNEL_TVOC] = measurement.tvoc;
+    return ESP_OK;
+}
+
+static void baseline_read_done(i2c_txn_t *txn, esp_err_t err) {
+    sensor_node_t *node = txn->ctx;
+    sgp30_sensor_t *sgp = node->state;
+    sgp30_measurement_t baseline;
+
+    if (err == ESP_OK) err = sgp30_parse_measurement(txn, &baseline);
+    sgp->baseline_pending = false;
+    if (err != ESP_OK) {
+        sensor_sched_report(node, err);
+        return;
+    }
+
+    sgp->last_baseline_us = esp_timer_get_time();
+    if (sgp->baseline_cb) sgp->baseline_cb(node, &baseline);
+}
+
+static void sgp30_sensor_poll(sensor_node_t *node, int64_t now_us) {
+    sgp30_sensor_t *sgp = node->state;
+
+    if (!sgp->training_complete && now_us - sgp->init_us >= SGP30_SENSOR_TRAINING_US) {
+        sgp->training_complete = true;
+    }
+
+    //A failed read is retried after the next measurement
+    if (sgp->training_complete && !sgp->baseline_pending && now_us - sgp->last_baseline_us >= SGP30_SENSOR_BASELINE_PERIOD_US) {
+        esp_err_t err = sgp30_get_iaq_baseline_async(&sgp->baseline_txn, node->dev, baseline_read_done, node);
+        sgp->baseline_pending = err == ESP_OK;
+        sensor_sched_report(node, err);
+    }
+}
+
+static void sgp30_sensor_accept(sensor_node_t *node, const sensor_reading_t *input) {
+    sgp30_sensor_t *sgp = node->state;
+    const uint32_t needed = SENSOR_CHANNEL_BIT(SENSOR_CHANNEL_TEMPERATURE) | SENSOR_CHANNEL_BIT(SENSOR_CHANNEL_HUMIDITY);
+
+    if ((input->channels & needed) != needed) return;
+    sgp->absolute_humidity = compensation_absolute_humidity(input->value[SENSOR_CHANNEL_TEMPERATURE], (uint32_t)input->value[SENSOR_CHANNEL_HUMIDITY]);
+    sgp->humidity_pending = true;
+}
+
+const sensor_driver_t sgp30_sensor_driver = {
+    .name = "SGP30",
+    .period_ms = 1000,
+    .conversion_us = SGP30_SENSOR_CONVERSION_US,
+    .init = sgp30_sensor_init,
+    .start = sgp30_sensor_start,
+    .decode = sgp30_sensor_decode,
+    .poll = sgp30_sensor_poll,
+    .accept = sgp30_sensor_accept,
+};
@@ -1,40 +1,165 @@
 /**
-* @file sgp30.h
+* @file sht3x_controller.h
 * @brief Driver interface for the SHT3X temperature and humidity sensor
 *
 * Provides initialisation and measurement functions for the Sensirion
 * SHT3X sensor, allowing retrieval of temperature and humidity measurements
 * over an I2C interface
+*
+* The sensor can measure on demand (single shot, optionally holding SCL through the conversion) or on its own
+* at a fixed rate (periodic and ART modes), in which case every measurement is a single Fetch Data transfer
+* with no conversion wait. Only Fetch Data, Break and ART are accepted while a periodic mode runs, the other
+* commands, soft reset included, are NACKed until a Break has stopped it.
 */
 
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "esp_err.h"
-#include "driver/i2c_master.h"
+#include "i2c_controller.h"
+#include "i2c_scheduler.h"
+
+/*!< Status register bits */
+#define SHT3X_STATUS_ALERT_PENDING (1u << 15)
+#define SHT3X_STATUS_HEATER_ON (1u << 13)
+#define SHT3X_STATUS_RH_ALERT (1u << 11)
+#define SHT3X_STATUS_T_ALERT (1u << 10)
+#define SHT3X_STATUS_RESET_DETECTED (1u << 4)
+#define SHT3X_STATUS_COMMAND_FAILED (1u << 1)
+#define SHT3X_STATUS_WRITE_CRC_FAILED (1u << 0)
 
 /**
 * @brief SHT3X temperature and humidity measurement data
 */
 typedef struct {
-    float temp;
-    float humidity;
+    int16_t temperature_centi;      /*!< Temperature in 0.01 degC */
+    uint16_t humidity_centi;        /*!< Relative humidity in 0.01 %RH */
 } sht3x_measurement_t;
 
 /**
-* @brief Initializes the SHT3X sensor
+* @brief How measurements are acquired
+*/
+typedef enum {
+    SHT3X_SINGLE_SHOT,              /*!< Command, conversion wait, then read */
+    SHT3X_SINGLE_SHOT_STRETCH,      /*!< The sensor holds SCL through the conversion, one transfer that keeps the bus busy */
+    SHT3X_PERIODIC,                 /*!< The sensor measures on its own at the chosen rate, reads fetch the latest result */
+    SHT3X_ART,                      /*!< Periodic at 4 Hz with accelerated response time */
+} sht3x_acquisition_t;
+
+/**
+* @brief Measurement repeatability, higher repeatability means less noise and a longer conversion
+*/
+typedef enum {
+    SHT3X_REPEATABILITY_HIGH,       /*!< 15.5 ms conversion */
+    SHT3X_REPEATABILITY_MEDIUM,     /*!< 6.5 ms conversion */
+    SHT3X_REPEATABILITY_LOW,        /*!< 4.5 ms conversion */
+} sht3x_repeatability_t;
+
+/**
+* @brief Periodic measurement rates in measurements per second
+*/
+typedef enum {
+    SHT3X_RATE_0_5_MPS,
+    SHT3X_RATE_1_MPS,
+    SHT3X_RATE_2_MPS,
+    SHT3X_RATE_4_MPS,
+    SHT3X_RATE_10_MPS,
+} sht3x_rate_t;
+
+/**
+* @brief Acquisition mode
+*/
+typedef struct {
+    sht3x_acquisition_t acquisition;
+    sht3x_repeatability_t repeatability;    /*!< Not used in ART mode */
+    sht3x_rate_t rate;                      /*!< Only used in periodic mode */
+} sht3x_mode_t;
+
+/**
+* @brief Initializes the SHT3X sensor, stopping any periodic acquisition left running from before a reboot
 *
 * @param dev I2C device handle for the SHT3X
 * @return esp_err_t ESP error code
 */
 esp_err_t sht3x_init(i2c_master_dev_handle_t dev);
 
+/**
+* @brief Switches the acquisition mode. Any running periodic acquisition is stopped first, and a periodic or ART
+*        mode is started and waited on until its first result is ready, so the first fetch doesn't come early.
+*
+* @param dev I2C device handle for the SHT3X
+* @param mode Pointer to the mode
+* @return esp_err_t ESP error code
+*/
+esp_err_t sht3x_set_mode(i2c_master_dev_handle_t dev, const sht3x_mode_t *mode);
+
+/**
+* @brief Picks the slowest periodic rate that measures at least twice per read interval, so a read that comes
+*        early on host jitter or the sensor's clock drift still finds a fresh result
+*
+* @param interval_ms Time between reads
+* @return sht3x_rate_t The rate
+*/
+sht3x_rate_t sht3x_rate_for_interval(uint32_t interval_ms);
+
 /**
  * @brief Reads a measurement from the SHT3X sensor
  *
  * @param dev I2C device handle for the SHT3X
+ * @param mode Pointer to the mode the sensor is in
  * @param out Pointer to a structure that receives the measurement data
  * @return esp_err_t ESP error code
  */
-esp_err_t sht3x_measure(i2c_master_dev_handle_t dev, sht3x_measurement_t *out);
+esp_err_t sht3x_measure(i2c_master_dev_handle_t dev, const sht3x_mode_t *mode, sht3x_measurement_t *out);
+
+/**
+ * @brief Starts a measurement on the I2C scheduler without waiting for it to complete. In the periodic modes
+ *        this fetches the latest result, which the sensor NACKs if it has no new one since the last fetch.
+ *        Decode the result with sht3x_parse_measurement() from the completion callback.
+ *
+ * @param txn Pointer to the transaction to use, must stay valid until the callback has run
+ * @param dev I2C device handle for the SHT3X
+ * @param mode Pointer to the mode the sensor is in
+ * @param cb Completion callback
+ * @param ctx Caller context passed back through txn->ctx
+ * @return esp_err_t ESP error code
+ */
+esp_err_t sht3x_measure_async(i2c_txn_t *txn, i2c_master_dev_handle_t dev, const sht3x_mode_t *mode, i2c_txn_cb_t cb, void *ctx);
+
+/**
+ * @brief Checks the crc and decodes a completed measurement transaction
+ *
+ * @param txn Pointer to the completed transaction
+ * @param out Pointer to a structure that receives the measurement data
+ * @return esp_err_t ESP error code
+ */
+esp_err_t sht3x_parse_measurement(const i2c_txn_t *txn, sht3x_measurement_t *out);
+
+/**
+ * @brief Switches the internal heater, used to check the sensor or drive off condensation. Temperature readings
+ *        are a few degrees high while it is on.
+ *
+ * @param dev I2C device handle for the SHT3X
+ * @param enable True to switch the heater on
+ * @return esp_err_t ESP error code
+ */
+esp_err_t sht3x_set_heater(i2c_master_dev_handle_t dev, bool enable);
+
+/**
+ * @brief Reads the status register, see the SHT3X_STATUS_ bits
+ *
+ * @param dev I2C device handle for the SHT3X
+ * @param status Pointer that receives the status register
+ * @return esp_err_t ESP error code
+ */
+esp_err_t sht3x_read_status(i2c_master_dev_handle_t dev, uint16_t *status);
+
+/**
+ * @brief Clears the alert, reset detected and command status bits
+ *
+ * @param dev I2C device handle for the SHT3X
+ * @return esp_err_t ESP error code
+ */
+esp_err_t sht3x_clear_status(i2c_master_dev_handle_t dev);
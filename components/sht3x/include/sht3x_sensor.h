@@ -0,0 +1,27 @@
+/**
+* @file sht3x_sensor.h
+* @brief SHT3X implementation of the sensor driver interface, see sensor_driver.h
+*
+* Reports temperature and humidity. In the periodic modes the sensor measures at the slowest rate that keeps
+* up with the node's period, and the acquisition is restarted when that period changes and after repeated failed
+* reads in case the part reset on its own.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#include "sensor_driver.h"
+#include "sht3x_controller.h"
+
+/**
+* @brief Node state, set node->state to one of these before adding the node
+*/
+typedef struct {
+    sht3x_mode_t mode;              /*!< Acquisition mode, the periodic rate is chosen from the node's period */
+
+    /* Driver private */
+    uint8_t failures;
+} sht3x_sensor_t;
+
+extern const sensor_driver_t sht3x_sensor_driver;
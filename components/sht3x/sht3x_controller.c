@@ -4,53 +4,161 @@
 #include "freertos/task.h"
 
 #include "i2c_controller.h"
-#include "crc8.h"
+#include "sensirion_cmd.h"
 
-#define SHT3X_CMD_RESET 0x30A2 
-#define SHT3X_CMD_MEASURE 0x2416
-#define SHT_TIMEOUT_MS 100
-#define SHT_INIT_WARM_UP_MS 20
-#define SHT_MEASURE_WAIT_MS 20
+//Maximum conversion times from the datasheet, by repeatability
+#define SHT_HIGH_US 15500
+#define SHT_MEDIUM_US 6500
+#define SHT_LOW_US 4500
+//Time the sensor needs to accept the next command after a break, heater or status command
+#define SHT_COMMAND_US 1000
 
-//Helper function to send commands
-static inline esp_err_t sht3x_send_cmd(i2c_master_dev_handle_t dev, uint16_t cmd) {
-    uint8_t buf[2] = { cmd >> 8, cmd & 0xFF };
-    return i2c_write_to_device(dev, buf, sizeof(buf), pdMS_TO_TICKS(SHT_TIMEOUT_MS));
+static const sensirion_cmd_t cmd_reset = { .opcode = 0x30A2, .exec_us = 20000 };
+static const sensirion_cmd_t cmd_break = { .opcode = 0x3093, .exec_us = SHT_COMMAND_US };
+static const sensirion_cmd_t cmd_fetch = { .opcode = 0xE000, .reply_words = 2 };
+static const sensirion_cmd_t cmd_art = { .opcode = 0x2B32, .exec_us = SHT_HIGH_US };
+static const sensirion_cmd_t cmd_heater_on = { .opcode = 0x306D, .exec_us = SHT_COMMAND_US };
+static const sensirion_cmd_t cmd_heater_off = { .opcode = 0x3066, .exec_us = SHT_COMMAND_US };
+static const sensirion_cmd_t cmd_read_status = { .opcode = 0xF32D, .reply_words = 1 };
+static const sensirion_cmd_t cmd_clear_status = { .opcode = 0x3041, .exec_us = SHT_COMMAND_US };
+
+//Single shot commands by repeatability, without clock stretching the read waits out the conversion
+static const sensirion_cmd_t cmd_single_shot[] = {
+    [SHT3X_REPEATABILITY_HIGH] = { .opcode = 0x2400, .reply_words = 2, .exec_us = SHT_HIGH_US },
+    [SHT3X_REPEATABILITY_MEDIUM] = { .opcode = 0x240B, .reply_words = 2, .exec_us = SHT_MEDIUM_US },
+    [SHT3X_REPEATABILITY_LOW] = { .opcode = 0x2416, .reply_words = 2, .exec_us = SHT_LOW_US },
+};
+
+static const sensirion_cmd_t cmd_single_shot_stretch[] = {
+    [SHT3X_REPEATABILITY_HIGH] = { .opcode = 0x2C06, .reply_words = 2 },
+    [SHT3X_REPEATABILITY_MEDIUM] = { .opcode = 0x2C0D, .reply_words = 2 },
+    [SHT3X_REPEATABILITY_LOW] = { .opcode = 0x2C10, .reply_words = 2 },
+};
+
+//Periodic commands by rate then repeatability, executing one waits for the first result
+#define SHT_PERIODIC(high, medium, low) { \
+    [SHT3X_REPEATABILITY_HIGH] = { .opcode = (high), .exec_us = SHT_HIGH_US }, \
+    [SHT3X_REPEATABILITY_MEDIUM] = { .opcode = (medium), .exec_us = SHT_MEDIUM_US }, \
+    [SHT3X_REPEATABILITY_LOW] = { .opcode = (low), .exec_us = SHT_LOW_US }, \
+}
+
+static const sensirion_cmd_t cmd_periodic[][3] = {
+    [SHT3X_RATE_0_5_MPS] = SHT_PERIODIC(0x2032, 0x2024, 0x202F),
+    [SHT3X_RATE_1_MPS] = SHT_PERIODIC(0x2130, 0x2126, 0x212D),
+    [SHT3X_RATE_2_MPS] = SHT_PERIODIC(0x2236, 0x2220, 0x222B),
+    [SHT3X_RATE_4_MPS] = SHT_PERIODIC(0x2334, 0x2322, 0x2329),
+    [SHT3X_RATE_10_MPS] = SHT_PERIODIC(0x2737, 0x2721, 0x272A),
+};
+
+static const uint32_t rate_period_ms[] = {
+    [SHT3X_RATE_0_5_MPS] = 2000,
+    [SHT3X_RATE_1_MPS] = 1000,
+    [SHT3X_RATE_2_MPS] = 500,
+    [SHT3X_RATE_4_MPS] = 250,
+    [SHT3X_RATE_10_MPS] = 100,
+};
+
+static bool valid_mode(const sht3x_mode_t *mode) {
+    return mode != NULL && mode->acquisition <= SHT3X_ART && mode->repeatability <= SHT3X_REPEATABILITY_LOW && mode->rate <= SHT3X_RATE_10_MPS;
+}
+
+//Command that reads one measurement in the given mode. The clock stretching single shot and Fetch Data read
+//straight away and go out as one combined transfer.
+static const sensirion_cmd_t *measurement_cmd(const sht3x_mode_t *mode) {
+    switch (mode->acquisition) {
+        case SHT3X_SINGLE_SHOT:
+            return &cmd_single_shot[mode->repeatability];
+        case SHT3X_SINGLE_SHOT_STRETCH:
+            return &cmd_single_shot_stretch[mode->repeatability];
+        default:
+            return &cmd_fetch;
+    }
+}
+
+//T = -45 + 175 * raw / 65535 and RH = 100 * raw / 65535, in centi units rounded to nearest without floats
+static void convert_measurement(const uint16_t *words, sht3x_measurement_t *out) {
+    out->temperature_centi = (int16_t)((int32_t)((17500u * words[0] + 32767u) / 65535u) - 4500);
+    out->humidity_centi = (uint16_t)((10000u * words[1] + 32767u) / 65535u);
 }
 
 esp_err_t sht3x_init(i2c_master_dev_handle_t dev) {
-    esp_err_t error = sht3x_send_cmd(dev, SHT3X_CMD_RESET);
-    if(error != ESP_OK) return error;
+    //A reboot of the host doesn't stop a periodic acquisition, and the sensor NACKs a reset until a Break has
+    //stopped it. Fails harmlessly if nothing is running.
+    sensirion_execute(dev, &cmd_break, NULL, NULL);
 
-    //Small delay for sensor to initialise
-    vTaskDelay(pdMS_TO_TICKS(SHT_INIT_WARM_UP_MS));
-    return ESP_OK;
+    //The reset time covers the sensor initialising
+    return sensirion_execute(dev, &cmd_reset, NULL, NULL);
 }
 
-esp_err_t sht3x_measure(i2c_master_dev_handle_t dev, sht3x_measurement_t *out) {
-    //Send measure command, wait for measure to complete (max 12 ms) then read in the measurement
-    uint8_t read_buf[6];
-    esp_err_t error = sht3x_send_cmd(dev, SHT3X_CMD_MEASURE);
-    if(error != ESP_OK) return error;
+esp_err_t sht3x_set_mode(i2c_master_dev_handle_t dev, const sht3x_mode_t *mode) {
+    if (!valid_mode(mode)) {
+        return ESP_ERR_INVALID_ARG;
+    }
 
-    vTaskDelay(pdMS_TO_TICKS(SHT_MEASURE_WAIT_MS));
+    sensirion_execute(dev, &cmd_break, NULL, NULL);
 
-    error = i2c_read_from_device(dev, read_buf, sizeof(read_buf), pdMS_TO_TICKS(SHT_TIMEOUT_MS));
-    if(error != ESP_OK) return error;
+    //The first periodic measurement starts with the command
+    switch (mode->acquisition) {
+        case SHT3X_PERIODIC:
+            return sensirion_execute(dev, &cmd_periodic[mode->rate][mode->repeatability], NULL, NULL);
+        case SHT3X_ART:
+            return sensirion_execute(dev, &cmd_art, NULL, NULL);
+        default:
+            return ESP_OK;
+    }
+}
 
-    //Parse measurement and check crc
+sht3x_rate_t sht3x_rate_for_interval(uint32_t interval_ms) {
+    for (sht3x_rate_t rate = SHT3X_RATE_0_5_MPS; rate < SHT3X_RATE_10_MPS; rate++) {
+        if (rate_period_ms[rate] * 2 <= interval_ms) return rate;
+    }
+    return SHT3X_RATE_10_MPS;
+}
+
+esp_err_t sht3x_parse_measurement(const i2c_txn_t *txn, sht3x_measurement_t *out) {
+    if (out == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint16_t words[2];
+    esp_err_t error = sensirion_decode(txn, words, 2);
+    if(error != ESP_OK) return error;
 
-    uint16_t raw_temp = (read_buf[0] << 8) | read_buf[1];
-    uint16_t raw_humidity = (read_buf[3] << 8) | read_buf[4];
-    uint8_t temperature_crc = read_buf[2];
-    uint8_t humidity_crc = read_buf[5];
+    convert_measurement(words, out);
+    return ESP_OK;
+}
 
-    if(temperature_crc != crc8(&read_buf[0], 2) || humidity_crc != crc8(&read_buf[3], 2)) {
-        return ESP_ERR_INVALID_CRC;
+esp_err_t sht3x_measure(i2c_master_dev_handle_t dev, const sht3x_mode_t *mode, sht3x_measurement_t *out) {
+    if (!valid_mode(mode) || out == NULL) {
+        return ESP_ERR_INVALID_ARG;
     }
 
-    out->temp = (-45.0f + 175.0f * (((float)raw_temp) / 65535.0f));
-    out->humidity = (100.0f * ((float)raw_humidity / 65535.0f));
+    uint16_t words[2];
+    esp_err_t error = sensirion_execute(dev, measurement_cmd(mode), NULL, words);
+    if(error != ESP_OK) return error;
 
+    convert_measurement(words, out);
     return ESP_OK;
 }
+
+esp_err_t sht3x_measure_async(i2c_txn_t *txn, i2c_master_dev_handle_t dev, const sht3x_mode_t *mode, i2c_txn_cb_t cb, void *ctx) {
+    if (!valid_mode(mode)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return sensirion_submit(txn, dev, measurement_cmd(mode), NULL, cb, ctx);
+}
+
+esp_err_t sht3x_set_heater(i2c_master_dev_handle_t dev, bool enable) {
+    return sensirion_execute(dev, enable ? &cmd_heater_on : &cmd_heater_off, NULL, NULL);
+}
+
+esp_err_t sht3x_read_status(i2c_master_dev_handle_t dev, uint16_t *status) {
+    if (status == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return sensirion_execute(dev, &cmd_read_status, NULL, status);
+}
+
+esp_err_t sht3x_clear_status(i2c_master_dev_handle_t dev) {
+    return sensirion_execute(dev, &cmd_clear_status, NULL, NULL);
+}
@@ -0,0 +1,58 @@
+#include "sht3x_sensor.h"
+
+//Worst case conversion, single shot at high repeatability
+#define SHT3X_SENSOR_CONVERSION_US 15500
+//Consecutive failed reads after which the periodic acquisition is restarted
+#define SHT3X_SENSOR_RESTART_FAILURES 3
+
+static esp_err_t sht3x_sensor_init(sensor_node_t *node) {
+    sht3x_sensor_t *sht = node->state;
+
+    esp_err_t err = sht3x_init(node->dev);
+    if (err != ESP_OK) return err;
+
+    sht->mode.rate = sht3x_rate_for_interval(node->period_ms);
+    sht->failures = 0;
+    return sht3x_set_mode(node->dev, &sht->mode);
+}
+
+static esp_err_t sht3x_sensor_start(sensor_node_t *node, i2c_txn_cb_t done) {
+    sht3x_sensor_t *sht = node->state;
+
+    bool periodic = sht->mode.acquisition == SHT3X_PERIODIC || sht->mode.acquisition == SHT3X_ART;
+    sht3x_rate_t rate = sht3x_rate_for_interval(node->period_ms);
+    if (periodic && (sht->failures >= SHT3X_SENSOR_RESTART_FAILURES || sht->mode.rate != rate)) {
+        //Blocks for one conversion, only after the sensor has stopped answering or the node's period changed
+        sht->failures = 0;
+        sht->mode.rate = rate;
+        esp_err_t err = sht3x_set_mode(node->dev, &sht->mode);
+        if (err != ESP_OK) return err;
+    }
+    return sht3x_measure_async(&node->txn, node->dev, &sht->mode, done, node);
+}
+
+static esp_err_t sht3x_sensor_decode(sensor_node_t *node, esp_err_t err, sensor_reading_t *out) {
+    sht3x_sensor_t *sht = node->state;
+    sht3x_measurement_t measurement;
+
+    if (err == ESP_OK) err = sht3x_parse_measurement(&node->txn, &measurement);
+    if (err != ESP_OK) {
+        sht->failures++;
+        return err;
+    }
+    sht->failures = 0;
+
+    out->channels = SENSOR_CHANNEL_BIT(SENSOR_CHANNEL_TEMPERATURE) | SENSOR_CHANNEL_BIT(SENSOR_CHANNEL_HUMIDITY);
+    out->value[SENSOR_CHANNEL_TEMPERATURE] = measurement.temperature_centi;
+    out->value[SENSOR_CHANNEL_HUMIDITY] = measurement.humidity_centi;
+    return ESP_OK;
+}
+
+const sensor_driver_t sht3x_sensor_driver = {
+    .name = "SHT3X",
+    .period_ms = 10000,             //Temperature and humidity change slowly
+    .conversion_us = SHT3X_SENSOR_CONVERSION_US,
+    .init = sht3x_sensor_init,
+    .start = sht3x_sensor_start,
+    .decode = sht3x_sensor_decode,
+};
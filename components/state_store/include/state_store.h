@@ -0,0 +1,174 @@
+/**
+* @file state_store.h
+* @brief Typed persistent state shared by the services, kept in NVS as one versioned blob with a CRC
+*
+* The whole state is held in RAM and written back as a single NVS blob by state_store_commit(). A commit that
+* wouldn't change anything is skipped, so services can commit as often as they like without wearing the flash.
+*
+* There is no wall clock, so ages are measured in operating time: the powered time accumulated over every boot.
+* It is stored with the blob, refreshed at most every CONFIG_STATE_STORE_TIME_RESOLUTION_S on its own, so an
+* age can be under reported by up to that much. Time spent powered off isn't counted.
+*
+* New fields must only be appended to state_store_data_t, bumping STATE_STORE_VERSION. A blob written by an
+* older version then loads with the new fields zeroed. A blob from a newer version is ignored.
+*
+* All functions are thread safe. Flash writes happen outside the lock on the state, so the setters never wait
+* for an erase. state_store_commit_async() hands the write to a low priority worker task so time critical
+* callers don't block at all.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+#define STATE_STORE_VERSION 5
+#define STATE_STORE_SGP30_COUNT 2      /*!< One SGP30 per I2C bus, its address is fixed */
+#define STATE_STORE_DEADBAND_COUNT 4   /*!< Temperature, humidity, eCO2 and TVOC */
+
+/**
+* @brief SGP30 IAQ baseline
+*/
+typedef struct {
+    uint16_t eco2;
+    uint16_t tvoc;
+    uint32_t confirmed_s;           /*!< Operating time the sensor last reported this baseline */
+    uint8_t valid;
+    uint8_t reserved[3];
+} state_store_baseline_t;
+
+/**
+* @brief Settings changed at runtime, each service uses its menuconfig defaults while valid is 0
+*/
+typedef struct {
+    uint32_t sample_period_ms;
+    uint32_t batch_max_age_ms;
+    uint16_t batch_max_samples;
+    uint16_t co2_warning_ppm;
+    uint16_t co2_danger_ppm;
+    uint8_t log_level;
+    uint8_t valid;
+    uint32_t deadband_absolute[STATE_STORE_DEADBAND_COUNT];
+    uint16_t deadband_permille[STATE_STORE_DEADBAND_COUNT];
+    uint32_t heartbeat_s;
+    uint8_t deadband_valid;         /*!< The deadbands and heartbeat were set, firmware built without them leaves 0 */
+    uint8_t reserved[3];
+} state_store_settings_t;
+
+/**
+* @brief The access point the station last connected to
+*/
+typedef struct {
+    uint8_t bssid[6];
+    uint8_t channel;                /*!< Primary channel */
+    uint8_t valid;
+} state_store_wifi_t;
+
+/**
+* @brief Everything that is persisted, append only
+*/
+typedef struct {
+    uint32_t operating_s;           /*!< Operating time when the blob was written */
+    state_store_baseline_t sgp30_baseline;
+    state_store_baseline_t sgp30_baseline_bus2;     /*!< Since version 2 */
+    state_store_settings_t settings;                /*!< Since version 3 */
+    state_store_wifi_t wifi;                        /*!< Since version 4 */
+    uint32_t boot_count;                            /*!< Since version 5 */
+} state_store_data_t;
+
+/**
+* @brief Opens the NVS namespace, loads the stored state, or empty state if there is none, counts the boot and
+*        starts the worker task. The baseline and boot counter stored by earlier firmware as separate keys are
+*        migrated.
+*
+* @return esp_err_t The esp error code
+*/
+esp_err_t state_store_init(void);
+
+/**
+* @brief Returns the operating time, the powered time accumulated over every boot
+*
+* @return uint32_t Operating time in seconds
+*/
+uint32_t state_store_operating_time(void);
+
+/**
+* @brief Returns the number of this boot, counted from 1. Persisted by the next state_store_commit().
+*
+* @return uint32_t Boot count
+*/
+uint32_t state_store_boot_count(void);
+
+/**
+* @brief Reads the stored baseline of an SGP30
+*
+* @param index Which SGP30, the I2C bus it is on, below STATE_STORE_SGP30_COUNT
+* @param eco2 Pointer that receives the eCO2 baseline word
+* @param tvoc Pointer that receives the TVOC baseline word
+* @param age_s Pointer that receives the operating time since the sensor last reported the baseline, may be NULL
+* @return bool True if a baseline is stored
+*/
+bool state_store_get_sgp30_baseline(uint8_t index, uint16_t *eco2, uint16_t *tvoc, uint32_t *age_s);
+
+/**
+* @brief Records the baseline the sensor reported. Persisted by the next state_store_commit() if it changed,
+*        or if it was last confirmed more than CONFIG_STATE_STORE_TIME_RESOLUTION_S ago.
+*
+* @param index Which SGP30, the I2C bus it is on, below STATE_STORE_SGP30_COUNT
+* @param eco2 The eCO2 baseline word
+* @param tvoc The TVOC baseline word
+*/
+void state_store_set_sgp30_baseline(uint8_t index, uint16_t eco2, uint16_t tvoc);
+
+/**
+* @brief Reads the runtime settings
+*
+* @param settings Pointer to a structure that receives the settings
+* @return bool True if settings are stored, otherwise the services keep their defaults
+*/
+bool state_store_get_settings(state_store_settings_t *settings);
+
+/**
+* @brief Replaces the runtime settings and marks them valid. Persisted by the next state_store_commit().
+*
+* @param settings Pointer to the new settings
+*/
+void state_store_set_settings(const state_store_settings_t *settings);
+
+/**
+* @brief Reads the access point the station last connected to
+*
+* @param wifi Pointer to a structure that receives the access point
+* @return bool True if one is stored
+*/
+bool state_store_get_wifi(state_store_wifi_t *wifi);
+
+/**
+* @brief Records the access point the station connected to. Persisted by the next state_store_commit() if it changed.
+*
+* @param bssid The access point's BSSID
+* @param channel Its primary channel
+*/
+void state_store_set_wifi(const uint8_t bssid[6], uint8_t channel);
+
+/**
+* @brief Checks whether the state in RAM differs from the state in flash
+*
+* @return bool True if a commit would write
+*/
+bool state_store_dirty(void);
+
+/**
+* @brief Writes the state to NVS if it changed since the last write, blocking until the write is done
+*
+* @return esp_err_t The esp error code, ESP_OK if nothing needed writing
+*/
+esp_err_t state_store_commit(void);
+
+/**
+* @brief Asks the worker task to run state_store_commit() and returns straight away. Requests made while one
+*        is pending are merged. Failures are logged and counted in the diagnostics.
+*/
+void state_store_commit_async(void);
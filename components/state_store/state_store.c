@@ -0,0 +1,289 @@
+#include "state_store.h"
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "nvs.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include "diagnostics.h"
+
+#define STATE_STORE_NAMESPACE "storage"
+#define STATE_STORE_KEY "state"
+#define STATE_STORE_TIME_RESOLUTION_S CONFIG_STATE_STORE_TIME_RESOLUTION_S
+
+static const char *TAG = "STATE_STORE";
+
+typedef struct {
+    uint16_t version;
+    uint16_t length;                /*!< Size of the data that follows, as written */
+    uint32_t crc;                   /*!< CRC32 of the data that follows */
+} blob_header_t;
+
+typedef struct {
+    blob_header_t header;
+    state_store_data_t data;
+} blob_t;
+
+//lock guards the state and is never held across a flash write, commit_lock serialises the writers
+static SemaphoreHandle_t lock;
+static SemaphoreHandle_t commit_lock;
+static nvs_handle_t nvs_handle;
+static TaskHandle_t worker_handle;
+
+//The state in RAM, and the state as it was last written to flash
+static state_store_data_t state;
+static state_store_data_t written;
+
+//Operating time stored in the blob at boot, the uptime of this boot is added to it
+static uint32_t boot_operating_s;
+
+static inline uint32_t operating_now(void) {
+    return boot_operating_s + (uint32_t)(esp_timer_get_time() / 1000000);
+}
+
+//Loads the blob into state, returns false if there is none or it can't be used
+static bool load_blob(void) {
+    blob_t blob;
+    size_t len = sizeof(blob);
+
+    esp_err_t err = nvs_get_blob(nvs_handle, STATE_STORE_KEY, &blob, &len);
+    if (err == ESP_ERR_NVS_NOT_FOUND) return false;
+    if (err != ESP_OK) {
+        //ESP_ERR_NVS_INVALID_LENGTH means a larger blob from a newer version
+        ESP_LOGW(TAG, "Stored state unreadable: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    if (len < sizeof(blob_header_t) || blob.header.version > STATE_STORE_VERSION ||
+        blob.header.length != len - sizeof(blob_header_t)) {
+        ESP_LOGW(TAG, "Stored state has an unknown layout, version %u", blob.header.version);
+        return false;
+    }
+    if (esp_rom_crc32_le(0, (const uint8_t *)&blob.data, blob.header.length) != blob.header.crc) {
+        ESP_LOGW(TAG, "Stored state failed its CRC check");
+        return false;
+    }
+
+    //Fields added since the blob was written stay zero
+    memcpy(&state, &blob.data, blob.header.length);
+    return true;
+}
+
+static state_store_baseline_t *sgp30_baseline(uint8_t index) {
+    return index == 0 ? &state.sgp30_baseline : &state.sgp30_baseline_bus2;
+}
+
+//Baselines written by earlier firmware as two u16 keys, their age is unknown so they count as new
+static bool load_legacy_baseline(void) {
+    uint16_t eco2, tvoc;
+    if (nvs_get_u16(nvs_handle, "co2_baseline", &eco2) != ESP_OK) return false;
+    if (nvs_get_u16(nvs_handle, "tvoc_baseline", &tvoc) != ESP_OK) return false;
+
+    state.sgp30_baseline = (state_store_baseline_t){ .eco2 = eco2, .tvoc = tvoc, .valid = 1 };
+    return true;
+}
+
+//Boot counter written by earlier firmware as its own key, continued so boot ids already in flash aren't reused
+static bool load_legacy_boot_count(void) {
+    uint32_t boot_count;
+    if (nvs_get_u32(nvs_handle, "boot_count", &boot_count) != ESP_OK) return false;
+
+    if (boot_count > state.boot_count) state.boot_count = boot_count;
+    return true;
+}
+
+static esp_err_t write_blob(const state_store_data_t *data) {
+    blob_t blob = {
+        .header = {
+            .version = STATE_STORE_VERSION,
+            .length = sizeof(state_store_data_t),
+            .crc = esp_rom_crc32_le(0, (const uint8_t *)data, sizeof(state_store_data_t)),
+        },
+        .data = *data,
+    };
+
+    esp_err_t err = nvs_set_blob(nvs_handle, STATE_STORE_KEY, &blob, sizeof(blob));
+    if (err != ESP_OK) return err;
+
+    return nvs_commit(nvs_handle);
+}
+
+//Only the operating time changing doesn't make the state dirty until it has moved on by the resolution
+static bool is_dirty(uint32_t now) {
+    state_store_data_t candidate = state;
+    candidate.operating_s = written.operating_s;
+    return memcmp(&candidate, &written, sizeof(candidate)) != 0 || now - written.operating_s >= STATE_STORE_TIME_RESOLUTION_S;
+}
+
+//Runs the commits requested with state_store_commit_async()
+static void state_store_worker(void *arg) {
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        esp_err_t err = state_store_commit();
+        if (err != ESP_OK) {
+            diagnostics_count(DIAG_STATE_STORE_ERRORS);
+            ESP_LOGE(TAG, "Failed to write state: %s", esp_err_to_name(err));
+        }
+    }
+}
+
+esp_err_t state_store_init(void) {
+    if (lock) return ESP_OK;
+
+    esp_err_t err = nvs_open(STATE_STORE_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK) return err;
+
+    //Earlier firmware kept the baseline and the boot counter as separate keys. The baseline moved into the
+    //first version of the blob, the boot counter only into version 5, so it can sit next to a blob.
+    bool loaded = load_blob();
+    bool migrated = !loaded && load_legacy_baseline();
+    migrated = load_legacy_boot_count() || migrated;
+    if (migrated) {
+        ESP_LOGI(TAG, "Migrating state from separate keys");
+        err = write_blob(&state);
+        if (err != ESP_OK) return err;
+        nvs_erase_key(nvs_handle, "co2_baseline");
+        nvs_erase_key(nvs_handle, "tvoc_baseline");
+        nvs_erase_key(nvs_handle, "boot_count");
+        nvs_commit(nvs_handle);
+    }
+    written = state;
+    boot_operating_s = state.operating_s;
+
+    //Left for the first commit of this boot to persist
+    state.boot_count++;
+
+    commit_lock = xSemaphoreCreateMutex();
+    if (!commit_lock) return ESP_ERR_NO_MEM;
+
+    lock = xSemaphoreCreateMutex();
+    if (!lock) return ESP_ERR_NO_MEM;
+
+    //Below the services so a slow erase only ever delays itself
+    BaseType_t ok = xTaskCreate(state_store_worker, "State Store", 3072, NULL, 2, &worker_handle);
+    if (ok != pdPASS) return ESP_ERR_NO_MEM;
+
+    return diagnostics_register_task(worker_handle);
+}
+
+uint32_t state_store_operating_time(void) {
+    return operating_now();
+}
+
+uint32_t state_store_boot_count(void) {
+    if (!lock) return 0;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    uint32_t boot_count = state.boot_count;
+    xSemaphoreGive(lock);
+    return boot_count;
+}
+
+bool state_store_get_sgp30_baseline(uint8_t index, uint16_t *eco2, uint16_t *tvoc, uint32_t *age_s) {
+    if (!lock || index >= STATE_STORE_SGP30_COUNT || !eco2 || !tvoc) return false;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    state_store_baseline_t baseline = *sgp30_baseline(index);
+    xSemaphoreGive(lock);
+
+    if (!baseline.valid) return false;
+
+    *eco2 = baseline.eco2;
+    *tvoc = baseline.tvoc;
+    if (age_s) *age_s = operating_now() - baseline.confirmed_s;
+    return true;
+}
+
+void state_store_set_sgp30_baseline(uint8_t index, uint16_t eco2, uint16_t tvoc) {
+    if (!lock || index >= STATE_STORE_SGP30_COUNT) return;
+
+    uint32_t now = operating_now();
+    xSemaphoreTake(lock, portMAX_DELAY);
+    state_store_baseline_t *baseline = sgp30_baseline(index);
+    //An unchanged baseline only has its confirmation time refreshed once it is a resolution step old
+    if (!baseline->valid || baseline->eco2 != eco2 || baseline->tvoc != tvoc || now - baseline->confirmed_s >= STATE_STORE_TIME_RESOLUTION_S) {
+        *baseline = (state_store_baseline_t){ .eco2 = eco2, .tvoc = tvoc, .confirmed_s = now, .valid = 1 };
+    }
+    xSemaphoreGive(lock);
+}
+
+bool state_store_get_settings(state_store_settings_t *settings) {
+    if (!lock || !settings) return false;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    *settings = state.settings;
+    xSemaphoreGive(lock);
+    return settings->valid;
+}
+
+void state_store_set_settings(const state_store_settings_t *settings) {
+    if (!lock || !settings) return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    state.settings = *settings;
+    state.settings.valid = 1;
+    xSemaphoreGive(lock);
+}
+
+bool state_store_get_wifi(state_store_wifi_t *wifi) {
+    if (!lock || !wifi) return false;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    *wifi = state.wifi;
+    xSemaphoreGive(lock);
+    return wifi->valid;
+}
+
+void state_store_set_wifi(const uint8_t bssid[6], uint8_t channel) {
+    if (!lock || !bssid) return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    memcpy(state.wifi.bssid, bssid, sizeof(state.wifi.bssid));
+    state.wifi.channel = channel;
+    state.wifi.valid = 1;
+    xSemaphoreGive(lock);
+}
+
+bool state_store_dirty(void) {
+    if (!lock) return false;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    bool dirty = is_dirty(operating_now());
+    xSemaphoreGive(lock);
+    return dirty;
+}
+
+esp_err_t state_store_commit(void) {
+    if (!lock) return ESP_ERR_INVALID_STATE;
+
+    xSemaphoreTake(commit_lock, portMAX_DELAY);
+
+    uint32_t now = operating_now();
+    xSemaphoreTake(lock, portMAX_DELAY);
+    bool dirty = is_dirty(now);
+    if (dirty) state.operating_s = now;
+    state_store_data_t snapshot = state;
+    xSemaphoreGive(lock);
+
+    esp_err_t err = ESP_OK;
+    if (dirty) {
+        err = write_blob(&snapshot);
+        if (err == ESP_OK) {
+            xSemaphoreTake(lock, portMAX_DELAY);
+            written = snapshot;
+            xSemaphoreGive(lock);
+        }
+    }
+
+    xSemaphoreGive(commit_lock);
+    return err;
+}
+
+void state_store_commit_async(void) {
+    if (worker_handle) xTaskNotifyGive(worker_handle);
+}
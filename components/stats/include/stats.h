@@ -0,0 +1,96 @@
+/**
+* @file stats.h
+* @brief Constant memory streaming statistics: min, max, mean, variance and quantile estimates
+*
+* Every sample is folded into the accumulator in O(1) time and nothing is kept per sample. The mean and
+* variance use Welford's update, which stays accurate over long windows where a plain sum of squares would
+* cancel. Quantiles are estimated with the P² algorithm (Jain and Chlamtac), five markers per quantile whose
+* heights are adjusted with a piecewise parabolic fit as samples arrive.
+*
+* Single precision floats are used internally. Samples arrive at 1 Hz at most, so the soft float cost on
+* targets without an FPU is negligible, and results are handed out as integers in the units of the input.
+*
+* The component has no ESP-IDF dependencies so it can be built on a host with plain CMake.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#define STATS_QUANTILE_COUNT 3      /*!< Quantiles estimated per accumulator, see STATS_QUANTILES */
+#define STATS_QUANTILES { 0.1f, 0.5f, 0.9f }
+
+/**
+* @brief P² estimator of one quantile
+*/
+typedef struct {
+    float height[5];                /*!< Marker heights, the first five samples sorted until the estimator is primed */
+    int32_t pos[5];                 /*!< Marker positions, 0 based */
+} stats_p2_t;
+
+/**
+* @brief Streaming accumulator of one channel
+*/
+typedef struct {
+    uint32_t count;
+    float min;
+    float max;
+    float mean;
+    float m2;                       /*!< Sum of squared differences from the mean */
+    stats_p2_t quantile[STATS_QUANTILE_COUNT];
+} stats_acc_t;
+
+/**
+* @brief Accumulator results rounded to the units of the samples, all zero if count is zero
+*/
+typedef struct {
+    uint32_t count;
+    int32_t min;
+    int32_t max;
+    int32_t mean;
+    int32_t stddev;                 /*!< Sample standard deviation, zero for fewer than two samples */
+    int32_t quantile[STATS_QUANTILE_COUNT];
+} stats_summary_t;
+
+/**
+* @brief Empties an accumulator
+*
+* @param acc Pointer to the accumulator
+*/
+void stats_reset(stats_acc_t *acc);
+
+/**
+* @brief Folds one sample into an accumulator
+*
+* @param acc Pointer to the accumulator
+* @param value The sample
+*/
+void stats_add(stats_acc_t *acc, float value);
+
+/**
+* @brief Folds one sample into a standalone P² estimator, for quantiles other than STATS_QUANTILES
+*
+* @param p2 Pointer to the estimator, zeroed before the first sample
+* @param p The quantile to estimate, between 0 and 1
+* @param value The sample
+* @param count Number of samples including this one
+*/
+void stats_quantile_add(stats_p2_t *p2, float p, float value, uint32_t count);
+
+/**
+* @brief Reads the current estimate of a standalone P² estimator
+*
+* @param p2 Pointer to the estimator
+* @param p The quantile it estimates
+* @param count Number of samples added, at least 1
+* @return float The estimate
+*/
+float stats_quantile_estimate(const stats_p2_t *p2, float p, uint32_t count);
+
+/**
+* @brief Reads the current results of an accumulator without changing it
+*
+* @param acc Pointer to the accumulator
+* @param out Pointer to a structure that receives the results
+*/
+void stats_summarise(const stats_acc_t *acc, stats_summary_t *out);
@@ -0,0 +1,124 @@
+#include "stats.h"
+
+#include <math.h>
+#include <string.h>
+
+static const float quantiles[STATS_QUANTILE_COUNT] = STATS_QUANTILES;
+
+static inline int32_t round_to_int(float value) {
+    return (int32_t)lroundf(value);
+}
+
+//The first five samples are kept sorted in the marker heights, they become the initial markers
+static void p2_prime(stats_p2_t *p2, float value, uint32_t count) {
+    uint32_t i = count - 1;
+    while (i > 0 && p2->height[i - 1] > value) {
+        p2->height[i] = p2->height[i - 1];
+        i--;
+    }
+    p2->height[i] = value;
+
+    if (count == 5) {
+        for (int32_t m = 0; m < 5; m++) p2->pos[m] = m;
+    }
+}
+
+static float p2_parabolic(const stats_p2_t *p2, int i, int d) {
+    const float *q = p2->height;
+    const int32_t *n = p2->pos;
+    return q[i] + (float)d / (n[i + 1] - n[i - 1]) *
+        ((n[i] - n[i - 1] + d) * (q[i + 1] - q[i]) / (n[i + 1] - n[i]) +
+         (n[i + 1] - n[i] - d) * (q[i] - q[i - 1]) / (n[i] - n[i - 1]));
+}
+
+static float p2_linear(const stats_p2_t *p2, int i, int d) {
+    return p2->height[i] + d * (p2->height[i + d] - p2->height[i]) / (p2->pos[i + d] - p2->pos[i]);
+}
+
+void stats_quantile_add(stats_p2_t *p2, float p, float value, uint32_t count) {
+    if (count <= 5) {
+        p2_prime(p2, value, count);
+        return;
+    }
+
+    float *q = p2->height;
+    int32_t *n = p2->pos;
+
+    //Find the cell the sample falls in, stretching the end markers if it is a new extreme
+    int k;
+    if (value < q[0]) {
+        q[0] = value;
+        k = 0;
+    }
+    else if (value >= q[4]) {
+        q[4] = value;
+        k = 3;
+    }
+    else {
+        k = 0;
+        while (value >= q[k + 1]) k++;
+    }
+    for (int i = k + 1; i < 5; i++) n[i]++;
+
+    //Move the middle markers one step towards their desired positions if they are off by a whole position
+    const float increment[5] = { 0.0f, p / 2.0f, p, (1.0f + p) / 2.0f, 1.0f };
+    for (int i = 1; i < 4; i++) {
+        float offset = (count - 1) * increment[i] - n[i];
+        if ((offset >= 1.0f && n[i + 1] - n[i] > 1) || (offset <= -1.0f && n[i - 1] - n[i] < -1)) {
+            int d = offset > 0 ? 1 : -1;
+            float height = p2_parabolic(p2, i, d);
+            if (!(q[i - 1] < height && height < q[i + 1])) {
+                height = p2_linear(p2, i, d);
+            }
+            q[i] = height;
+            n[i] += d;
+        }
+    }
+}
+
+float stats_quantile_estimate(const stats_p2_t *p2, float p, uint32_t count) {
+    if (count >= 5) return p2->height[2];
+    //Too few samples for the markers, use the nearest rank of the sorted samples
+    return p2->height[(uint32_t)lroundf(p * (count - 1))];
+}
+
+void stats_reset(stats_acc_t *acc) {
+    memset(acc, 0, sizeof(*acc));
+}
+
+void stats_add(stats_acc_t *acc, float value) {
+    acc->count++;
+
+    if (acc->count == 1 || value < acc->min) acc->min = value;
+    if (acc->count == 1 || value > acc->max) acc->max = value;
+
+    //Welford's update
+    float delta = value - acc->mean;
+    acc->mean += delta / acc->count;
+    acc->m2 += delta * (value - acc->mean);
+
+    for (int i = 0; i < STATS_QUANTILE_COUNT; i++) {
+        stats_quantile_add(&acc->quantile[i], quantiles[i], value, acc->count);
+    }
+}
+
+void stats_summarise(const stats_acc_t *acc, stats_summary_t *out) {
+    memset(out, 0, sizeof(*out));
+    out->count = acc->count;
+    if (acc->count == 0) return;
+
+    out->min = round_to_int(acc->min);
+    out->max = round_to_int(acc->max);
+    out->mean = round_to_int(acc->mean);
+    if (acc->count > 1) {
+        out->stddev = round_to_int(sqrtf(acc->m2 / (acc->count - 1)));
+    }
+
+    for (int i = 0; i < STATS_QUANTILE_COUNT; i++) {
+        float estimate = stats_quantile_estimate(&acc->quantile[i], quantiles[i], acc->count);
+        //The parabolic fit can overshoot slightly on tiny windows, keep the estimate inside the observed range
+        if (estimate < acc->min) estimate = acc->min;
+        if (estimate > acc->max) estimate = acc->max;
+        out->quantile[i] = round_to_int(estimate);
+    }
+}
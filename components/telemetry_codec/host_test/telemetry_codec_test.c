@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "telemetry_codec.h"
+
+#define MAX_SAMPLES 16
+#define RANDOM_ROUNDS 10000
+
+static int failures = 0;
+
+static void fail(const char *what, long value) {
+    if (failures++ < 10) printf("FAIL: %s %ld\n", what, value);
+}
+
+static bool same_sample(const telemetry_sample_t *a, const telemetry_sample_t *b) {
+    return a->seq == b->seq && a->timestamp_ms == b->timestamp_ms && a->temperature_centi == b->temperature_centi &&
+            a->humidity_centi == b->humidity_centi && a->eco2 == b->eco2 && a->tvoc == b->tvoc && a->probe == b->probe;
+}
+
+//Encodes the samples into a buffer of exactly TELEMETRY_FRAME_SIZE(count), decodes the frame again and checks
+//the header and every sample came back unchanged. Every shorter prefix of the frame must be rejected.
+//Returns the frame length.
+static int round_trip(const char *what, uint16_t boot_id, uint32_t uptime_ms, const telemetry_sample_t *samples, size_t count) {
+    uint8_t frame[TELEMETRY_FRAME_SIZE(MAX_SAMPLES)];
+    telemetry_sample_t decoded[MAX_SAMPLES];
+    telemetry_header_t header;
+
+    int len = telemetry_encode(frame, TELEMETRY_FRAME_SIZE(count), boot_id, uptime_ms, samples, count);
+    if (len < 0) {
+        fail(what, len);
+        return len;
+    }
+
+    int decoded_count = telemetry_decode(frame, len, &header, decoded, MAX_SAMPLES);
+    if (decoded_count != (int)count) {
+        fail(what, decoded_count);
+        return len;
+    }
+    if (header.version != TELEMETRY_SCHEMA_VERSION || header.flags != 0 || header.count != count) fail(what, header.version);
+    if (header.boot_id != boot_id) fail(what, header.boot_id);
+    if (header.uptime_ms != uptime_ms) fail(what, header.uptime_ms);
+    for (size_t i = 0; i < count; i++) {
+        if (!same_sample(&samples[i], &decoded[i])) fail(what, (long)i);
+    }
+
+    for (int cut = 0; cut < len; cut++) {
+        if (telemetry_decode(frame, cut, NULL, decoded, MAX_SAMPLES) >= 0) fail("truncated frame accepted", cut);
+    }
+    return len;
+}
+
+//A lone sample is written in full: 2+3+2+2+2+1+1 bytes of fields after a 7 byte header
+static void check_first_sample(void) {
+    const telemetry_sample_t sample = {
+        .seq = 1234, .timestamp_ms = 56789, .temperature_centi = -1234, .humidity_centi = 4567, .eco2 = 400, .tvoc = 0, .probe = 2,
+    };
+
+    int len = round_trip("first sample", 7, 60000, &sample, 1);
+    if (len != 20) fail("first sample length", len);
+}
+
+//Every field falling, including the sequence number and timestamp as when older samples are replayed
+static void check_negative_deltas(void) {
+    const telemetry_sample_t samples[] = {
+        { .seq = 100, .timestamp_ms = 90000, .temperature_centi = 2500, .humidity_centi = 6000, .eco2 = 2000, .tvoc = 600, .probe = 0 },
+        { .seq = 99, .timestamp_ms = 89000, .temperature_centi = 120, .humidity_centi = 5999, .eco2 = 1500, .tvoc = 300, .probe = 0 },
+        { .seq = 50, .timestamp_ms = 1000, .temperature_centi = -500, .humidity_centi = 100, .eco2 = 400, .tvoc = 0, .probe = 0 },
+        { .seq = 51, .timestamp_ms = 2000, .temperature_centi = -4500, .humidity_centi = 0, .eco2 = 400, .tvoc = 0, .probe = 0 },
+    };
+
+    round_trip("negative deltas", 3, 90500, samples, sizeof(samples) / sizeof(samples[0]));
+}
+
+//The header's size claim for a steady batch
+static void check_steady_batch(void) {
+    telemetry_sample_t samples[10];
+
+    for (int i = 0; i < 10; i++) {
+        samples[i] = (telemetry_sample_t){
+            .seq = 5000 + i, .timestamp_ms = 3600000 + i * 1000, .temperature_centi = 2150 + i % 3, .humidity_centi = 4520 - i,
+            .eco2 = 450 + i, .tvoc = 20, .probe = i % 2,
+        };
+    }
+
+    int len = round_trip("steady batch", 12, 3610000, samples, 10);
+    if (len >= 100) fail("steady batch length", len);
+}
+
+//Values that need the longest varints: 5 bytes for the full and delta sequence numbers, timestamps and
+//uptime, 3 bytes for the 16 bit fields and the boot id, 2 for the probe
+static void check_max_width(void) {
+    const telemetry_sample_t samples[] = {
+        { .seq = 0xFFFFFFFF, .timestamp_ms = 0xFFFFFFFF, .temperature_centi = INT16_MIN, .humidity_centi = 0xFFFF, .eco2 = 0xFFFF, .tvoc = 0xFFFF, .probe = 255 },
+        //A difference of 0x80000000 is INT32_MIN, which zigzags to 0xFFFFFFFF
+        { .seq = 0x7FFFFFFF, .timestamp_ms = 0x7FFFFFFF, .temperature_centi = INT16_MAX, .humidity_centi = 0, .eco2 = 0, .tvoc = 0, .probe = 0 },
+        { .seq = 0xFFFFFFFF, .timestamp_ms = 0, .temperature_centi = INT16_MIN, .humidity_centi = 0xFFFF, .eco2 = 0xFFFF, .tvoc = 0xFFFF, .probe = 255 },
+    };
+    size_t count = sizeof(samples) / sizeof(samples[0]);
+    uint8_t frame[TELEMETRY_FRAME_SIZE(MAX_SAMPLES)];
+    telemetry_sample_t decoded[MAX_SAMPLES];
+
+    int len = round_trip("max width", 0xFFFF, 0xFFFFFFFF, samples, count);
+    //Header 1+1+1+3+5, then 5+5+3+3+3+3 for every sample plus a probe id of 2, 1 and 2 bytes
+    if (len != 11 + 24 + 23 + 24) fail("max width length", len);
+
+    if (telemetry_encode(frame, sizeof(frame), 0xFFFF, 0xFFFFFFFF, samples, count) != len) fail("max width encode", len);
+    if (telemetry_encode(frame, len - 1, 0xFFFF, 0xFFFFFFFF, samples, count) != TELEMETRY_ERR_NO_SPACE) fail("short buffer accepted", len - 1);
+    if (telemetry_decode(frame, len, NULL, decoded, count - 1) != TELEMETRY_ERR_TOO_MANY) fail("too many samples accepted", (long)count);
+}
+
+//Probe ids and boot ids on both sides of the one byte varint limit, and frames from before each field existed
+static void check_probe_and_boot_id(void) {
+    const uint16_t boot_ids[] = { 0, 1, 127, 128, 0x3FFF, 0x4000, 0xFFFF };
+    const uint8_t probes[] = { 0, 1, 127, 128, 255 };
+    telemetry_sample_t samples[sizeof(probes)];
+
+    for (size_t b = 0; b < sizeof(boot_ids) / sizeof(boot_ids[0]); b++) {
+        for (size_t i = 0; i < sizeof(probes); i++) {
+            samples[i] = (telemetry_sample_t){ .seq = 10 + i, .timestamp_ms = 10000, .temperature_centi = 2000, .humidity_centi = 5000, .eco2 = 400, .probe = probes[i] };
+        }
+        round_trip("probe and boot id", boot_ids[b], 20000, samples, sizeof(probes));
+    }
+
+    //Version 2 has a boot id but no probe id, version 1 has neither
+    const uint8_t version_2[] = { 2, 0, 1, 5, 10, 1, 2, 4, 6, 8, 10 };
+    const uint8_t version_1[] = { 1, 0, 1, 10, 1, 2, 4, 6, 8, 10 };
+    telemetry_header_t header;
+
+    if (telemetry_decode(version_2, sizeof(version_2), &header, samples, 1) != 1 || header.boot_id != 5 || samples[0].probe != 0 ||
+            samples[0].temperature_centi != 2 || samples[0].tvoc != 5) {
+        fail("version 2 frame", header.boot_id);
+    }
+    if (telemetry_decode(version_1, sizeof(version_1), &header, samples, 1) != 1 || header.boot_id != 0 || header.uptime_ms != 10 ||
+            samples[0].probe != 0 || samples[0].seq != 1) {
+        fail("version 1 frame", header.uptime_ms);
+    }
+}
+
+//Random batches of every size, with deltas of any magnitude and sign
+static void check_random(void) {
+    telemetry_sample_t samples[MAX_SAMPLES];
+    uint32_t seed = 1;
+
+    for (unsigned round = 0; round < RANDOM_ROUNDS; round++) {
+        size_t count = round % (MAX_SAMPLES + 1);
+        uint32_t words[8] = { 0 };
+
+        for (size_t i = 0; i < count; i++) {
+            for (int w = 0; w < 8; w++) {
+                seed = seed * 1103515245u + 12345u;
+                words[w] = (seed >> 16) | (seed << 16);
+            }
+            //Odd rounds keep the values small so the short varints get exercised too
+            uint32_t mask = (round & 1) ? 0xFF : 0xFFFFFFFF;
+            samples[i] = (telemetry_sample_t){
+                .seq = words[0] & mask, .timestamp_ms = words[1] & mask, .temperature_centi = (int16_t)(words[2] & mask),
+                .humidity_centi = (uint16_t)(words[3] & mask), .eco2 = (uint16_t)(words[4] & mask), .tvoc = (uint16_t)(words[5] & mask),
+                .probe = (uint8_t)words[6],
+            };
+        }
+        round_trip("random batch", (uint16_t)words[7], seed, samples, count);
+    }
+}
+
+int main(void) {
+    check_first_sample();
+    check_negative_deltas();
+    check_steady_batch();
+    check_max_width();
+    check_probe_and_boot_id();
+    check_random();
+
+    if (failures) {
+        printf("%d failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("telemetry_codec: every frame decoded to the samples encoded\n");
+    return EXIT_SUCCESS;
+}
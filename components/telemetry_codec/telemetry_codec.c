@@ -0,0 +1,161 @@
+#include "telemetry_codec.h"
+
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+} writer_t;
+
+typedef struct {
+    const uint8_t *buf;
+    size_t len;
+    size_t pos;
+} reader_t;
+
+static inline uint32_t zigzag_encode(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static inline int32_t zigzag_decode(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+static int put_byte(writer_t *w, uint8_t byte) {
+    if (w->len >= w->size) return TELEMETRY_ERR_NO_SPACE;
+    w->buf[w->len++] = byte;
+    return TELEMETRY_OK;
+}
+
+static int put_varint(writer_t *w, uint32_t value) {
+    while (value >= 0x80) {
+        if (put_byte(w, (uint8_t)(value | 0x80)) != TELEMETRY_OK) return TELEMETRY_ERR_NO_SPACE;
+        value >>= 7;
+    }
+    return put_byte(w, (uint8_t)value);
+}
+
+static int get_varint(reader_t *r, uint32_t *value) {
+    uint32_t result = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (r->pos >= r->len) return TELEMETRY_ERR_TRUNCATED;
+        uint8_t byte = r->buf[r->pos++];
+        result |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return TELEMETRY_OK;
+        }
+    }
+    return TELEMETRY_ERR_TRUNCATED;
+}
+
+//Writes every field as the difference from the previous sample, or in full for the first sample
+static int put_sample(writer_t *w, const telemetry_sample_t *s, const telemetry_sample_t *prev) {
+    uint32_t fields[6];
+
+    if (prev) {
+        fields[0] = zigzag_encode((int32_t)(s->seq - prev->seq));
+        fields[1] = zigzag_encode((int32_t)(s->timestamp_ms - prev->timestamp_ms));
+        fields[2] = zigzag_encode(s->temperature_centi - prev->temperature_centi);
+        fields[3] = zigzag_encode(s->humidity_centi - prev->humidity_centi);
+        fields[4] = zigzag_encode(s->eco2 - prev->eco2);
+        fields[5] = zigzag_encode(s->tvoc - prev->tvoc);
+    }
+    else {
+        //Sequence number and timestamp can't be negative on their own so they go out unsigned
+        fields[0] = s->seq;
+        fields[1] = s->timestamp_ms;
+        fields[2] = zigzag_encode(s->temperature_centi);
+        fields[3] = zigzag_encode(s->humidity_centi);
+        fields[4] = zigzag_encode(s->eco2);
+        fields[5] = zigzag_encode(s->tvoc);
+    }
+
+    for (int i = 0; i < 6; i++) {
+        if (put_varint(w, fields[i]) != TELEMETRY_OK) return TELEMETRY_ERR_NO_SPACE;
+    }
+    return put_varint(w, s->probe);
+}
+
+static int get_sample(reader_t *r, uint8_t version, telemetry_sample_t *s, const telemetry_sample_t *prev) {
+    uint32_t fields[6];
+    for (int i = 0; i < 6; i++) {
+        int err = get_varint(r, &fields[i]);
+        if (err != TELEMETRY_OK) return err;
+    }
+
+    //Frames before version 3 have no probe id, they only ever had one
+    uint32_t probe = 0;
+    if (version >= 3) {
+        int err = get_varint(r, &probe);
+        if (err != TELEMETRY_OK) return err;
+    }
+    s->probe = (uint8_t)probe;
+
+    if (prev) {
+        s->seq = prev->seq + (uint32_t)zigzag_decode(fields[0]);
+        s->timestamp_ms = prev->timestamp_ms + (uint32_t)zigzag_decode(fields[1]);
+    }
+    else {
+        s->seq = fields[0];
+        s->timestamp_ms = fields[1];
+    }
+    s->temperature_centi = (int16_t)((prev ? prev->temperature_centi : 0) + zigzag_decode(fields[2]));
+    s->humidity_centi = (uint16_t)((prev ? prev->humidity_centi : 0) + zigzag_decode(fields[3]));
+    s->eco2 = (uint16_t)((prev ? prev->eco2 : 0) + zigzag_decode(fields[4]));
+    s->tvoc = (uint16_t)((prev ? prev->tvoc : 0) + zigzag_decode(fields[5]));
+    return TELEMETRY_OK;
+}
+
+int telemetry_encode(uint8_t *buf, size_t size, uint16_t boot_id, uint32_t uptime_ms, const telemetry_sample_t *samples, size_t count) {
+    if (!buf || (!samples && count > 0)) return TELEMETRY_ERR_INVALID_ARG;
+
+    writer_t w = { .buf = buf, .size = size, .len = 0 };
+
+    if (put_byte(&w, TELEMETRY_SCHEMA_VERSION) != TELEMETRY_OK) return TELEMETRY_ERR_NO_SPACE;
+    if (put_byte(&w, 0) != TELEMETRY_OK) return TELEMETRY_ERR_NO_SPACE;
+    if (put_varint(&w, (uint32_t)count) != TELEMETRY_OK) return TELEMETRY_ERR_NO_SPACE;
+    if (put_varint(&w, boot_id) != TELEMETRY_OK) return TELEMETRY_ERR_NO_SPACE;
+    if (put_varint(&w, uptime_ms) != TELEMETRY_OK) return TELEMETRY_ERR_NO_SPACE;
+
+    for (size_t i = 0; i < count; i++) {
+        if (put_sample(&w, &samples[i], i > 0 ? &samples[i - 1] : NULL) != TELEMETRY_OK) {
+            return TELEMETRY_ERR_NO_SPACE;
+        }
+    }
+    return (int)w.len;
+}
+
+int telemetry_decode(const uint8_t *buf, size_t len, telemetry_header_t *header, telemetry_sample_t *samples, size_t max_count) {
+    if (!buf || (!samples && max_count > 0)) return TELEMETRY_ERR_INVALID_ARG;
+
+    reader_t r = { .buf = buf, .len = len, .pos = 0 };
+    telemetry_header_t hdr;
+
+    if (len < 2) return TELEMETRY_ERR_TRUNCATED;
+    hdr.version = buf[r.pos++];
+    hdr.flags = buf[r.pos++];
+    if (hdr.version == 0 || hdr.version > TELEMETRY_SCHEMA_VERSION) return TELEMETRY_ERR_VERSION;
+
+    int err = get_varint(&r, &hdr.count);
+    if (err != TELEMETRY_OK) return err;
+
+    //Version 1 frames have no boot id
+    uint32_t boot_id = 0;
+    if (hdr.version >= 2) {
+        err = get_varint(&r, &boot_id);
+        if (err != TELEMETRY_OK) return err;
+    }
+    hdr.boot_id = (uint16_t)boot_id;
+
+    err = get_varint(&r, &hdr.uptime_ms);
+    if (err != TELEMETRY_OK) return err;
+
+    if (header) *header = hdr;
+    if (hdr.count > max_count) return TELEMETRY_ERR_TOO_MANY;
+
+    for (uint32_t i = 0; i < hdr.count; i++) {
+        err = get_sample(&r, hdr.version, &samples[i], i > 0 ? &samples[i - 1] : NULL);
+        if (err != TELEMETRY_OK) return err;
+    }
+    return (int)hdr.count;
+}
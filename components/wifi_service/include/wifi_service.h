@@ -9,12 +9,29 @@
 #include "esp_err.h"
 #include <stdbool.h>
 
+#include <stdint.h>
+
+/**
+* @brief Called from the default event loop task each time the station obtains an IP address. Must not block.
+*/
+typedef void (*wifi_connected_cb_t)(void);
+
 /**
-* @brief Initialises the wifi event handler, configures the device as a station and waits for a connection to be established
+* @brief Initialises the wifi event handler, configures the device as a station and starts connecting to the
+*        access point. Returns without waiting for the connection, so the rest of the system can start meanwhile.
 *
+* @param on_connected Called every time an IP address is obtained, may be NULL
 * @return esp_err_t The esp error code
 */
-esp_err_t wifi_service_start(void);
+esp_err_t wifi_service_start(wifi_connected_cb_t on_connected);
+
+/**
+* @brief Waits for the station to have an IP address
+*
+* @param timeout_ms Maximum time to wait in milliseconds
+* @return esp_err_t ESP_OK once connected, ESP_ERR_TIMEOUT otherwise
+*/
+esp_err_t wifi_service_wait_connected(uint32_t timeout_ms);
 
 
 /**
@@ -1,48 +1,207 @@
 #include "wifi_service.h"
 
+#include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_netif.h"
+#include "esp_timer.h"
+#include "esp_random.h"
 #include "esp_log.h"
 #include "esp_err.h"
 
+#include "diagnostics.h"
+#include "state_store.h"
+
 #define WIFI_CONNECTED_BIT BIT0
+#define WIFI_BACKOFF_INITIAL_MS CONFIG_WIFI_BACKOFF_INITIAL_MS
+#define WIFI_BACKOFF_MAX_MS CONFIG_WIFI_BACKOFF_MAX_MS
 
 static const char *TAG = "wifi_service";
 
 static EventGroupHandle_t wifi_event_group;
+static esp_netif_t *sta_netif;
+static esp_timer_handle_t reconnect_timer;
 static bool connected = false;
+static wifi_connected_cb_t connected_cb;
+
+//Connection state, only touched from the default event loop and the reconnect timer, which never run at once
+//for the same attempt: the timer is only armed after a failed attempt has been reported
+static bool associated = false;
+static uint32_t failures = 0;
+static bool pinned = false;
+static int64_t connect_start_us;
+static uint32_t connect_max_ms = 0;
+static state_store_wifi_t last_ap;
+
+//Attempts alternate between the last access point on its own channel and a full scan, starting with the last
+//access point. A single channel attempt takes a fraction of a scan and usually finds an access point that has
+//rebooted, the full scan finds one that came back on another channel or a different access point of the network.
+static bool use_last_ap(void) {
+#if CONFIG_WIFI_FAST_CONNECT
+    return last_ap.valid && failures % 2 == 0;
+#else
+    return false;
+#endif
+}
+
+static void configure_attempt(bool use_pinned) {
+    if (use_pinned == pinned) return;
+
+    wifi_config_t wifi_config;
+    if (esp_wifi_get_config(WIFI_IF_STA, &wifi_config) != ESP_OK) return;
+
+    wifi_config.sta.bssid_set = use_pinned;
+    if (use_pinned) {
+        memcpy(wifi_config.sta.bssid, last_ap.bssid, sizeof(wifi_config.sta.bssid));
+        wifi_config.sta.channel = last_ap.channel;
+        wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+    }
+    else {
+        wifi_config.sta.channel = 0;
+        wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    }
+
+    if (esp_wifi_set_config(WIFI_IF_STA, &wifi_config) == ESP_OK) pinned = use_pinned;
+}
+
+static void connect_attempt(void) {
+    configure_attempt(use_last_ap());
+
+    esp_err_t err = esp_wifi_connect();
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Connect attempt failed to start: %s", esp_err_to_name(err));
+    }
+}
+
+static void reconnect_timer_expired(void *arg) {
+    connect_attempt();
+}
+
+//Exponential backoff with equal jitter: the delay doubles with every failure up to the maximum, and a random
+//part of up to half of it keeps devices that lost the same access point from retrying in lockstep. The first
+//attempt after losing the connection goes straight away.
+static void schedule_attempt(void) {
+    if (failures == 0) {
+        connect_attempt();
+        return;
+    }
+
+    uint32_t shift = failures - 1 < 16 ? failures - 1 : 16;
+    uint32_t delay_ms = WIFI_BACKOFF_INITIAL_MS << shift;
+    if (delay_ms > WIFI_BACKOFF_MAX_MS) delay_ms = WIFI_BACKOFF_MAX_MS;
+    delay_ms = delay_ms / 2 + esp_random() % (delay_ms / 2 + 1);
+
+    ESP_LOGI(TAG, "Retrying in %lu ms", (unsigned long)delay_ms);
+    esp_timer_stop(reconnect_timer);
+    esp_timer_start_once(reconnect_timer, (uint64_t)delay_ms * 1000);
+}
+
+#if CONFIG_WIFI_STATIC_IP_ENABLE
+//Skips DHCP altogether, the address is set as soon as the station has associated
+static void set_static_ip(void) {
+    esp_err_t err = esp_netif_dhcpc_stop(sta_netif);
+    if (err != ESP_OK && err != ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED) {
+        ESP_LOGE(TAG, "Failed to stop DHCP client: %s", esp_err_to_name(err));
+        return;
+    }
+
+    esp_netif_ip_info_t ip_info = {
+        .ip.addr = esp_ip4addr_aton(CONFIG_WIFI_STATIC_IP),
+        .netmask.addr = esp_ip4addr_aton(CONFIG_WIFI_STATIC_NETMASK),
+        .gw.addr = esp_ip4addr_aton(CONFIG_WIFI_STATIC_GATEWAY),
+    };
+    err = esp_netif_set_ip_info(sta_netif, &ip_info);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to set static IP: %s", esp_err_to_name(err));
+        return;
+    }
+
+    esp_netif_dns_info_t dns = {
+        .ip.u_addr.ip4.addr = esp_ip4addr_aton(CONFIG_WIFI_STATIC_DNS),
+        .ip.type = ESP_IPADDR_TYPE_V4,
+    };
+    err = esp_netif_set_dns_info(sta_netif, ESP_NETIF_DNS_MAIN, &dns);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to set DNS server: %s", esp_err_to_name(err));
+    }
+}
+#endif
 
 static void wifi_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
     if (event_base == WIFI_EVENT) {
         switch (event_id) {
             case WIFI_EVENT_STA_START:
-                ESP_LOGI(TAG, "Wi-Fi started, connecting...");
-                esp_wifi_connect();
+                ESP_LOGI(TAG, "Wi-Fi started, connecting%s...", use_last_ap() ? " to the last access point" : "");
+                connect_attempt();
                 break;
 
+            case WIFI_EVENT_STA_CONNECTED: {
+                wifi_event_sta_connected_t *event = (wifi_event_sta_connected_t *)event_data;
+                ESP_LOGI(TAG, "Associated on channel %u", event->channel);
+                associated = true;
+                failures = 0;
+
+                //Skipped by the store if it is the same access point as last time, so reconnects cost no flash writes
+                memcpy(last_ap.bssid, event->bssid, sizeof(last_ap.bssid));
+                last_ap.channel = event->channel;
+                last_ap.valid = 1;
+                state_store_set_wifi(event->bssid, event->channel);
+                state_store_commit_async();
+#if CONFIG_WIFI_STATIC_IP_ENABLE
+                set_static_ip();
+#endif
+                break;
+            }
+
             case WIFI_EVENT_STA_DISCONNECTED:
-                ESP_LOGW(TAG, "Wi-Fi disconnected, retrying...");
                 connected = false;
-                esp_wifi_connect();
+                xEventGroupClearBits(wifi_event_group, WIFI_CONNECTED_BIT);
+                if (associated) {
+                    //The connection time is measured from here, it is the gap in the data
+                    ESP_LOGW(TAG, "Wi-Fi disconnected, reconnecting...");
+                    associated = false;
+                    connect_start_us = esp_timer_get_time();
+                    diagnostics_count(DIAG_WIFI_DISCONNECTS);
+                }
+                else {
+                    failures++;
+                    ESP_LOGW(TAG, "Connect attempt %lu failed", (unsigned long)failures);
+                }
+                schedule_attempt();
                 break;
 
             default:
                 break;
         }
-    } 
+    }
     else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
-        ESP_LOGI(TAG, "Got IP: " IPSTR, IP2STR(&event->ip_info.ip));
+        uint32_t connect_ms = (uint32_t)((esp_timer_get_time() - connect_start_us) / 1000);
+        ESP_LOGI(TAG, "Got IP: " IPSTR " after %lu ms", IP2STR(&event->ip_info.ip), (unsigned long)connect_ms);
+
+        if (connect_ms > connect_max_ms) connect_max_ms = connect_ms;
+        diagnostics_set_gauge(DIAG_WIFI_CONNECT_MS, connect_ms);
+        diagnostics_set_gauge(DIAG_WIFI_CONNECT_MAX_MS, connect_max_ms);
 
         connected = true;
         xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
+        if (connected_cb) connected_cb();
     }
 }
 
-esp_err_t wifi_service_start(void) {
-    esp_err_t err = esp_netif_init();
+esp_err_t wifi_service_start(wifi_connected_cb_t on_connected) {
+    connected_cb = on_connected;
+    connect_start_us = esp_timer_get_time();
+
+    //Holds the access point cached by the last boot, already initialised by the sensor service
+    esp_err_t err = state_store_init();
+    if(err != ESP_OK) return err;
+    if (state_store_get_wifi(&last_ap)) {
+        ESP_LOGI(TAG, "Last access point on channel %u", last_ap.channel);
+    }
+
+    err = esp_netif_init();
     if(err != ESP_OK) return err;
 
     err = esp_event_loop_create_default();
@@ -53,7 +212,15 @@ esp_err_t wifi_service_start(void) {
         return ESP_ERR_NO_MEM;
     }
 
-    esp_netif_create_default_wifi_sta();
+    esp_timer_create_args_t timer_args = {
+        .callback = reconnect_timer_expired,
+        .name = "wifi_reconnect",
+    };
+    err = esp_timer_create(&timer_args, &reconnect_timer);
+    if(err != ESP_OK) return err;
+
+    sta_netif = esp_netif_create_default_wifi_sta();
+    if (!sta_netif) return ESP_ERR_NO_MEM;
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     err = esp_wifi_init(&cfg);
@@ -79,6 +246,7 @@ esp_err_t wifi_service_start(void) {
         .sta = {
             .ssid = CONFIG_WIFI_SSID,
             .password = CONFIG_WIFI_PASSWORD,
+            .scan_method = WIFI_ALL_CHANNEL_SCAN,
             .threshold.authmode = WIFI_AUTH_WPA2_PSK,
         },
     };
@@ -86,26 +254,31 @@ esp_err_t wifi_service_start(void) {
     err = esp_wifi_set_mode(WIFI_MODE_STA);
     if(err != ESP_OK) return err;
 
-    esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+    err = esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
     if(err != ESP_OK) return err;
 
     err = esp_wifi_start();
     if(err != ESP_OK) return err;
 
-    ESP_LOGI(TAG, "Waiting for Wi-Fi connection...");
+    //The connection comes up in the background, on_connected is called once it has an IP address
+    ESP_LOGI(TAG, "Connecting to Wi-Fi...");
     ESP_LOGI(TAG, "SSID: %s Password: %s", wifi_config.sta.ssid, wifi_config.sta.password);
 
-    xEventGroupWaitBits(
+    return ESP_OK;
+}
+
+esp_err_t wifi_service_wait_connected(uint32_t timeout_ms) {
+    if (!wifi_event_group) return ESP_ERR_INVALID_STATE;
+
+    EventBits_t bits = xEventGroupWaitBits(
         wifi_event_group,
         WIFI_CONNECTED_BIT,
         pdFALSE,
         pdTRUE,
-        portMAX_DELAY
+        pdMS_TO_TICKS(timeout_ms)
     );
 
-    ESP_LOGI(TAG, "Wi-Fi connected");
-
-    return ESP_OK;
+    return (bits & WIFI_CONNECTED_BIT) ? ESP_OK : ESP_ERR_TIMEOUT;
 }
 
 bool wifi_is_connected() {
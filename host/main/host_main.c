@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <math.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs_flash.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "sensor_service.h"
+#include "sensor_ring.h"
+#include "i2c_controller.h"
+#if CONFIG_RUNTIME_EVENT_LOOP
+#include "runtime.h"
+#endif
+
+#define HOST_READ_BATCH 8
+#define TEMPERATURE_TOLERANCE_CENTI 1
+#define HUMIDITY_TOLERANCE_CENTI 1
+
+static const char *TAG = "HOST_SIM";
+
+typedef struct {
+    uint32_t samples;
+    uint32_t checked;           //Samples compared with the simulated values
+    uint32_t faulted;           //Samples taken while a fault was injected, not compared
+    uint32_t mismatched;
+    uint32_t gaps;              //Samples missing from the sequence
+    uint32_t max_latency_ms;    //Time from taking a sample to this task reading it
+} host_results_t;
+
+static esp_err_t init_nvs(void);
+
+static void configure_simulation(void) {
+    //Slow enough that a sample never straddles a large change, with one fast square wave to exercise the LEDs
+    i2c_sim_set_waveform(I2C_SIM_TEMPERATURE, &(i2c_sim_waveform_t){ .type = I2C_SIM_WAVE_SINE, .offset = 21.0f, .amplitude = 4.0f, .period_ms = 600000 });
+    i2c_sim_set_waveform(I2C_SIM_HUMIDITY, &(i2c_sim_waveform_t){ .type = I2C_SIM_WAVE_RAMP, .offset = 50.0f, .amplitude = 30.0f, .period_ms = 900000 });
+    i2c_sim_set_waveform(I2C_SIM_ECO2, &(i2c_sim_waveform_t){ .type = I2C_SIM_WAVE_SQUARE, .offset = 1000.0f, .amplitude = 500.0f, .period_ms = 120000 });
+    i2c_sim_set_waveform(I2C_SIM_TVOC, &(i2c_sim_waveform_t){ .type = I2C_SIM_WAVE_SINE, .offset = 200.0f, .amplitude = 150.0f, .period_ms = 300000 });
+
+    i2c_sim_set_faults(I2C_SIM_SHT3X_ADDR, &(i2c_sim_faults_t){
+        .nack_every = CONFIG_HOST_SIM_SHT3X_NACK_EVERY,
+        .crc_error_every = CONFIG_HOST_SIM_SHT3X_CRC_ERROR_EVERY,
+    });
+    i2c_sim_set_faults(I2C_SIM_SGP30_ADDR, &(i2c_sim_faults_t){
+        .nack_every = CONFIG_HOST_SIM_SGP30_NACK_EVERY,
+        .crc_error_every = CONFIG_HOST_SIM_SGP30_CRC_ERROR_EVERY,
+    });
+}
+
+//Faults seen on both devices so far, a sample taken across a fault isn't compared
+static uint32_t fault_count(void) {
+    i2c_sim_stats_t sht;
+    i2c_sim_stats_t sgp;
+    i2c_sim_get_stats(I2C_SIM_SHT3X_ADDR, &sht);
+    i2c_sim_get_stats(I2C_SIM_SGP30_ADDR, &sgp);
+    return sht.nacks + sht.crc_errors + sgp.nacks + sgp.crc_errors;
+}
+
+//Compares a sample with the values the simulated devices last returned. The service holds a sample back until
+//both sensors have a reading, so the SGP30's fixed warm up values never show up here.
+static bool sample_matches(const sensor_data_t *data) {
+    i2c_sim_stats_t sht;
+    i2c_sim_stats_t sgp;
+    i2c_sim_get_stats(I2C_SIM_SHT3X_ADDR, &sht);
+    i2c_sim_get_stats(I2C_SIM_SGP30_ADDR, &sgp);
+
+    bool match = abs(data->temperature_centi - (int)lroundf(sht.last_value[0] * 100.0f)) <= TEMPERATURE_TOLERANCE_CENTI &&
+                 abs(data->humidity_centi - (int)lroundf(sht.last_value[1] * 100.0f)) <= HUMIDITY_TOLERANCE_CENTI &&
+                 data->eco2 == (uint32_t)sgp.last_value[0] &&
+                 data->tvoc == (uint32_t)sgp.last_value[1];
+
+    if (!match) {
+        ESP_LOGE(TAG, "Sample %lu doesn't match the simulation: %.2f degC %.2f %%RH %.0f ppm %.0f ppb",
+                (unsigned long)data->seq, sht.last_value[0], sht.last_value[1], sgp.last_value[0], sgp.last_value[1]);
+    }
+    return match;
+}
+
+void app_main(void)
+{
+    host_results_t results = {0};
+
+    ESP_ERROR_CHECK(init_nvs());
+
+    configure_simulation();
+
+    ESP_ERROR_CHECK(sensor_service_start());
+#if CONFIG_RUNTIME_EVENT_LOOP
+    ESP_ERROR_CHECK(runtime_start());
+#endif
+
+    uint32_t next_seq = sensor_ring_head_seq();
+    uint32_t faults_seen = fault_count();
+    int64_t end_us = esp_timer_get_time() + (int64_t)CONFIG_HOST_SIM_DURATION_S * 1000000;
+
+    while (esp_timer_get_time() < end_us) {
+        if (!sensor_ring_wait(pdMS_TO_TICKS(1000))) continue;
+
+        sensor_data_t samples[HOST_READ_BATCH];
+        uint32_t first_seq = next_seq;
+        size_t count = sensor_ring_read_since(&next_seq, samples, HOST_READ_BATCH);
+        uint32_t now_ms = xTaskGetTickCount() * portTICK_PERIOD_MS;
+        uint32_t faults = fault_count();
+
+        if (count > 0) {
+            results.gaps += samples[0].seq - first_seq;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            const sensor_data_t *data = &samples[i];
+            results.samples++;
+
+            uint32_t latency_ms = now_ms - data->timestamp_ms;
+            if (latency_ms > results.max_latency_ms) results.max_latency_ms = latency_ms;
+
+            ESP_LOGI(TAG, "seq %lu ts %lu: %d centi-degC %u centi-%%RH %lu ppm %lu ppb",
+                    (unsigned long)data->seq, (unsigned long)data->timestamp_ms, data->temperature_centi,
+                    data->humidity_centi, (unsigned long)data->eco2, (unsigned long)data->tvoc);
+
+            //Only the newest sample lines up with what the simulation last returned
+            if (i != count - 1) continue;
+            if (faults != faults_seen) {
+                results.faulted++;
+                continue;
+            }
+            results.checked++;
+            if (!sample_matches(data)) results.mismatched++;
+        }
+        faults_seen = faults;
+    }
+
+    i2c_sim_stats_t sht;
+    i2c_sim_stats_t sgp;
+    sensor_ring_stats_t ring;
+    i2c_sim_get_stats(I2C_SIM_SHT3X_ADDR, &sht);
+    i2c_sim_get_stats(I2C_SIM_SGP30_ADDR, &sgp);
+    sensor_ring_get_stats(&ring);
+
+    ESP_LOGI(TAG, "Samples %lu, checked %lu, faulted %lu, mismatched %lu, gaps %lu, max latency %lu ms",
+            (unsigned long)results.samples, (unsigned long)results.checked, (unsigned long)results.faulted,
+            (unsigned long)results.mismatched, (unsigned long)results.gaps, (unsigned long)results.max_latency_ms);
+    ESP_LOGI(TAG, "SHT3X: %lu transfers, %lu nacks, %lu early reads, %lu crc errors, %lu bad commands",
+            (unsigned long)sht.transfers, (unsigned long)sht.nacks, (unsigned long)sht.early_reads,
+            (unsigned long)sht.crc_errors, (unsigned long)sht.bad_commands);
+    ESP_LOGI(TAG, "SGP30: %lu transfers, %lu nacks, %lu early reads, %lu crc errors, %lu bad commands, humidity word 0x%04X",
+            (unsigned long)sgp.transfers, (unsigned long)sgp.nacks, (unsigned long)sgp.early_reads,
+            (unsigned long)sgp.crc_errors, (unsigned long)sgp.bad_commands, sgp.absolute_humidity);
+    ESP_LOGI(TAG, "Ring: %lu pushed, %lu overruns", (unsigned long)ring.pushed, (unsigned long)ring.overruns);
+
+    //Non zero exit status when the pipeline delivered wrong values, so the run can gate a CI job
+    exit(results.mismatched == 0 && results.samples > 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static esp_err_t init_nvs(void) {
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        err = nvs_flash_erase();
+        if (err != ESP_OK) return err;
+        err = nvs_flash_init();
+    }
+    return err;
+}
@@ -1,3 +1,4 @@
+#include "sdkconfig.h"
 #include "esp_err.h"
 #include "nvs_flash.h"
 #include "sensor_service.h"
@@ -5,8 +6,12 @@
 #include "wifi_service.h"
 #include "led_service.h"
 #include "ota_service.h"
+#if CONFIG_RUNTIME_EVENT_LOOP
+#include "runtime.h"
+#endif
 
 static esp_err_t init_nvs(void);
+static void network_up(void);
 
 void app_main(void)
 {
@@ -14,13 +19,32 @@ void app_main(void)
 
     ESP_ERROR_CHECK(led_service_init());
 
-    ESP_ERROR_CHECK(wifi_service_start());
-
-    ESP_ERROR_CHECK(ota_service_start());
-
+    //Sensing doesn't wait for the network, the SGP30 warms up and the first samples are taken while Wi-Fi associates
     ESP_ERROR_CHECK(sensor_service_start());
 
+    //The publisher holds samples until the client connects, which network_up() starts. The connect also
+    //registers the flush on restart, after Wi-Fi's own shutdown handler so the flush still has a link.
     ESP_ERROR_CHECK(mqtt_service_start());
+
+    ESP_ERROR_CHECK(wifi_service_start(network_up));
+
+#if CONFIG_RUNTIME_EVENT_LOOP
+    //The services only registered their handlers, nothing runs until the dispatcher starts
+    ESP_ERROR_CHECK(runtime_start());
+#endif
+}
+
+//Runs on the default event loop each time an IP address is obtained. The services that need the network start
+//on the first one, the MQTT client reconnects on its own after that.
+static void network_up(void) {
+    static bool ota_started = false;
+
+    ESP_ERROR_CHECK(mqtt_service_connect());
+
+    if (!ota_started) {
+        ESP_ERROR_CHECK(ota_service_start());
+        ota_started = true;
+    }
 }
 
 static esp_err_t init_nvs(void) {